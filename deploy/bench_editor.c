@@ -0,0 +1,180 @@
+// Line editor benchmark. Runs chefs_shell on a pseudo-terminal once with
+// readline and once with the native editor (CHEFS_EDITOR=native), types the
+// same keys into both and counts the bytes each writes back per keystroke,
+// which is what a web terminal sends over the wire. Also reports the time to
+// the first prompt and the shell's RSS there.
+//
+//   make -f deploy/Makefile bench-editor
+//   ./bench_editor [path/to/chefs_shell]     (default ./chefs_shell)
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each step is a group of keys; its bytes are summed over the group
+typedef struct {
+  const char* name;
+  const char* keys[48];
+} bench_step;
+
+#define LEFT "\033[D"
+#define RIGHT "\033[C"
+#define UP "\033[A"
+#define DOWN "\033[B"
+
+static const bench_step steps[] = {
+    {"type at end", {"e", "c", "h", "o", " ", "t", "h", "e", " ", "q", "u", "i", "c", "k", " ", "b", "r", "o", "w", "n",
+                     " ", "f", "o", "x", " ", "j", "u", "m", "p", "s"}},
+    {"cursor left/right", {LEFT, LEFT, LEFT, LEFT, LEFT, LEFT, RIGHT, RIGHT, LEFT, LEFT}},
+    {"insert mid-line", {"v", "e", "r", "y", " "}},
+    {"delete mid-line", {"\177", "\177", "\177", "\177", "\177", "\033[3~", "\033[3~"}},
+    {"home/end", {"\001", "\005", "\001", "\005"}},
+    {"kill line", {"\025"}},
+    {"history up/down", {UP, UP, DOWN, DOWN}},
+    {"complete", {"e", "c", "h", "\t", "/", "u", "s", "r", "/", "l", "i", "\t", "\t"}},
+    {"kill line", {"\025"}},
+};
+
+#define NSTEPS (sizeof(steps) / sizeof(steps[0]))
+
+typedef struct {
+  size_t bytes[NSTEPS];
+  size_t keys[NSTEPS];
+  double startup_ms;
+  long rss_kb;
+} bench_result;
+
+double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Read until the shell has been quiet for quiet_ms; returns the bytes read.
+// If want is set, first wait (up to 5s) for it to appear, and note when it did.
+double want_seen_ms;
+
+size_t drain(int fd, int quiet_ms, const char* want) {
+  char buf[65536];
+  size_t total = 0;
+  char tail[64] = "";
+  double deadline = now_ms() + 5000;
+  for (;;) {
+    int waiting = want && !strstr(tail, want);
+    if (want && !waiting && want_seen_ms == 0) want_seen_ms = now_ms();
+    struct pollfd p = {fd, POLLIN, 0};
+    int timeout = waiting ? (int)(deadline - now_ms()) : quiet_ms;
+    if (timeout < 0 || poll(&p, 1, timeout) <= 0) break;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) break;
+    total += n;
+    // Keep the last bytes to look for want across reads
+    size_t keep = strlen(tail);
+    size_t add = (size_t)n < sizeof(tail) - 1 ? (size_t)n : sizeof(tail) - 1;
+    if (keep + add > sizeof(tail) - 1) {
+      memmove(tail, tail + keep + add - (sizeof(tail) - 1), sizeof(tail) - 1 - add);
+      keep = sizeof(tail) - 1 - add;
+    }
+    memcpy(tail + keep, buf + n - add, add);
+    tail[keep + add] = '\0';
+  }
+  return total;
+}
+
+long rss_kb(pid_t pid) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE* f = fopen(path, "r");
+  long kb = -1;
+  if (!f) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+int run(const char* shell, const char* editor, const char* histfile, bench_result* r) {
+  struct winsize ws = {24, 80, 0, 0};
+  int fd;
+  double start = now_ms();
+  pid_t pid = forkpty(&fd, NULL, NULL, &ws);
+  if (pid < 0) {
+    perror("forkpty");
+    return -1;
+  }
+  if (pid == 0) {
+    setenv("CHEFS_EDITOR", editor, 1);
+    setenv("HISTFILE", histfile, 1);
+    setenv("TERM", "xterm-256color", 1);
+    setenv("CHEFS_LAZY_HISTORY", "0", 1);
+    execl(shell, shell, (char*)NULL);
+    _exit(127);
+  }
+
+  want_seen_ms = 0;
+  drain(fd, 200, "$ ");
+  r->startup_ms = want_seen_ms - start;
+  r->rss_kb = rss_kb(pid);
+
+  for (size_t s = 0; s < NSTEPS; s++) {
+    r->bytes[s] = r->keys[s] = 0;
+    for (size_t k = 0; steps[s].keys[k]; k++) {
+      if (write(fd, steps[s].keys[k], strlen(steps[s].keys[k])) < 0) break;
+      r->bytes[s] += drain(fd, 60, NULL);
+      r->keys[s]++;
+    }
+  }
+
+  if (write(fd, "exit\r", 5) < 0) {
+  }
+  drain(fd, 200, NULL);
+  close(fd);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  const char* shell = argc > 1 ? argv[1] : "./chefs_shell";
+  char histfile[] = "/tmp/bench_editor_XXXXXX";
+  int hfd = mkstemp(histfile);
+  if (hfd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  static const char history[] = "echo first entry\nls -la /usr/share\n";
+  if (write(hfd, history, sizeof(history) - 1) < 0) perror("write");
+  close(hfd);
+
+  bench_result rl, native;
+  if (run(shell, "readline", histfile, &rl) < 0 || run(shell, "native", histfile, &native) < 0) {
+    unlink(histfile);
+    return 1;
+  }
+  unlink(histfile);
+
+  printf("bytes written per keystroke, %s on an 80x24 pty\n\n", shell);
+  printf("%-18s %5s %10s %8s %10s %8s\n", "step", "keys", "readline", "per key", "native", "per key");
+  size_t total_rl = 0, total_native = 0, total_keys = 0;
+  for (size_t s = 0; s < NSTEPS; s++) {
+    printf("%-18s %5zu %10zu %8.1f %10zu %8.1f\n", steps[s].name, rl.keys[s], rl.bytes[s],
+           (double)rl.bytes[s] / rl.keys[s], native.bytes[s], (double)native.bytes[s] / native.keys[s]);
+    total_rl += rl.bytes[s];
+    total_native += native.bytes[s];
+    total_keys += rl.keys[s];
+  }
+  printf("%-18s %5zu %10zu %8.1f %10zu %8.1f\n\n", "total", total_keys, total_rl, (double)total_rl / total_keys,
+         total_native, (double)total_native / total_keys);
+  printf("%-18s %16.1f %19.1f\n", "first prompt ms", rl.startup_ms, native.startup_ms);
+  printf("%-18s %16ld %19ld\n", "RSS at prompt KB", rl.rss_kb, native.rss_kb);
+  return 0;
+}
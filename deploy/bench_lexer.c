@@ -0,0 +1,117 @@
+// Lexer microbenchmark. Generates a large script of typical command lines and
+// tokenizes it with each version of the lexer's character index (scalar, SSE2,
+// AVX2), then parses it fully, and reports the best time of several runs. The
+// index column is the bitmap pass alone; lex includes it.
+//
+//   make -f deploy/Makefile bench-lexer
+//   ./bench_lexer [megabytes] [runs]     (defaults: 16 MB, best of 5)
+//
+// libchefs is compiled in here, so the benchmark can reach its internals.
+
+#include "../src/chefs.c"
+
+static const char* bench_lines[] = {
+    "gcc -Wall -Wextra -O2 -I/usr/local/include/project_headers -o build/output src/module.c\n",
+    "curl --silent --location https://example.com/api/v1/resources/items?page=2 | grep -c id\n",
+    "PROJECT_ROOT=/home/developer/workspace/project_name ./scripts/configure_environment.sh\n",
+    "cp /var/lib/application/data/archive.tar.gz /mnt/backup/storage/archive.tar.gz && echo ok\n",
+    "if [ -f \"$HOME/.config/app/settings.conf\" ]; then echo 'settings found'; fi\n",
+    "for f in src/*.c; do wc -l \"$f\" >> line_counts.txt 2>&1; done\n",
+};
+
+size_t index_only(const char* src) {
+  free(index_specials(src, strlen(src)));
+  return 1;
+}
+
+// Tokens in src, lexed with the current special_mask
+size_t lex_all(const char* src) {
+  arena a = {0};
+  parser p = {0};
+  p.src = src;
+  p.arena = &a;
+  uint64_t* special = index_specials(src, p.src_len = strlen(src));
+  p.special = special;
+  size_t tokens = 0;
+  for (lex_next(&p); p.tok.type != TOK_EOF; lex_next(&p)) tokens++;
+  free(special);
+  return tokens;
+}
+
+size_t parse_all_nodes(const char* src) {
+  program prog;
+  parse_program(src, &prog);
+  size_t ok = prog.root != NULL;
+  arena_free(&prog.arena);
+  return ok;
+}
+
+double elapsed_ms(const struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+double best_ms(size_t (*run)(const char*), const char* src, int runs, size_t* result) {
+  double best = 0;
+  for (int r = 0; r < runs; r++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *result = run(src);
+    double ms = elapsed_ms(&start);
+    if (r == 0 || ms < best) best = ms;
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+  size_t size = megabytes << 20;
+  size_t nlines = sizeof(bench_lines) / sizeof(bench_lines[0]);
+
+  // Wrapped in a function definition, so the whole text is one command
+  char* src = malloc(size + 256);
+  size_t len = 0;
+  memcpy(src, "bench() {\n", 10);
+  len = 10;
+  for (size_t k = 0; len < size; k = (k + 1) % nlines) {
+    size_t n = strlen(bench_lines[k]);
+    memcpy(src + len, bench_lines[k], n);
+    len += n;
+  }
+  memcpy(src + len, "}\n", 3);
+  len += 2;
+
+  printf("%.1f MB, best of %d runs\n\n", len / 1048576.0, runs);
+  printf("%-8s %10s %9s %9s %9s %9s %9s %9s\n", "version", "tokens", "index ms", "speedup",
+         "lex ms", "speedup", "parse ms", "speedup");
+  static const char* versions[] = {"scalar", "sse2", "avx2"};
+  double scalar_index = 0;
+  double scalar_lex = 0;
+  double scalar_parse = 0;
+  for (size_t v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+    if (set_lexer(versions[v]) != 0) {
+      printf("%-8s %10s\n", versions[v], "unsupported");
+      continue;
+    }
+    size_t tokens = 0;
+    size_t parsed = 0;
+    double index = best_ms(index_only, src, runs, &parsed);
+    double lex = best_ms(lex_all, src, runs, &tokens);
+    double parse = best_ms(parse_all_nodes, src, runs, &parsed);
+    if (!parsed) {
+      fprintf(stderr, "bench_lexer: the generated script did not parse\n");
+      return 1;
+    }
+    if (v == 0) {
+      scalar_index = index;
+      scalar_lex = lex;
+      scalar_parse = parse;
+    }
+    printf("%-8s %10zu %9.1f %8.2fx %9.1f %8.2fx %9.1f %8.2fx\n", versions[v], tokens, index,
+           scalar_index / index, lex, scalar_lex / lex, parse, scalar_parse / parse);
+  }
+  free(src);
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Pipeline placement benchmark. Runs the same pipelines through chefs_shell
+// with CHEFS_PIPELINE_AFFINITY unset and set to each policy, taking the
+// policies in turn so they see the same machine, and reports the median wall
+// time of each with the CPU time and context switches of that run.
+//
+//   make -f deploy/Makefile bench-pipeline
+//   ./bench_pipeline [path/to/chefs_shell] [runs]     (default ./chefs_shell, 5)
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DATA_MB 32
+#define MAX_RUNS 31
+
+typedef struct {
+  const char* name;
+  const char* script;  // %s is the data directory
+} workload;
+
+static const workload workloads[] = {
+    {"cat x4", "cat %s/words.txt | cat | cat | cat > /dev/null\n"},
+    {"zcat|grep|sort", "zcat %s/words.gz | grep -v 7 | sort | wc -l > /dev/null\n"},
+    {"tr|sort|uniq", "tr ' ' '\\n' < %s/words.txt | sort | uniq -c | sort -rn | head -n 1 > /dev/null\n"},
+};
+
+static const char* policies[] = {NULL, "compact", "spread", "numa"};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+typedef struct {
+  double wall_ms;
+  double cpu_ms;
+  long switches;
+} sample;
+
+double now_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// DATA_MB of lines of pseudo-random words, and the same gzipped
+int make_data(const char* dir) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/words.txt", dir);
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  uint64_t x = 88172645463325252ULL;
+  size_t written = 0;
+  while (written < (size_t)DATA_MB << 20) {
+    char line[128];
+    int len = 0;
+    for (int w = 0; w < 8; w++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      len += snprintf(line + len, sizeof(line) - len, w ? " w%u" : "w%u", (unsigned)(x % 50000));
+    }
+    line[len++] = '\n';
+    fwrite(line, 1, len, f);
+    written += len;
+  }
+  fclose(f);
+
+  char cmd[600];
+  snprintf(cmd, sizeof(cmd), "gzip -1 -c %s/words.txt > %s/words.gz", dir, dir);
+  if (system(cmd) != 0) {
+    fprintf(stderr, "bench_pipeline: gzip failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+int run(const char* shell, const char* script, const char* policy, sample* s) {
+  double start = now_ms();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    if (policy) {
+      setenv("CHEFS_PIPELINE_AFFINITY", policy, 1);
+    } else {
+      unsetenv("CHEFS_PIPELINE_AFFINITY");
+    }
+    execl(shell, shell, script, (char*)NULL);
+    _exit(127);
+  }
+  int wstatus;
+  struct rusage ru;
+  if (wait4(pid, &wstatus, 0, &ru) < 0) return -1;
+  s->wall_ms = now_ms() - start;
+  // The shell reaps its stages, so their usage is in the shell's
+  s->cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 + ru.ru_stime.tv_sec * 1e3 +
+              ru.ru_stime.tv_usec / 1e3;
+  s->switches = ru.ru_nvcsw + ru.ru_nivcsw;
+  return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 ? 0 : -1;
+}
+
+int compare_wall(const void* a, const void* b) {
+  double x = ((const sample*)a)->wall_ms, y = ((const sample*)b)->wall_ms;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+  const char* shell = argc > 1 ? argv[1] : "./chefs_shell";
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+  if (runs < 1 || runs > MAX_RUNS) runs = 5;
+
+  char dir[] = "/tmp/bench_pipeline_XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  int failed = make_data(dir) < 0;
+
+  static sample samples[NWORKLOADS][NPOLICIES][MAX_RUNS];
+  char script[NWORKLOADS][300];
+  for (size_t w = 0; w < NWORKLOADS && !failed; w++) {
+    snprintf(script[w], sizeof(script[w]), "%s/w%zu.sh", dir, w);
+    FILE* f = fopen(script[w], "w");
+    if (!f) {
+      perror(script[w]);
+      failed = 1;
+      break;
+    }
+    fprintf(f, workloads[w].script, dir);
+    fclose(f);
+    // One untimed run to warm the page cache
+    sample warm;
+    if (run(shell, script[w], NULL, &warm) < 0) {
+      fprintf(stderr, "bench_pipeline: %s failed\n", workloads[w].name);
+      failed = 1;
+    }
+    for (int r = 0; r < runs && !failed; r++) {
+      for (size_t p = 0; p < NPOLICIES; p++) {
+        if (run(shell, script[w], policies[p], &samples[w][p][r]) < 0) failed = 1;
+      }
+    }
+  }
+
+  char cmd[300];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  if (system(cmd) != 0) fprintf(stderr, "bench_pipeline: could not remove %s\n", dir);
+  if (failed) return 1;
+
+  cpu_set_t allowed;
+  int cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 0;
+  printf("pipeline stage placement, %s, %d MB of text, median of %d runs, %d CPUs\n\n", shell, DATA_MB, runs, cpus);
+  printf("%-16s %-9s %10s %10s %10s %8s\n", "workload", "policy", "wall ms", "vs none", "cpu ms", "ctx sw");
+  for (size_t w = 0; w < NWORKLOADS; w++) {
+    double base = 0;
+    for (size_t p = 0; p < NPOLICIES; p++) {
+      qsort(samples[w][p], runs, sizeof(sample), compare_wall);
+      sample* median = &samples[w][p][runs / 2];
+      if (p == 0) base = median->wall_ms;
+      printf("%-16s %-9s %10.1f %9.1f%% %10.1f %8ld\n", p == 0 ? workloads[w].name : "",
+             policies[p] ? policies[p] : "(none)", median->wall_ms, (median->wall_ms / base - 1) * 100,
+             median->cpu_ms, median->switches);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Builds the web terminal's static files into dist/ so the page needs nothing
+// from outside the server. The xterm.js files are copied out of node_modules
+// under content-hashed names, index.html is rewritten to point at them, and
+// every file gets .gz and .br siblings that server.js sends as they are.
+// Hashed files never change, so they can be cached forever; index.html is
+// the only file a browser has to revalidate.
+//
+//   node build-assets.js          (also run by npm install, and by server.js
+//                                  when dist/ is missing or out of date)
+
+const crypto = require("crypto");
+const fs = require("fs");
+const path = require("path");
+const zlib = require("zlib");
+
+const PUBLIC_DIR = path.join(__dirname, "public");
+const DIST_DIR = path.join(__dirname, "dist");
+const MANIFEST = path.join(DIST_DIR, "manifest.json");
+
+// index.html refers to each of these by its /vendor/ name
+const VENDOR = [
+  { ref: "/vendor/xterm.css", file: "xterm/css/xterm.css" },
+  { ref: "/vendor/xterm.js", file: "xterm/lib/xterm.js" },
+  { ref: "/vendor/xterm-addon-fit.js", file: "xterm-addon-fit/lib/xterm-addon-fit.js" },
+  { ref: "/vendor/xterm-addon-web-links.js", file: "xterm-addon-web-links/lib/xterm-addon-web-links.js" },
+];
+
+function vendorPath(file) {
+  return require.resolve(file, { paths: [__dirname] });
+}
+
+// Everything the output depends on, with sizes and mtimes to spot changes
+function inputs() {
+  const files = [path.join(PUBLIC_DIR, "index.html"), __filename, ...VENDOR.map((v) => vendorPath(v.file))];
+  return files.map((file) => {
+    const st = fs.statSync(file);
+    return { file: path.relative(__dirname, file), size: st.size, mtimeMs: st.mtimeMs };
+  });
+}
+
+function isStale() {
+  try {
+    const manifest = JSON.parse(fs.readFileSync(MANIFEST, "utf8"));
+    return JSON.stringify(manifest.inputs) !== JSON.stringify(inputs());
+  } catch (err) {
+    return true;
+  }
+}
+
+// Write data to file, and its precompressed forms next to it
+function writeCompressed(file, data) {
+  fs.writeFileSync(file, data);
+  fs.writeFileSync(`${file}.gz`, zlib.gzipSync(data, { level: zlib.constants.Z_BEST_COMPRESSION }));
+  fs.writeFileSync(
+    `${file}.br`,
+    zlib.brotliCompressSync(data, {
+      params: {
+        [zlib.constants.BROTLI_PARAM_QUALITY]: zlib.constants.BROTLI_MAX_QUALITY,
+        [zlib.constants.BROTLI_PARAM_SIZE_HINT]: data.length,
+      },
+    })
+  );
+}
+
+function build() {
+  const tmp = `${DIST_DIR}.tmp-${process.pid}`;
+  fs.rmSync(tmp, { recursive: true, force: true });
+  fs.mkdirSync(path.join(tmp, "assets"), { recursive: true });
+
+  const built = inputs();
+  const urls = {};
+
+  for (const v of VENDOR) {
+    // The source maps are not shipped, so drop the comment pointing at them
+    const text = fs.readFileSync(vendorPath(v.file), "utf8").replace(/\n\/[/*]# sourceMappingURL=.*$/m, "\n");
+    const data = Buffer.from(text);
+    const hash = crypto.createHash("sha256").update(data).digest("hex").slice(0, 12);
+    const ext = path.extname(v.file);
+    const name = `assets/${path.basename(v.file, ext)}.${hash}${ext}`;
+    writeCompressed(path.join(tmp, name), data);
+    urls[v.ref] = `/${name}`;
+  }
+
+  let html = fs.readFileSync(path.join(PUBLIC_DIR, "index.html"), "utf8");
+  for (const [ref, url] of Object.entries(urls)) html = html.split(`"${ref}"`).join(`"${url}"`);
+  const missing = html.match(/"\/vendor\/[^"]*"/);
+  if (missing) throw new Error(`index.html refers to ${missing[0]}, which is not vendored`);
+  writeCompressed(path.join(tmp, "index.html"), Buffer.from(html));
+
+  fs.writeFileSync(path.join(tmp, "manifest.json"), JSON.stringify({ inputs: built, urls }, null, 2) + "\n");
+  // Swap the whole directory in, so a running server never sees half of it
+  const old = `${DIST_DIR}.old-${process.pid}`;
+  if (fs.existsSync(DIST_DIR)) fs.renameSync(DIST_DIR, old);
+  fs.renameSync(tmp, DIST_DIR);
+  fs.rmSync(old, { recursive: true, force: true });
+  return urls;
+}
+
+function buildIfStale() {
+  if (isStale()) build();
+}
+
+module.exports = { DIST_DIR, build, buildIfStale };
+
+if (require.main === module) {
+  const urls = build();
+  for (const [ref, url] of Object.entries(urls)) console.log(`${ref} -> ${url}`);
+}
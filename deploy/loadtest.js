@@ -0,0 +1,361 @@
+// Load generator for the web terminal gateway.
+// Opens N WebSocket sessions against a local server.js, types scripted commands like a
+// real user and reports keystroke-to-echo latency, connect-to-prompt time and the
+// CPU/RSS of the server process tree for every step of N.
+//
+//   node loadtest.js --steps 1,10,50,100 --duration 15
+//   node loadtest.js --url ws://127.0.0.1:3000 --pid 1234 --steps 20 --json
+//
+// Everything runs on localhost; non-loopback targets are refused.
+
+const WebSocket = require("ws");
+const { spawn, execSync } = require("child_process");
+const fs = require("fs");
+const http = require("http");
+const path = require("path");
+
+// Commands each virtual user types, one key at a time. "\t" presses Tab.
+const DEFAULT_SCRIPT = [
+  "help",
+  "pwd",
+  "ls",
+  "echo hello world | cat",
+  "ls -la | grep json | wc -l",
+  "fetc\t",
+  "type ls",
+  "history 5",
+];
+
+function parseArgs(argv) {
+  const opts = {
+    url: null,
+    pid: null,
+    port: 3900,
+    steps: [1, 5, 10, 25],
+    duration: 10,
+    thinkMs: 40,
+    timeoutMs: 5000,
+    script: DEFAULT_SCRIPT,
+    json: false,
+    maxEchoP99: null,
+    maxConnectP99: null,
+  };
+
+  for (let i = 2; i < argv.length; i++) {
+    const arg = argv[i];
+    const next = () => argv[++i];
+    if (arg === "--url") opts.url = next();
+    else if (arg === "--pid") opts.pid = parseInt(next(), 10);
+    else if (arg === "--port") opts.port = parseInt(next(), 10);
+    else if (arg === "--steps") opts.steps = next().split(",").map((n) => parseInt(n, 10));
+    else if (arg === "--duration") opts.duration = parseFloat(next());
+    else if (arg === "--think") opts.thinkMs = parseFloat(next());
+    else if (arg === "--timeout") opts.timeoutMs = parseFloat(next());
+    else if (arg === "--script") {
+      opts.script = fs
+        .readFileSync(next(), "utf8")
+        .split("\n")
+        .filter((l) => l.length > 0)
+        .map((l) => l.replace(/\\t/g, "\t"));
+    } else if (arg === "--json") opts.json = true;
+    else if (arg === "--max-echo-p99") opts.maxEchoP99 = parseFloat(next());
+    else if (arg === "--max-connect-p99") opts.maxConnectP99 = parseFloat(next());
+    else {
+      console.error(`Unknown option: ${arg}`);
+      process.exit(2);
+    }
+  }
+  return opts;
+}
+
+function assertLocal(url) {
+  const host = new URL(url).hostname;
+  if (!["127.0.0.1", "localhost", "::1", "[::1]"].includes(host)) {
+    console.error(`Refusing to load-test non-local host: ${host}`);
+    process.exit(2);
+  }
+}
+
+const ANSI = /\x1b\[[0-9;?]*[A-Za-z]|\x1b[()][A-Za-z0-9]|\x1b[=>]|\x07/g;
+const stripAnsi = (s) => s.replace(ANSI, "");
+const now = () => Number(process.hrtime.bigint()) / 1e6;
+const sleep = (ms) => new Promise((r) => setTimeout(r, ms));
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) return NaN;
+  const rank = Math.ceil((p / 100) * sorted.length) - 1;
+  return sorted[Math.min(sorted.length - 1, Math.max(0, rank))];
+}
+
+function summarize(samples) {
+  const sorted = [...samples].sort((a, b) => a - b);
+  return {
+    count: sorted.length,
+    p50: percentile(sorted, 50),
+    p95: percentile(sorted, 95),
+    p99: percentile(sorted, 99),
+    max: sorted.length ? sorted[sorted.length - 1] : NaN,
+  };
+}
+
+// One simulated browser tab.
+class VirtualUser {
+  constructor(url, opts, stats) {
+    this.url = url;
+    this.opts = opts;
+    this.stats = stats;
+    this.buffer = "";
+    this.waiter = null;
+  }
+
+  // Resolves once the accumulated output satisfies pred, or rejects after the timeout.
+  waitFor(pred) {
+    return new Promise((resolve, reject) => {
+      if (pred(this.buffer)) return resolve();
+      const timer = setTimeout(() => {
+        this.waiter = null;
+        reject(new Error("timeout"));
+      }, this.opts.timeoutMs);
+      this.waiter = () => {
+        if (pred(this.buffer)) {
+          clearTimeout(timer);
+          this.waiter = null;
+          resolve();
+        }
+      };
+    });
+  }
+
+  connect() {
+    const start = now();
+    return new Promise((resolve, reject) => {
+      this.ws = new WebSocket(this.url);
+      this.ws.on("message", (data) => {
+        this.buffer += stripAnsi(data.toString());
+        if (this.waiter) this.waiter();
+      });
+      this.ws.on("error", reject);
+      this.ws.on("open", () => {
+        this.ws.send(JSON.stringify({ type: "resize", cols: 120, rows: 40 }));
+        this.waitFor((b) => b.endsWith("$ "))
+          .then(() => {
+            this.stats.connect.push(now() - start);
+            resolve();
+          })
+          .catch(reject);
+      });
+    });
+  }
+
+  async typeKey(key) {
+    this.buffer = "";
+    const sent = now();
+    this.ws.send(key);
+    // Tab may complete, list or just ring the bell: any output counts as the echo.
+    await this.waitFor((b) => (key === "\t" ? b.length > 0 : b.includes(key)));
+    this.stats.echo.push(now() - sent);
+  }
+
+  async runCommand(cmd) {
+    for (const key of cmd) {
+      await this.typeKey(key);
+      await sleep(this.opts.thinkMs);
+    }
+    this.buffer = "";
+    const sent = now();
+    this.ws.send("\r");
+    await this.waitFor((b) => b.endsWith("$ "));
+    this.stats.command.push(now() - sent);
+  }
+
+  async run(deadline) {
+    try {
+      await this.connect();
+      while (now() < deadline) {
+        for (const cmd of this.opts.script) {
+          if (now() >= deadline) break;
+          await this.runCommand(cmd);
+        }
+      }
+    } catch (err) {
+      this.stats.errors.push(err.message);
+    } finally {
+      if (this.ws) this.ws.close();
+    }
+  }
+}
+
+// CPU and RSS of a process and all of its descendants (node + every chefs_shell).
+const CLK_TCK = parseInt(execSync("getconf CLK_TCK").toString(), 10) || 100;
+const PAGE_SIZE = parseInt(execSync("getconf PAGESIZE").toString(), 10) || 4096;
+
+function processTree(root) {
+  const children = new Map();
+  for (const entry of fs.readdirSync("/proc")) {
+    if (!/^\d+$/.test(entry)) continue;
+    try {
+      const stat = fs.readFileSync(`/proc/${entry}/stat`, "utf8");
+      const ppid = parseInt(stat.slice(stat.lastIndexOf(")") + 2).split(" ")[1], 10);
+      if (!children.has(ppid)) children.set(ppid, []);
+      children.get(ppid).push(parseInt(entry, 10));
+    } catch (err) {
+      // Process exited while scanning
+    }
+  }
+  const pids = [root];
+  for (let i = 0; i < pids.length; i++) pids.push(...(children.get(pids[i]) || []));
+  return pids;
+}
+
+function sampleTree(root) {
+  let ticks = 0;
+  let rss = 0;
+  for (const pid of processTree(root)) {
+    try {
+      const stat = fs.readFileSync(`/proc/${pid}/stat`, "utf8");
+      const fields = stat.slice(stat.lastIndexOf(")") + 2).split(" ");
+      ticks += parseInt(fields[11], 10) + parseInt(fields[12], 10);  // utime + stime
+      rss += parseInt(fs.readFileSync(`/proc/${pid}/statm`, "utf8").split(" ")[1], 10) * PAGE_SIZE;
+    } catch (err) {
+      // Process exited while sampling
+    }
+  }
+  return { ticks, rss };
+}
+
+function startSampler(pid) {
+  const result = { cpuPct: [], rss: [] };
+  if (!pid) return { stop: () => result };
+  let last = { ...sampleTree(pid), at: now() };
+  const timer = setInterval(() => {
+    const cur = { ...sampleTree(pid), at: now() };
+    const cpuSec = (cur.ticks - last.ticks) / CLK_TCK;
+    result.cpuPct.push((100 * cpuSec) / ((cur.at - last.at) / 1000));
+    result.rss.push(cur.rss);
+    last = cur;
+  }, 500);
+  return {
+    stop: () => {
+      clearInterval(timer);
+      return result;
+    },
+  };
+}
+
+async function runStep(url, opts, users, pid) {
+  const stats = { connect: [], echo: [], command: [], errors: [] };
+  const sampler = startSampler(pid);
+  const deadline = now() + opts.duration * 1000;
+  await Promise.all(
+    Array.from({ length: users }, () => new VirtualUser(url, opts, stats).run(deadline))
+  );
+  const usage = sampler.stop();
+  const avg = (a) => (a.length ? a.reduce((x, y) => x + y, 0) / a.length : NaN);
+  return {
+    users,
+    connect: summarize(stats.connect),
+    echo: summarize(stats.echo),
+    command: summarize(stats.command),
+    errors: stats.errors.length,
+    cpuAvgPct: avg(usage.cpuPct),
+    cpuMaxPct: usage.cpuPct.length ? Math.max(...usage.cpuPct) : NaN,
+    rssMaxMB: usage.rss.length ? Math.max(...usage.rss) / (1024 * 1024) : NaN,
+  };
+}
+
+function waitForServer(port) {
+  const deadline = now() + 15000;
+  return new Promise((resolve, reject) => {
+    const poll = () => {
+      http
+        .get(`http://127.0.0.1:${port}/`, (res) => {
+          res.resume();
+          resolve();
+        })
+        .on("error", () => {
+          if (now() > deadline) reject(new Error("server did not start"));
+          else setTimeout(poll, 100);
+        });
+    };
+    poll();
+  });
+}
+
+function printRow(r) {
+  const f = (v) => (Number.isFinite(v) ? v.toFixed(1) : "-");
+  console.log(
+    [
+      String(r.users).padStart(5),
+      f(r.connect.p50).padStart(9),
+      f(r.connect.p99).padStart(9),
+      f(r.echo.p50).padStart(8),
+      f(r.echo.p95).padStart(8),
+      f(r.echo.p99).padStart(8),
+      f(r.echo.max).padStart(8),
+      f(r.command.p99).padStart(9),
+      f(r.cpuAvgPct).padStart(7),
+      f(r.rssMaxMB).padStart(8),
+      String(r.errors).padStart(6),
+    ].join(" ")
+  );
+}
+
+async function main() {
+  const opts = parseArgs(process.argv);
+  let server = null;
+  let url = opts.url;
+  let pid = opts.pid;
+
+  // Without --url, start our own server.js bound to a local port. It is
+  // stopped however the run ends, including on Ctrl-C or a failed step.
+  if (!url) {
+    server = spawn(process.execPath, [path.join(__dirname, "server.js")], {
+      env: { ...process.env, PORT: String(opts.port) },
+      stdio: "ignore",
+    });
+    pid = server.pid;
+    url = `ws://127.0.0.1:${opts.port}`;
+    for (const signal of ["SIGINT", "SIGTERM"]) {
+      process.on(signal, () => {
+        server.kill();
+        process.exit(1);
+      });
+    }
+  }
+
+  const results = [];
+  try {
+    if (server) await waitForServer(opts.port);
+    assertLocal(url);
+
+    if (!opts.json) {
+      console.log(`Load test against ${url} (${opts.duration}s per step)\n`);
+      console.log(
+        "users  conn_p50  conn_p99  echo_p50 echo_p95 echo_p99 echo_max   cmd_p99   cpu%   rss_MB errors"
+      );
+    }
+    for (const users of opts.steps) {
+      const r = await runStep(url, opts, users, pid);
+      results.push(r);
+      if (!opts.json) printRow(r);
+    }
+  } finally {
+    if (server) server.kill();
+  }
+
+  if (opts.json) console.log(JSON.stringify(results, null, 2));
+
+  // Deploy gate: non-zero exit when any step breaks the latency budget or drops sessions.
+  const failed = results.some(
+    (r) =>
+      r.errors > 0 ||
+      (opts.maxEchoP99 !== null && r.echo.p99 > opts.maxEchoP99) ||
+      (opts.maxConnectP99 !== null && r.connect.p99 > opts.maxConnectP99)
+  );
+  process.exit(failed ? 1 : 0);
+}
+
+main().catch((err) => {
+  console.error("Load test failed:", err.message);
+  process.exit(1);
+});
@@ -4,6 +4,8 @@ const WebSocket = require("ws");
 const pty = require("node-pty");
 const path = require("path");
 const fs = require("fs");
+const crypto = require("crypto");
+const { DIST_DIR, buildIfStale } = require("./build-assets");
 
 const app = express();
 const server = http.createServer(app);
@@ -11,8 +13,69 @@ const wss = new WebSocket.Server({ server });
 
 const PORT = process.env.PORT || 3000;
 
-// Serve static files (HTML, JS, CSS)
-app.use(express.static(path.join(__dirname, "public")));
+// Static files come from dist/, which build-assets.js fills: index.html and
+// the xterm.js files under content-hashed names, each with .br and .gz
+// versions. They are read into memory once and sent in the best encoding the
+// browser accepts. Hashed files are cached for good; index.html is revalidated.
+const CONTENT_TYPES = {
+  ".html": "text/html; charset=utf-8",
+  ".js": "application/javascript; charset=utf-8",
+  ".css": "text/css; charset=utf-8",
+};
+
+function loadAsset(file, cacheControl) {
+  const identity = fs.readFileSync(file);
+  const bodies = { identity };
+  for (const [encoding, suffix] of [["br", ".br"], ["gzip", ".gz"]]) {
+    const body = fs.readFileSync(file + suffix);
+    if (body.length < identity.length) bodies[encoding] = body;
+  }
+  const etag = crypto.createHash("sha256").update(identity).digest("base64url").slice(0, 16);
+  return { type: CONTENT_TYPES[path.extname(file)], cacheControl, etag, bodies };
+}
+
+function loadAssets() {
+  const assets = new Map();
+  const index = loadAsset(path.join(DIST_DIR, "index.html"), "no-cache");
+  assets.set("/", index);
+  assets.set("/index.html", index);
+  for (const name of fs.readdirSync(path.join(DIST_DIR, "assets"))) {
+    if (name.endsWith(".br") || name.endsWith(".gz")) continue;
+    assets.set(`/assets/${name}`, loadAsset(path.join(DIST_DIR, "assets", name), "public, max-age=31536000, immutable"));
+  }
+  return assets;
+}
+
+try {
+  buildIfStale();
+} catch (err) {
+  if (!fs.existsSync(path.join(DIST_DIR, "manifest.json"))) {
+    console.error(` Could not build the web assets: ${err.message}`);
+    console.error("Please install the dependencies first by running: npm install");
+    process.exit(1);
+  }
+  console.error(` Could not rebuild the web assets, serving the last build: ${err.message}`);
+}
+const assets = loadAssets();
+
+app.use((req, res, next) => {
+  const asset = assets.get(req.path);
+  if (!asset || (req.method !== "GET" && req.method !== "HEAD")) return next();
+  let encoding = "identity";
+  if (asset.bodies.br && req.acceptsEncodings("br")) encoding = "br";
+  else if (asset.bodies.gzip && req.acceptsEncodings("gzip")) encoding = "gzip";
+  res.set({
+    "Content-Type": asset.type,
+    "Cache-Control": asset.cacheControl,
+    Vary: "Accept-Encoding",
+    ETag: `"${asset.etag}-${encoding}"`,
+  });
+  if (encoding !== "identity") res.set("Content-Encoding", encoding);
+  res.send(asset.bodies[encoding]);  // answers HEAD and a matching If-None-Match too
+});
+
+// Anything else under public/
+app.use(express.static(path.join(__dirname, "public"), { index: false }));
 
 // Serve resume from root directory
 app.get('/yogesh_rana_resume.pdf', (req, res) => {
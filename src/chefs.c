@@ -0,0 +1,7211 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chefs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// builtin commands, sorted by name; the table itself is defined after the builtins
+typedef struct {
+  const char* name;
+  int (*run)(char* args[]);
+  int pure;  // leaves the shell's state alone, so $(...) may run it without forking
+} builtin_command;
+
+// Memory accounting for `memstat`. The long-lived structures allocate through
+// these wrappers, which count the usable size of every block against a
+// subsystem. Short-lived scratch buffers use malloc directly and show up only
+// in the heap total. The prefetch thread allocates too, hence the atomics.
+enum { MEM_PARSE, MEM_EXPAND, MEM_HISTORY, MEM_VARIABLES, MEM_FUNCTIONS, MEM_CACHES, MEM_IO, MEM_SUBSYSTEMS };
+
+static const char* mem_names[MEM_SUBSYSTEMS] = {"parse", "expand", "history", "variables", "functions", "caches", "io"};
+
+typedef struct {
+  size_t bytes;   // heap bytes held now
+  size_t peak;    // most heap bytes held at once
+  size_t blocks;  // heap blocks held now
+  size_t mapped;  // file mappings held now
+} mem_counter;
+
+static mem_counter mem_counters[MEM_SUBSYSTEMS];
+
+static void mem_count(int sub, void* p, int sign) {
+  if (!p) return;
+  mem_counter* c = &mem_counters[sub];
+  size_t size = malloc_usable_size(p);
+  if (sign < 0) {
+    __atomic_sub_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->blocks, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  size_t now = __atomic_add_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->blocks, 1, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&c->peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void* mem_malloc(int sub, size_t size) {
+  void* p = malloc(size);
+  mem_count(sub, p, 1);
+  return p;
+}
+
+static void* mem_calloc(int sub, size_t n, size_t size) {
+  void* p = calloc(n, size);
+  mem_count(sub, p, 1);
+  return p;
+}
+
+static void* mem_realloc(int sub, void* old, size_t size) {
+  size_t old_size = old ? malloc_usable_size(old) : 0;
+  void* p = realloc(old, size);
+  if (!p) return NULL;
+  // Moved or resized in place: count the new size in place of the old
+  if (old) {
+    __atomic_sub_fetch(&mem_counters[sub].bytes, old_size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem_counters[sub].blocks, 1, __ATOMIC_RELAXED);
+  }
+  mem_count(sub, p, 1);
+  return p;
+}
+
+static char* mem_strdup(int sub, const char* s) {
+  char* p = strdup(s);
+  mem_count(sub, p, 1);
+  return p;
+}
+
+static void mem_free(int sub, void* p) {
+  mem_count(sub, p, -1);
+  free(p);
+}
+
+static void mem_map(int sub, long size) { __atomic_add_fetch(&mem_counters[sub].mapped, size, __ATOMIC_RELAXED); }
+
+// Front-end memory memstat reports alongside the library's (chefs_memory_source)
+#define MEM_SOURCES 8
+
+typedef struct {
+  const char* name;
+  size_t (*bytes)(void);
+} mem_source;
+
+static mem_source mem_sources[MEM_SOURCES];
+
+// Shell variables live in an open-addressing hash table; names that are not
+// set here fall back to the environment.
+typedef struct {
+  char* name;
+  char* value;
+} shell_var;
+
+static shell_var* shell_vars = NULL;
+static size_t shell_vars_cap = 0;
+static size_t shell_vars_count = 0;
+static int last_status = 0;  // $?
+
+// $PIPESTATUS: the status of every stage of the last pipeline
+static int* pipe_statuses = NULL;
+static int pipe_status_count = 0;
+static int pipe_status_cap = 0;
+
+static void set_pipe_status(const int* statuses, int count) {
+  if (count > pipe_status_cap) {
+    pipe_status_cap = count < 8 ? 8 : count;
+    pipe_statuses = mem_realloc(MEM_VARIABLES, pipe_statuses, pipe_status_cap * sizeof(int));
+  }
+  memcpy(pipe_statuses, statuses, count * sizeof(int));
+  pipe_status_count = count;
+}
+
+static size_t hash_name(const char* name, size_t len) {
+  size_t h = 1469598103934665603ULL;  // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static shell_var* find_var_slot(const char* name, size_t len) {
+  if (shell_vars_cap == 0) return NULL;
+  size_t i = hash_name(name, len) & (shell_vars_cap - 1);
+  while (shell_vars[i].name) {
+    if (strncmp(shell_vars[i].name, name, len) == 0 && shell_vars[i].name[len] == '\0') {
+      return &shell_vars[i];
+    }
+    i = (i + 1) & (shell_vars_cap - 1);
+  }
+  return &shell_vars[i];
+}
+
+static const char* get_var_n(const char* name, size_t len) {
+  shell_var* slot = find_var_slot(name, len);
+  if (slot && slot->name) return slot->value;
+
+  char key[256];
+  if (len >= sizeof(key)) return NULL;
+  memcpy(key, name, len);
+  key[len] = '\0';
+  return getenv(key);
+}
+
+static const char* get_var(const char* name) { return get_var_n(name, strlen(name)); }
+
+static void set_var(const char* name, const char* value) {
+  if ((shell_vars_count + 1) * 10 > shell_vars_cap * 7) {
+    size_t old_cap = shell_vars_cap;
+    shell_var* old = shell_vars;
+    shell_vars_cap = old_cap ? old_cap * 2 : 64;
+    shell_vars = mem_calloc(MEM_VARIABLES, shell_vars_cap, sizeof(shell_var));
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].name) *find_var_slot(old[i].name, strlen(old[i].name)) = old[i];
+    }
+    mem_free(MEM_VARIABLES, old);
+  }
+
+  shell_var* slot = find_var_slot(name, strlen(name));
+  if (slot->name) {
+    mem_free(MEM_VARIABLES, slot->value);
+  } else {
+    slot->name = mem_strdup(MEM_VARIABLES, name);
+    shell_vars_count++;
+  }
+  slot->value = mem_strdup(MEM_VARIABLES, value);
+}
+
+// Builtins print through this buffer instead of unbuffered stdout, so a command's
+// output leaves in a few large write()s. It is flushed at the end of every command,
+// before fork() and at exit; stdout itself stays unbuffered for readline.
+#define OUT_BUFFER_SIZE 65536
+
+typedef struct {
+  int fd;
+  char* data;
+  size_t len;
+  size_t cap;
+  int error;  // errno of the first write that failed since it was cleared
+} out_buffer;
+
+static char out_storage[OUT_BUFFER_SIZE];
+static out_buffer builtin_out = {STDOUT_FILENO, out_storage, 0, OUT_BUFFER_SIZE, 0};
+
+// -1 with errno set if a write fails
+static int write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;  // Reader went away, drop the output like stdio would
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// A buffer with fd OUT_CAPTURE collects $(...) output of in-process builtins:
+// it grows instead of flushing
+#define OUT_CAPTURE -1
+
+static void out_send(out_buffer* out, const char* data, size_t len) {
+  if (write_all(out->fd, data, len) < 0 && !out->error) out->error = errno;
+}
+
+static void out_flush(out_buffer* out) {
+  if (out->len == 0 || out->fd == OUT_CAPTURE) return;
+  out_send(out, out->data, out->len);
+  out->len = 0;
+}
+
+static void out_reserve(out_buffer* out, size_t len) {
+  if (len <= out->cap - out->len) return;
+  while (len > out->cap - out->len) out->cap *= 2;
+  out->data = mem_realloc(MEM_IO, out->data, out->cap);
+  if (!out->data) {
+    perror("realloc");
+    exit(1);
+  }
+}
+
+static void out_write(out_buffer* out, const char* data, size_t len) {
+  if (out->fd == OUT_CAPTURE) {
+    out_reserve(out, len);
+  } else if (len > out->cap - out->len) {
+    out_flush(out);
+    if (len >= out->cap) {
+      out_send(out, data, len);
+      return;
+    }
+  }
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static __attribute__((format(printf, 1, 2))) void out_printf(const char* fmt, ...) {
+  out_buffer* out = &builtin_out;
+  va_list ap;
+
+  va_start(ap, fmt);
+  int n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+
+  if ((size_t)n < out->cap - out->len) {
+    out->len += n;
+    return;
+  }
+
+  // Did not fit: make room and format again
+  if (out->fd == OUT_CAPTURE) {
+    out_reserve(out, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+    va_end(ap);
+    out->len += n;
+    return;
+  }
+  out_flush(out);
+  if ((size_t)n < out->cap) {
+    va_start(ap, fmt);
+    vsnprintf(out->data, out->cap, fmt, ap);
+    va_end(ap);
+    out->len = n;
+    return;
+  }
+
+  char* big = malloc(n + 1);
+  if (!big) return;
+  va_start(ap, fmt);
+  vsnprintf(big, n + 1, fmt, ap);
+  va_end(ap);
+  out_send(out, big, n);
+  free(big);
+}
+
+static void flush_builtin_output(void) { out_flush(&builtin_out); }
+
+// End a forked child. exit() would run the host program's atexit handlers and
+// flush its stdio buffers a second time, so only the builtins' output is flushed.
+static __attribute__((noreturn)) void child_exit(int status) {
+  out_flush(&builtin_out);
+  _exit(status);
+}
+
+// Builtin error messages go out immediately, after any pending output
+static int builtin_err_fd = STDERR_FILENO;
+
+static __attribute__((format(printf, 1, 2))) void err_printf(const char* fmt, ...) {
+  char msg[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if (n >= (int)sizeof(msg)) n = sizeof(msg) - 1;
+  out_flush(&builtin_out);
+  write_all(builtin_err_fd, msg, n);
+}
+
+// Input buffers for the read builtin, one per low fd. Seekable fds are read in
+// blocks and the unread tail is handed back with lseek() before anything else
+// touches the fd; a terminal returns at most one line per read() anyway; any
+// other fd (a pipe someone else may read) goes a byte at a time.
+#define READ_BUFFER_FDS 10
+#define READ_BUFFER_SIZE 4096
+
+enum { READ_MODE_UNKNOWN, READ_MODE_SEEKABLE, READ_MODE_LINE, READ_MODE_BYTE };
+
+typedef struct {
+  char data[READ_BUFFER_SIZE];
+  size_t pos;
+  size_t len;
+  int mode;
+} read_buffer;
+
+static read_buffer read_buffers[READ_BUFFER_FDS];
+
+// Returns the next byte of fd, -1 at EOF, -2 on error
+static int read_buffer_getc(int fd) {
+  if (fd < 0 || fd >= READ_BUFFER_FDS) {
+    unsigned char c;
+    ssize_t n = read(fd, &c, 1);
+    return n == 1 ? c : (n == 0 ? -1 : -2);
+  }
+
+  read_buffer* rb = &read_buffers[fd];
+  if (rb->pos < rb->len) return (unsigned char)rb->data[rb->pos++];
+
+  if (rb->mode == READ_MODE_UNKNOWN) {
+    if (lseek(fd, 0, SEEK_CUR) >= 0) {
+      rb->mode = READ_MODE_SEEKABLE;
+    } else if (isatty(fd)) {
+      rb->mode = READ_MODE_LINE;
+    } else {
+      rb->mode = READ_MODE_BYTE;
+    }
+  }
+
+  size_t want = rb->mode == READ_MODE_BYTE ? 1 : sizeof(rb->data);
+  ssize_t n;
+  do {
+    n = read(fd, rb->data, want);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return n == 0 ? -1 : -2;
+
+  rb->pos = 1;
+  rb->len = n;
+  return (unsigned char)rb->data[0];
+}
+
+// Give unread bytes back to the file before another reader (a child, an
+// in-process utility or readline) uses the fd
+static void sync_read_buffers(void) {
+  for (int fd = 0; fd < READ_BUFFER_FDS; fd++) {
+    read_buffer* rb = &read_buffers[fd];
+    if (rb->mode == READ_MODE_SEEKABLE && rb->pos < rb->len) {
+      lseek(fd, -(off_t)(rb->len - rb->pos), SEEK_CUR);
+    }
+    rb->pos = rb->len = 0;
+    rb->mode = READ_MODE_UNKNOWN;
+  }
+}
+
+// Command history. The text of every entry is packed, NUL-terminated, into one
+// buffer, oldest first, and entries[] keeps each one's offset, length and hash,
+// so the whole list is two allocations. $HISTSIZE caps the number of entries
+// (default 500, negative for no limit). $HISTCONTROL may list ignorespace,
+// ignoredups, ignoreboth and erasedups; duplicates are found by hash before any
+// text is compared. Text left behind by dropped or erased entries is reclaimed
+// by compacting the buffer once half of it is dead.
+#define HISTSIZE_DEFAULT 500
+
+typedef struct {
+  size_t off;
+  size_t len;
+  size_t hash;
+} hist_entry;
+
+typedef struct {
+  char* text;
+  size_t text_len;
+  size_t text_cap;
+  size_t text_dead;
+  hist_entry* entries;
+  size_t first;  // entries[first .. first + count) are live
+  size_t count;
+  size_t cap;
+  size_t unsaved;     // the newest entries not yet written to $HISTFILE
+  size_t unappended;  // the newest entries not yet written by history -a FILE
+} hist_list;
+
+static hist_list shell_history;
+
+// Told about every entry added at the end (line set) or removed (line NULL), so a
+// line editor can keep its own list in step
+static void (*hist_listener)(size_t index, const char* line) = NULL;
+
+static void* hist_realloc(void* p, size_t size) {
+  p = mem_realloc(MEM_HISTORY, p, size);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static const char* hist_line(size_t i) {
+  return shell_history.text + shell_history.entries[shell_history.first + i].off;
+}
+
+// $HISTSIZE or $HISTFILESIZE: fallback when unset or not a number, -1 for no limit
+static long hist_limit(const char* name, long fallback) {
+  const char* v = get_var(name);
+  if (v == NULL || *v == '\0') return fallback;
+  char* end;
+  long n = strtol(v, &end, 10);
+  if (*end != '\0') return fallback;
+  return n < 0 ? -1 : n;
+}
+
+// Is option listed in the colon-separated $HISTCONTROL?
+static int hist_control(const char* control, const char* option) {
+  size_t len = strlen(option);
+  while (control && *control) {
+    const char* end = strchrnul(control, ':');
+    if ((size_t)(end - control) == len && strncmp(control, option, len) == 0) return 1;
+    control = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+static void hist_compact(hist_list* h) {
+  size_t cap = h->text_len - h->text_dead;
+  cap = cap < 1024 ? 1024 : cap * 2;
+  char* text = mem_malloc(MEM_HISTORY, cap);
+  if (!text) return;
+  size_t len = 0;
+  for (size_t k = 0; k < h->count; k++) {
+    hist_entry* e = &h->entries[h->first + k];
+    memcpy(text + len, h->text + e->off, e->len + 1);
+    e->off = len;
+    len += e->len + 1;
+  }
+  mem_free(MEM_HISTORY, h->text);
+  h->text = text;
+  h->text_len = len;
+  h->text_cap = cap;
+  h->text_dead = 0;
+}
+
+static void hist_remove(size_t i) {
+  hist_list* h = &shell_history;
+  hist_entry* e = &h->entries[h->first + i];
+  h->text_dead += e->len + 1;
+  if (i >= h->count - h->unsaved) h->unsaved--;
+  if (i >= h->count - h->unappended) h->unappended--;
+  if (i == 0) {
+    h->first++;
+  } else {
+    memmove(e, e + 1, (h->count - i - 1) * sizeof(hist_entry));
+  }
+  h->count--;
+  if (h->count == 0) {
+    h->first = 0;
+    h->text_len = 0;
+    h->text_dead = 0;
+  }
+  if (hist_listener) hist_listener(i, NULL);
+}
+
+static void hist_append(const char* line, size_t len, size_t hash) {
+  hist_list* h = &shell_history;
+  if (h->first + h->count == h->cap) {
+    if (h->first >= h->count && h->first > 0) {
+      // At least half the slots are free ones left at the front
+      memmove(h->entries, h->entries + h->first, h->count * sizeof(hist_entry));
+      h->first = 0;
+    } else {
+      h->cap = h->cap ? h->cap * 2 : 64;
+      h->entries = hist_realloc(h->entries, h->cap * sizeof(hist_entry));
+    }
+  }
+  if (len + 1 > h->text_cap - h->text_len && h->text_dead * 2 > h->text_len) hist_compact(h);
+  if (len + 1 > h->text_cap - h->text_len) {
+    while (len + 1 > h->text_cap - h->text_len) h->text_cap = h->text_cap ? h->text_cap * 2 : 1024;
+    h->text = hist_realloc(h->text, h->text_cap);
+  }
+
+  memcpy(h->text + h->text_len, line, len);
+  h->text[h->text_len + len] = '\0';
+  h->entries[h->first + h->count] = (hist_entry){h->text_len, len, hash};
+  h->text_len += len + 1;
+  h->count++;
+  h->unsaved++;
+  h->unappended++;
+  if (hist_listener) hist_listener(h->count - 1, h->text + h->text_len - len - 1);
+}
+
+// Drop the oldest entries beyond $HISTSIZE
+static void hist_trim(void) {
+  long size = hist_limit("HISTSIZE", HISTSIZE_DEFAULT);
+  while (size >= 0 && shell_history.count > (size_t)size) hist_remove(0);
+}
+
+static int hist_equal(size_t i, const char* line, size_t len, size_t hash) {
+  hist_entry* e = &shell_history.entries[shell_history.first + i];
+  return e->hash == hash && e->len == len && memcmp(shell_history.text + e->off, line, len) == 0;
+}
+
+// Add a line the user entered, as $HISTCONTROL and $HISTSIZE say
+static void hist_add(const char* line) {
+  if (*line == '\0' || hist_limit("HISTSIZE", HISTSIZE_DEFAULT) == 0) return;
+  const char* control = get_var("HISTCONTROL");
+  int ignoreboth = hist_control(control, "ignoreboth");
+  if ((ignoreboth || hist_control(control, "ignorespace")) && line[0] == ' ') return;
+
+  size_t len = strlen(line);
+  size_t hash = hash_name(line, len);
+  size_t n = shell_history.count;
+  if ((ignoreboth || hist_control(control, "ignoredups")) && n > 0 && hist_equal(n - 1, line, len, hash)) {
+    return;
+  }
+  if (hist_control(control, "erasedups")) {
+    for (size_t k = n; k-- > 0;) {
+      if (hist_equal(k, line, len, hash)) hist_remove(k);
+    }
+  }
+  hist_append(line, len, hash);
+  hist_trim();
+}
+
+// History is loaded lazily so the first prompt does not wait on $HISTFILE.
+// It is pulled in when readline has been idle for a tick, or on first use
+// (history builtin, Up/Down/Ctrl-R, the first save), whichever comes first.
+//
+// After that the file is shared, not owned: sessions open it with O_APPEND,
+// take flock() on it and append only their new entries, and each one
+// remembers how far it has read, so it picks up what other sessions appended
+// since by reading just those bytes. Once the file holds more than twice
+// $HISTFILESIZE lines, the session that notices replaces it, under the lock,
+// with its newest $HISTFILESIZE lines; that is the only rewrite.
+static const char* histfile = NULL;
+static int history_loaded = 0;
+
+typedef struct {
+  off_t offset;  // bytes of the file this session has read or written
+  dev_t dev;     // the file they belong to; ino 0 before it was first seen
+  ino_t ino;
+  long lines;  // lines in the file, as far as this session knows
+} hist_file_state;
+
+static hist_file_state hist_file;
+
+// The newline that ends the line at p, or end
+static char* line_end(char* p, char* end) {
+  char* nl = memchr(p, '\n', end - p);
+  return nl ? nl : end;
+}
+
+static int lock_file(int fd, int op) {
+  while (flock(fd, op) < 0) {
+    if (errno != EINTR) return -1;
+  }
+  return 0;
+}
+
+// Read len bytes at offset; NULL on a short read
+static char* read_at(int fd, off_t offset, size_t len) {
+  char* data = malloc(len + 1);
+  if (!data) return NULL;
+  size_t total = 0;
+  while (total < len) {
+    ssize_t n = pread(fd, data + total, len - total, offset + total);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    total += n;
+  }
+  data[len] = '\0';
+  return data;
+}
+
+// Add every non-empty line of data[0..len) as an entry, or only the last
+// $HISTSIZE of them. Returns the number of newlines.
+static long hist_add_lines(char* data, size_t len) {
+  char* p = data;
+  char* end = data + len;
+  long newlines = 0;
+  long lines = 0;
+  for (char* q = p; q < end; q = line_end(q, end) + 1) {
+    if (*q != '\n') lines++;
+    if (line_end(q, end) < end) newlines++;
+  }
+
+  // Lines before the last $HISTSIZE would only be trimmed again
+  long size = hist_limit("HISTSIZE", HISTSIZE_DEFAULT);
+  for (long skip = size >= 0 ? lines - size : 0; skip > 0 && p < end; p = line_end(p, end) + 1) {
+    if (*p != '\n') skip--;
+  }
+
+  while (p < end) {
+    char* nl = line_end(p, end);
+    if (nl > p) hist_append(p, nl - p, hash_name(p, nl - p));
+    p = nl + 1;
+  }
+  hist_trim();
+  return newlines;
+}
+
+// Read a whole history file with a single read() and add its lines. Returns
+// -1 if the file cannot be opened.
+static int load_history_from_file(const char* filepath) {
+  int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  // A concurrent append is never seen half-written
+  lock_file(fd, LOCK_SH);
+  struct stat st;
+  char* data = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) data = read_at(fd, 0, st.st_size);
+  close(fd);
+  if (!data) return 0;
+
+  long lines = hist_add_lines(data, st.st_size);
+  // Everything loaded is in a file already
+  shell_history.unsaved = 0;
+  shell_history.unappended = 0;
+  free(data);
+
+  if (filepath == histfile) hist_file = (hist_file_state){st.st_size, st.st_dev, st.st_ino, lines};
+  return 0;
+}
+
+// Returns 1 if this call loaded the file
+static int ensure_history_loaded(void) {
+  if (history_loaded) return 0;
+  history_loaded = 1;
+  if (histfile == NULL) return 0;
+
+  // Lines typed before the file was loaded must stay after the loaded ones
+  size_t pending = shell_history.count;
+  char** typed = NULL;
+  if (pending > 0) {
+    typed = malloc(sizeof(char*) * pending);
+    for (size_t i = 0; i < pending; i++) typed[i] = strdup(hist_line(i));
+    while (shell_history.count > 0) hist_remove(shell_history.count - 1);
+  }
+
+  load_history_from_file(histfile);
+
+  for (size_t i = 0; i < pending; i++) {
+    size_t len = strlen(typed[i]);
+    hist_append(typed[i], len, hash_name(typed[i], len));
+    free(typed[i]);
+  }
+  free(typed);
+  hist_trim();
+  return 1;
+}
+
+// Write entries [from, count) to fp
+static void write_history_entries(FILE* fp, size_t from) {
+  for (size_t i = from; i < shell_history.count; i++) fprintf(fp, "%s\n", hist_line(i));
+}
+
+// Open and lock $HISTFILE, making sure the lock is on the file that is at the
+// path now and not on one another session has just replaced
+static int lock_history_file(struct stat* st) {
+  for (int tries = 0; tries < 8; tries++) {
+    int fd = open(histfile, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    struct stat now;
+    if (lock_file(fd, LOCK_EX) == 0 && fstat(fd, st) == 0 && stat(histfile, &now) == 0 &&
+        now.st_dev == st->st_dev && now.st_ino == st->st_ino) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+static int write_file_atomic(const char* path, const void* data, size_t len);
+
+// Replace the locked file with its newest $HISTFILESIZE lines
+static void shrink_history_file(int fd, struct stat* st, long keep) {
+  char* data = read_at(fd, 0, st->st_size);
+  if (!data) return;
+  char* end = data + st->st_size;
+  char* start = end;
+  long kept = 0;
+  while (start > data && kept < keep) {
+    char* nl = memrchr(data, '\n', start - 1 - data);
+    start = nl ? nl + 1 : data;
+    kept++;
+  }
+
+  struct stat fresh;
+  if (write_file_atomic(histfile, start, end - start) == 0 && stat(histfile, &fresh) == 0) {
+    hist_file = (hist_file_state){fresh.st_size, fresh.st_dev, fresh.st_ino, kept};
+  }
+  free(data);
+}
+
+// Append this session's new entries to $HISTFILE, after adding the ones other
+// sessions appended since the last look
+static void sync_history_file(void) {
+  if (histfile == NULL) return;
+  ensure_history_loaded();
+
+  struct stat st;
+  int fd = lock_history_file(&st);
+  if (fd < 0) return;
+
+  if (hist_file.ino != 0 && (st.st_dev != hist_file.dev || st.st_ino != hist_file.ino ||
+                             st.st_size < hist_file.offset)) {
+    // Replaced or truncated by something else: go on from its end
+    hist_file = (hist_file_state){st.st_size, st.st_dev, st.st_ino, 0};
+  } else if (hist_file.ino == 0) {
+    // Created since this session loaded history
+    hist_file = (hist_file_state){0, st.st_dev, st.st_ino, 0};
+  }
+
+  char* data = NULL;
+  size_t len = st.st_size - hist_file.offset;
+  if (len > 0) data = read_at(fd, hist_file.offset, len);
+  if (data) {
+    // Only whole lines; an append from another program may still be in progress
+    char* last = memrchr(data, '\n', len);
+    len = last ? (size_t)(last - data) + 1 : 0;
+
+    // Their entries go before this session's unwritten ones, as in the file
+    size_t unsaved = shell_history.unsaved;
+    size_t unappended = shell_history.unappended;
+    char** mine = malloc(sizeof(char*) * (unsaved + 1));
+    for (size_t i = 0; i < unsaved; i++) mine[i] = strdup(hist_line(shell_history.count - unsaved + i));
+    for (size_t i = 0; i < unsaved && shell_history.count > 0; i++) hist_remove(shell_history.count - 1);
+    hist_file.lines += hist_add_lines(data, len);
+    shell_history.unsaved = 0;
+    for (size_t i = 0; i < unsaved; i++) {
+      size_t n = strlen(mine[i]);
+      hist_append(mine[i], n, hash_name(mine[i], n));
+      free(mine[i]);
+    }
+    free(mine);
+    hist_trim();
+    shell_history.unappended = unappended < shell_history.count ? unappended : shell_history.count;
+    hist_file.offset += len;
+    free(data);
+  }
+
+  // Everything unwritten in one write(), so it lands in one piece
+  size_t first = shell_history.count - shell_history.unsaved;
+  size_t total = 0;
+  for (size_t i = first; i < shell_history.count; i++) total += strlen(hist_line(i)) + 1;
+  char* out = total ? malloc(total) : NULL;
+  if (out) {
+    size_t n = 0;
+    for (size_t i = first; i < shell_history.count; i++) {
+      size_t line_len = strlen(hist_line(i));
+      memcpy(out + n, hist_line(i), line_len);
+      out[n + line_len] = '\n';
+      n += line_len + 1;
+    }
+    write_all(fd, out, total);
+    hist_file.lines += shell_history.unsaved;
+    free(out);
+  }
+  shell_history.unsaved = 0;
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size >= 0) hist_file.offset = size;
+
+  long keep = hist_limit("HISTFILESIZE", hist_limit("HISTSIZE", HISTSIZE_DEFAULT));
+  if (keep >= 0 && hist_file.lines > 2 * keep && fstat(fd, &st) == 0) shrink_history_file(fd, &st, keep);
+
+  close(fd);
+}
+
+// In-process versions of cat, head and wc, so the common tiny calls skip the PATH
+// scan, fork() and execv(). Each one writes straight to out_fd/err_fd and returns
+// the exit status, or FAST_PATH_UNSUPPORTED before producing any output when it
+// sees something it does not implement, and the caller runs the real binary.
+// CHEFS_FASTPATH=0 turns them off.
+#define FAST_PATH_UNSUPPORTED -1
+#define COPY_CHUNK (1 << 30)
+
+static int fast_paths_enabled(void) {
+  char* v = getenv("CHEFS_FASTPATH");
+  return v == NULL || strcmp(v, "0") != 0;
+}
+
+// Only names coreutils would print verbatim or in plain quotes are handled here
+static int is_plain_name(const char* name) {
+  int has_squote = 0;
+  int has_dquote_special = 0;
+  for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+    if (*p < 0x20 || *p >= 0x7f) return 0;
+    if (*p == '\'') has_squote = 1;
+    if (strchr("\"$`\\!", *p)) has_dquote_special = 1;
+  }
+  return !(has_squote && has_dquote_special);
+}
+
+// Quote a file name for an error message the way coreutils does in the C locale
+// (quotef, or quoteaf when always is set)
+static const char* quote_name(const char* name, int always, char* buf, size_t size) {
+  int needs = always || name[0] == '\0' || name[0] == '~' || name[0] == '#';
+  for (const char* p = name; *p && !needs; p++) {
+    if (strchr(" \t!\"$&'()*;<=>?[\\^`|:", *p)) needs = 1;
+  }
+  if (!needs) return name;
+  char q = strchr(name, '\'') ? '"' : '\'';
+  snprintf(buf, size, "%c%s%c", q, name, q);
+  return buf;
+}
+
+// Copy in_fd to out_fd until EOF, or until limit bytes when limit >= 0, using the
+// kernel-side copy that fits the pair of descriptors: copy_file_range between
+// regular files, sendfile from a regular file, splice when either end is a pipe,
+// and a plain read/write loop otherwise. Returns 0 or an errno value.
+static int copy_fd(int in_fd, int out_fd, off_t limit) {
+  enum { COPY_RANGE, SEND_FILE, SPLICE, READ_WRITE } method = READ_WRITE;
+  struct stat in_st, out_st;
+
+  if (fstat(in_fd, &in_st) == 0 && fstat(out_fd, &out_st) == 0) {
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+      method = COPY_RANGE;
+    } else if (S_ISREG(in_st.st_mode)) {
+      method = SEND_FILE;
+    } else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+      method = SPLICE;
+    }
+  }
+
+  char buf[65536];
+  while (limit != 0) {
+    size_t chunk = (limit < 0 || limit > COPY_CHUNK) ? COPY_CHUNK : (size_t)limit;
+    ssize_t n;
+
+    switch (method) {
+      case COPY_RANGE:
+        n = copy_file_range(in_fd, NULL, out_fd, NULL, chunk, 0);
+        break;
+      case SEND_FILE:
+        n = sendfile(out_fd, in_fd, NULL, chunk);
+        break;
+      case SPLICE:
+        n = splice(in_fd, NULL, out_fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        break;
+      default:
+        n = read(in_fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf));
+        if (n > 0) {
+          const char* p = buf;
+          ssize_t left = n;
+          while (left > 0) {
+            ssize_t w = write(out_fd, p, left);
+            if (w < 0) {
+              if (errno == EINTR) continue;
+              return errno;
+            }
+            p += w;
+            left -= w;
+          }
+        }
+        break;
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      // This pair of descriptors does not support the zero-copy call: step down
+      if (method != READ_WRITE && (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                                   errno == EOPNOTSUPP || errno == EBADF)) {
+        method = (method == COPY_RANGE) ? SEND_FILE : READ_WRITE;
+        continue;
+      }
+      return errno;
+    }
+    if (n == 0) break;  // EOF
+    if (limit > 0) limit -= n;
+  }
+  return 0;
+}
+
+static int fast_cat(char* args[], int out_fd, int err_fd) {
+  int nfiles = 0;
+  for (int i = 1; args[i]; i++) {
+    if (args[i][0] == '-' && args[i][1] != '\0') return FAST_PATH_UNSUPPORTED;
+    if (strcmp(args[i], "-") == 0 && isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+    if (!is_plain_name(args[i])) return FAST_PATH_UNSUPPORTED;
+    nfiles++;
+  }
+  if (nfiles == 0 && isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+
+  struct stat out_st;
+  int out_is_reg = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+  int status = 0;
+  char qbuf[PATH_MAX + 3];
+
+  for (int i = 1; i <= (nfiles ? nfiles : 1); i++) {
+    const char* name = nfiles ? args[i] : "-";
+    int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      dprintf(err_fd, "cat: %s: %s\n", quote_name(name, 0, qbuf, sizeof(qbuf)), strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    struct stat in_st;
+    if (out_is_reg && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev &&
+        in_st.st_ino == out_st.st_ino && lseek(fd, 0, SEEK_CUR) < in_st.st_size) {
+      dprintf(err_fd, "cat: %s: input file is output file\n", quote_name(name, 0, qbuf, sizeof(qbuf)));
+      status = 1;
+    } else {
+      int err = copy_fd(fd, out_fd, -1);
+      if (err) {
+        dprintf(err_fd, "cat: %s: %s\n", quote_name(name, 0, qbuf, sizeof(qbuf)), strerror(err));
+        status = 1;
+      }
+    }
+    if (fd != STDIN_FILENO) close(fd);
+  }
+  return status;
+}
+
+// Parse a plain decimal count; suffixes and signs are left to the real binary
+static int parse_count(const char* s, off_t* out) {
+  if (*s == '\0' || strlen(s) > 18) return 0;
+  off_t v = 0;
+  for (; *s; s++) {
+    if (*s < '0' || *s > '9') return 0;
+    v = v * 10 + (*s - '0');
+  }
+  *out = v;
+  return 1;
+}
+
+static int fast_head(char* args[], int out_fd, int err_fd) {
+  off_t count = 10;
+  int bytes_mode = 0;
+  char* files[64];
+  int nfiles = 0;
+
+  for (int i = 1; args[i]; i++) {
+    char* a = args[i];
+    if (a[0] != '-' || a[1] == '\0') {
+      if (nfiles == 64 || !is_plain_name(a)) return FAST_PATH_UNSUPPORTED;
+      if (strcmp(a, "-") == 0 && isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+      files[nfiles++] = a;
+    } else if (a[1] == 'n' || a[1] == 'c') {
+      char* num = a[2] ? a + 2 : args[++i];
+      if (num == NULL || !parse_count(num, &count)) return FAST_PATH_UNSUPPORTED;
+      bytes_mode = a[1] == 'c';
+    } else if (parse_count(a + 1, &count)) {
+      bytes_mode = 0;  // obsolete -N form
+    } else {
+      return FAST_PATH_UNSUPPORTED;
+    }
+  }
+  if (nfiles == 0) {
+    if (isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+    files[nfiles++] = "-";
+  }
+
+  int status = 0;
+  int first = 1;
+  char qbuf[PATH_MAX + 3];
+  char buf[65536];
+
+  for (int f = 0; f < nfiles; f++) {
+    int is_stdin = strcmp(files[f], "-") == 0;
+    const char* name = is_stdin ? "standard input" : files[f];
+    int fd = is_stdin ? STDIN_FILENO : open(files[f], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      dprintf(err_fd, "head: cannot open %s for reading: %s\n",
+              quote_name(name, 1, qbuf, sizeof(qbuf)), strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    if (nfiles > 1) {
+      dprintf(out_fd, "%s==> %s <==\n", first ? "" : "\n", name);
+    }
+    first = 0;
+
+    int err = 0;
+    if (bytes_mode) {
+      err = copy_fd(fd, out_fd, count);
+    } else {
+      off_t lines = count;
+      while (lines > 0) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          err = errno;
+          break;
+        }
+        if (n == 0) break;
+
+        // Stop right after the count-th newline
+        char* p = buf;
+        char* end = buf + n;
+        while (lines > 0 && p < end) {
+          char* nl = memchr(p, '\n', end - p);
+          if (!nl) {
+            p = end;
+            break;
+          }
+          p = nl + 1;
+          lines--;
+        }
+        write_all(out_fd, buf, p - buf);
+        // Like coreutils, leave a seekable input just past the last line printed,
+        // for whoever reads it next: { head -n1; cat; } < file
+        if (p < end) lseek(fd, -(off_t)(end - p), SEEK_CUR);
+      }
+    }
+    if (err) {
+      dprintf(err_fd, "head: error reading %s: %s\n", quote_name(name, 1, qbuf, sizeof(qbuf)),
+              strerror(err));
+      status = 1;
+    }
+    if (!is_stdin) close(fd);
+  }
+  return status;
+}
+
+// Only the C locale word rules are implemented; elsewhere wc -w goes to the binary
+static int is_c_locale(void) {
+  const char* vars[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+  for (int i = 0; i < 3; i++) {
+    char* v = getenv(vars[i]);
+    if (v && *v) return strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0;
+  }
+  return 1;
+}
+
+static void print_wc_counts(int out_fd, int show[3], uintmax_t counts[3], int width, const char* name) {
+  char line[PATH_MAX + 128];
+  int len = 0;
+  for (int k = 0; k < 3; k++) {
+    if (!show[k]) continue;
+    len += snprintf(line + len, sizeof(line) - len, "%s%*ju", len ? " " : "", width, counts[k]);
+  }
+  if (name) len += snprintf(line + len, sizeof(line) - len, " %s", name);
+  if (len >= (int)sizeof(line) - 1) len = sizeof(line) - 2;
+  line[len++] = '\n';
+  write_all(out_fd, line, len);
+}
+
+static int fast_wc(char* args[], int out_fd, int err_fd) {
+  int show[3] = {0, 0, 0};  // lines, words, bytes
+  char* files[64];
+  int nfiles = 0;
+
+  for (int i = 1; args[i]; i++) {
+    char* a = args[i];
+    if (a[0] == '-' && a[1] != '\0') {
+      for (char* p = a + 1; *p; p++) {
+        if (*p == 'l') show[0] = 1;
+        else if (*p == 'w') show[1] = 1;
+        else if (*p == 'c') show[2] = 1;
+        else return FAST_PATH_UNSUPPORTED;
+      }
+    } else {
+      if (nfiles == 64 || !is_plain_name(a)) return FAST_PATH_UNSUPPORTED;
+      if (strcmp(a, "-") == 0 && isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+      files[nfiles++] = a;
+    }
+  }
+  if (!show[0] && !show[1] && !show[2]) show[0] = show[1] = show[2] = 1;
+  if (show[1] && !is_c_locale()) return FAST_PATH_UNSUPPORTED;
+
+  int named = nfiles > 0;
+  if (!named) {
+    if (isatty(STDIN_FILENO)) return FAST_PATH_UNSUPPORTED;
+    files[nfiles++] = "-";
+  }
+
+  // Column width follows coreutils: digits of the total size of the regular
+  // files, at least 7 when any input is not a regular file, 1 for a single count
+  int width = 1;
+  if (!(nfiles == 1 && show[0] + show[1] + show[2] == 1)) {
+    int min_width = 1;
+    uintmax_t regular_total = 0;
+    for (int f = 0; f < nfiles; f++) {
+      struct stat st;
+      int ok = strcmp(files[f], "-") == 0 ? fstat(STDIN_FILENO, &st) : stat(files[f], &st);
+      if (ok != 0) continue;
+      if (S_ISREG(st.st_mode)) regular_total += st.st_size;
+      else min_width = 7;
+    }
+    for (; regular_total >= 10; regular_total /= 10) width++;
+    if (width < min_width) width = min_width;
+  }
+
+  uintmax_t totals[3] = {0, 0, 0};
+  int status = 0;
+  char qbuf[PATH_MAX + 3];
+  char buf[65536];
+
+  for (int f = 0; f < nfiles; f++) {
+    int is_stdin = strcmp(files[f], "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(files[f], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      dprintf(err_fd, "wc: %s: %s\n", quote_name(files[f], 0, qbuf, sizeof(qbuf)), strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    uintmax_t counts[3] = {0, 0, 0};
+    int in_word = 0;
+    int err = 0;
+    struct stat st;
+
+    if (!show[0] && !show[1] && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      // Byte count alone comes from the inode, no reading needed
+      off_t pos = lseek(fd, 0, SEEK_CUR);
+      counts[2] = st.st_size > pos && pos >= 0 ? (uintmax_t)(st.st_size - pos) : 0;
+    } else {
+      for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          err = errno;
+          break;
+        }
+        if (n == 0) break;
+        counts[2] += n;
+
+        if (!show[1]) {
+          for (char* p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++) counts[0]++;
+          continue;
+        }
+        // Words are runs of printable characters between whitespace; other
+        // bytes neither start nor end a word
+        for (ssize_t k = 0; k < n; k++) {
+          unsigned char c = buf[k];
+          if (c == '\n') counts[0]++;
+          if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            in_word = 0;
+          } else if (c > ' ' && c < 0x7f && !in_word) {
+            counts[1]++;
+            in_word = 1;
+          }
+        }
+      }
+    }
+    if (err) {
+      dprintf(err_fd, "wc: %s: %s\n", quote_name(files[f], 0, qbuf, sizeof(qbuf)), strerror(err));
+      status = 1;
+    }
+
+    print_wc_counts(out_fd, show, counts, width, named ? files[f] : NULL);
+    for (int k = 0; k < 3; k++) totals[k] += counts[k];
+    if (!is_stdin) close(fd);
+  }
+
+  if (nfiles > 1) print_wc_counts(out_fd, show, totals, width, "total");
+  return status;
+}
+
+typedef struct {
+  const char* name;
+  int (*run)(char* args[], int out_fd, int err_fd);
+} fast_path;
+
+static fast_path fast_paths[] = {{"cat", fast_cat}, {"head", fast_head}, {"wc", fast_wc}, {NULL, NULL}};
+
+static fast_path* find_fast_path(const char* cmd) {
+  if (!fast_paths_enabled()) return NULL;
+  for (int i = 0; fast_paths[i].name; i++) {
+    if (strcmp(fast_paths[i].name, cmd) == 0) return &fast_paths[i];
+  }
+  return NULL;
+}
+
+// test / [ : evaluated by argument count as POSIX describes, with longer
+// expressions (-a, -o, !, parentheses) going through a small recursive parser
+typedef struct {
+  char** argv;
+  int pos;
+  int count;
+  int error;
+} test_parser;
+
+static const char* test_name = "test";  // "test" or "[" in error messages
+
+static int test_int(const char* s, long long* out, int* error) {
+  char* end;
+  errno = 0;
+  while (*s == ' ' || *s == '\t') s++;
+  long long v = strtoll(s, &end, 10);
+  while (*end == ' ' || *end == '\t') end++;
+  if (*s == '\0' || *end != '\0' || errno == ERANGE) {
+    err_printf("%s: %s: integer expression expected\n", test_name, s);
+    *error = 1;
+    return 0;
+  }
+  *out = v;
+  return 1;
+}
+
+static int is_test_unary(const char* op) {
+  return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghknprsSwxzLOG", op[1]);
+}
+
+static int is_test_binary(const char* op) {
+  const char* ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt",
+                       "-ge", "-nt", "-ot", "-ef", NULL};
+  for (int i = 0; ops[i]; i++) {
+    if (strcmp(op, ops[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+static int test_unary(const char* op, const char* arg) {
+  struct stat st;
+  if (op[1] == 'n') return arg[0] != '\0';
+  if (op[1] == 'z') return arg[0] == '\0';
+  if (op[1] == 'h' || op[1] == 'L') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  if (op[1] == 'r') return access(arg, R_OK) == 0;
+  if (op[1] == 'w') return access(arg, W_OK) == 0;
+  if (op[1] == 'x') return access(arg, X_OK) == 0;
+  if (op[1] == 't') return isatty(atoi(arg));
+  if (stat(arg, &st) != 0) return 0;
+  switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+  }
+  return 0;
+}
+
+static int test_binary(const char* left, const char* op, const char* right, int* error) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0;
+  if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0;
+  if (strcmp(op, "<") == 0) return strcmp(left, right) < 0;
+  if (strcmp(op, ">") == 0) return strcmp(left, right) > 0;
+
+  if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+    struct stat a, b;
+    int ha = stat(left, &a) == 0;
+    int hb = stat(right, &b) == 0;
+    if (op[1] == 'e') return ha && hb && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    if (!ha || !hb) return op[1] == 'n' ? ha : hb;
+    long long ta = a.st_mtim.tv_sec * 1000000000LL + a.st_mtim.tv_nsec;
+    long long tb = b.st_mtim.tv_sec * 1000000000LL + b.st_mtim.tv_nsec;
+    return op[1] == 'n' ? ta > tb : ta < tb;
+  }
+
+  long long l, r;
+  if (!test_int(left, &l, error) || !test_int(right, &r, error)) return 0;
+  if (strcmp(op, "-eq") == 0) return l == r;
+  if (strcmp(op, "-ne") == 0) return l != r;
+  if (strcmp(op, "-lt") == 0) return l < r;
+  if (strcmp(op, "-le") == 0) return l <= r;
+  if (strcmp(op, "-gt") == 0) return l > r;
+  return l >= r;  // -ge
+}
+
+static int test_or(test_parser* tp);
+
+static int test_primary(test_parser* tp) {
+  if (tp->pos >= tp->count) {
+    err_printf("%s: argument expected\n", test_name);
+    tp->error = 1;
+    return 0;
+  }
+  char** a = tp->argv + tp->pos;
+  int left = tp->count - tp->pos;
+
+  if (strcmp(a[0], "!") == 0) {
+    tp->pos++;
+    return !test_primary(tp);
+  }
+  if (strcmp(a[0], "(") == 0) {
+    tp->pos++;
+    int r = test_or(tp);
+    if (tp->pos >= tp->count || strcmp(tp->argv[tp->pos], ")") != 0) {
+      err_printf("%s: `)' expected\n", test_name);
+      tp->error = 1;
+      return 0;
+    }
+    tp->pos++;
+    return r;
+  }
+  if (left >= 3 && is_test_binary(a[1])) {
+    tp->pos += 3;
+    return test_binary(a[0], a[1], a[2], &tp->error);
+  }
+  if (left >= 2 && is_test_unary(a[0])) {
+    tp->pos += 2;
+    return test_unary(a[0], a[1]);
+  }
+  tp->pos++;
+  return a[0][0] != '\0';
+}
+
+static int test_and(test_parser* tp) {
+  int r = test_primary(tp);
+  while (!tp->error && tp->pos < tp->count && strcmp(tp->argv[tp->pos], "-a") == 0) {
+    tp->pos++;
+    int rhs = test_primary(tp);
+    r = r && rhs;
+  }
+  return r;
+}
+
+static int test_or(test_parser* tp) {
+  int r = test_and(tp);
+  while (!tp->error && tp->pos < tp->count && strcmp(tp->argv[tp->pos], "-o") == 0) {
+    tp->pos++;
+    int rhs = test_and(tp);
+    r = r || rhs;
+  }
+  return r;
+}
+
+static int test_eval(char** a, int n, int* error) {
+  switch (n) {
+    case 0:
+      return 0;
+    case 1:
+      return a[0][0] != '\0';
+    case 2:
+      if (strcmp(a[0], "!") == 0) return a[1][0] == '\0';
+      if (is_test_unary(a[0])) return test_unary(a[0], a[1]);
+      err_printf("%s: %s: unary operator expected\n", test_name, a[0]);
+      *error = 1;
+      return 0;
+    case 3:
+      if (is_test_binary(a[1])) return test_binary(a[0], a[1], a[2], error);
+      if (strcmp(a[0], "!") == 0) return !test_eval(a + 1, 2, error);
+      if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) return a[1][0] != '\0';
+      break;
+    case 4:
+      if (strcmp(a[0], "!") == 0) return !test_eval(a + 1, 3, error);
+      if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) return test_eval(a + 1, 2, error);
+      break;
+  }
+
+  test_parser tp = {a, 0, n, 0};
+  int r = test_or(&tp);
+  if (!tp.error && tp.pos < n) {
+    err_printf("%s: %s: unexpected argument\n", test_name, a[tp.pos]);
+    tp.error = 1;
+  }
+  *error = tp.error;
+  return r;
+}
+
+static int builtin_test(char* args[]) {
+  int n = 0;
+  while (args[n + 1]) n++;
+
+  test_name = args[0];
+  if (strcmp(args[0], "[") == 0) {
+    if (n == 0 || strcmp(args[n], "]") != 0) {
+      err_printf("[: missing `]'\n");
+      return 2;
+    }
+    n--;
+  }
+
+  int error = 0;
+  int r = test_eval(args + 1, n, &error);
+  if (error) return 2;
+  return r ? 0 : 1;
+}
+
+static int builtin_true(char* args[]) {
+  (void)args;
+  return 0;
+}
+
+static int builtin_false(char* args[]) {
+  (void)args;
+  return 1;
+}
+
+// Decode the escape after a backslash into out. Returns how many characters
+// were consumed, or -1 for \c (stop all output, only meaningful in %b).
+static int decode_escape(const char* s, char* out, int in_b) {
+  switch (*s) {
+    case 'a': *out = '\a'; return 1;
+    case 'b': *out = '\b'; return 1;
+    case 'e': *out = '\033'; return 1;
+    case 'f': *out = '\f'; return 1;
+    case 'n': *out = '\n'; return 1;
+    case 'r': *out = '\r'; return 1;
+    case 't': *out = '\t'; return 1;
+    case 'v': *out = '\v'; return 1;
+    case '\\': *out = '\\'; return 1;
+    case 'c':
+      if (in_b) return -1;
+      break;
+    case 'x': {
+      int v = 0, k = 1;
+      for (; k <= 2 && isxdigit((unsigned char)s[k]); k++) {
+        v = v * 16 + (isdigit((unsigned char)s[k]) ? s[k] - '0' : (tolower(s[k]) - 'a' + 10));
+      }
+      if (k == 1) break;
+      *out = (char)v;
+      return k;
+    }
+    default:
+      if (*s >= '0' && *s <= '7') {
+        // %b takes \0NNN, the format string \NNN
+        int start = (in_b && *s == '0') ? 1 : 0;
+        int v = 0, k = start;
+        for (; k < start + 3 && s[k] >= '0' && s[k] <= '7'; k++) v = v * 8 + (s[k] - '0');
+        *out = (char)v;
+        return k;
+      }
+      break;
+  }
+  // Unknown escape: keep the backslash, the character follows as normal text
+  *out = '\\';
+  return 0;
+}
+
+static int printf_number(const char* arg, long long* out) {
+  if (arg == NULL || *arg == '\0') {
+    *out = 0;
+    return 1;
+  }
+  if (arg[0] == '\'' || arg[0] == '"') {
+    *out = (unsigned char)arg[1];
+    return 1;
+  }
+  char* end;
+  errno = 0;
+  *out = strtoll(arg, &end, 0);
+  if (*end != '\0' || errno == ERANGE) {
+    err_printf("printf: %s: invalid number\n", arg);
+    return 0;
+  }
+  return 1;
+}
+
+static int builtin_printf(char* args[]) {
+  if (args[1] == NULL) {
+    err_printf("printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+
+  const char* fmt = args[1];
+  char** argp = args + 2;
+  int status = 0;
+
+  // The format is reused until every argument has been consumed
+  do {
+    char** round_start = argp;
+    for (const char* p = fmt; *p; p++) {
+      if (*p == '\\') {
+        char c;
+        int used = decode_escape(p + 1, &c, 0);
+        out_write(&builtin_out, &c, 1);
+        p += used;
+        continue;
+      }
+      if (*p != '%') {
+        out_write(&builtin_out, p, 1);
+        continue;
+      }
+      if (p[1] == '%') {
+        out_write(&builtin_out, "%", 1);
+        p++;
+        continue;
+      }
+
+      // %[flags][width][.precision]conversion, with * taken from the arguments
+      char spec[64] = "%";
+      size_t sl = 1;
+      p++;
+      while (*p && strchr("-+ #0", *p) && sl < 10) spec[sl++] = *p++;
+      for (int part = 0; part < 2; part++) {
+        if (part == 1) {
+          if (*p != '.') break;
+          spec[sl++] = *p++;
+        }
+        if (*p == '*') {
+          long long v = 0;
+          if (!printf_number(*argp, &v)) status = 1;
+          if (*argp) argp++;
+          sl += snprintf(spec + sl, sizeof(spec) - sl - 4, "%d", (int)v);
+          p++;
+        } else {
+          while (*p >= '0' && *p <= '9' && sl < 40) spec[sl++] = *p++;
+        }
+      }
+
+      char conv = *p;
+      if (conv == '\0') {
+        err_printf("printf: %s: missing format character\n", fmt);
+        return 1;
+      }
+      const char* arg = *argp;
+      if (arg) argp++;
+
+      if (strchr("diouxXc", conv)) {
+        long long v = 0;
+        if (conv == 'c') {
+          spec[sl++] = 'c';
+          spec[sl] = '\0';
+          if (arg && *arg) out_printf(spec, arg[0]);
+          continue;
+        }
+        if (!printf_number(arg, &v)) status = 1;
+        spec[sl++] = 'l';
+        spec[sl++] = 'l';
+        spec[sl++] = conv;
+        spec[sl] = '\0';
+        if (conv == 'd' || conv == 'i') {
+          out_printf(spec, v);
+        } else {
+          out_printf(spec, (unsigned long long)v);
+        }
+      } else if (strchr("eEfFgG", conv)) {
+        char* end = NULL;
+        double v = arg ? strtod(arg, &end) : 0.0;
+        if (arg && *end != '\0') {
+          err_printf("printf: %s: invalid number\n", arg);
+          status = 1;
+        }
+        spec[sl++] = conv;
+        spec[sl] = '\0';
+        out_printf(spec, v);
+      } else if (conv == 's' || conv == 'b') {
+        spec[sl++] = 's';
+        spec[sl] = '\0';
+        if (conv == 's' || arg == NULL) {
+          out_printf(spec, arg ? arg : "");
+          continue;
+        }
+        char* expanded = malloc(strlen(arg) + 1);
+        size_t el = 0;
+        int stop = 0;
+        for (const char* q = arg; *q; q++) {
+          if (*q == '\\' && q[1]) {
+            char c;
+            int used = decode_escape(q + 1, &c, 1);
+            if (used < 0) {
+              stop = 1;
+              break;
+            }
+            expanded[el++] = c;
+            q += used;
+          } else {
+            expanded[el++] = *q;
+          }
+        }
+        expanded[el] = '\0';
+        out_printf(spec, expanded);
+        free(expanded);
+        if (stop) return status;
+      } else {
+        err_printf("printf: %c: invalid format character\n", conv);
+        return 1;
+      }
+    }
+    if (argp == round_start) break;  // the format consumes no arguments
+  } while (*argp);
+
+  return status;
+}
+
+static int is_ifs_space(char c, const char* ifs) { return (c == ' ' || c == '\t' || c == '\n') && strchr(ifs, c); }
+
+// read [-r] [-p prompt] [name...]: one line from stdin through the per-fd buffer,
+// split on IFS; the last name takes the rest of the line, REPLY is the default
+static int builtin_read(char* args[]) {
+  int raw = 0;
+  const char* prompt = NULL;
+  int i = 1;
+
+  for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "-r") == 0) {
+      raw = 1;
+    } else if (strcmp(args[i], "-p") == 0 && args[i + 1]) {
+      prompt = args[++i];
+    } else if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    } else {
+      err_printf("read: %s: invalid option\n", args[i]);
+      return 2;
+    }
+  }
+  if (prompt && isatty(STDIN_FILENO)) err_printf("%s", prompt);
+
+  size_t len = 0, cap = 128;
+  char* line = malloc(cap);
+  int c;
+  int status = 1;
+  while ((c = read_buffer_getc(STDIN_FILENO)) >= 0) {
+    if (c == '\n') {
+      status = 0;
+      break;
+    }
+    if (!raw && c == '\\') {
+      c = read_buffer_getc(STDIN_FILENO);
+      if (c == '\n') continue;  // line continuation
+      if (c < 0) break;
+    }
+    if (len + 1 >= cap) line = realloc(line, cap *= 2);
+    line[len++] = (char)c;
+  }
+  line[len] = '\0';
+  if (c == -2) {
+    err_printf("read: read error: %s\n", strerror(errno));
+    status = 1;
+  }
+
+  char** names = args + i;
+  if (names[0] == NULL) {
+    set_var("REPLY", line);
+    free(line);
+    return status;
+  }
+
+  const char* ifs = get_var("IFS");
+  if (ifs == NULL) ifs = " \t\n";
+  char* p = line;
+  while (*p && is_ifs_space(*p, ifs)) p++;
+
+  for (int k = 0; names[k]; k++) {
+    if (names[k + 1] == NULL) {
+      // Last name: the rest of the line without trailing IFS whitespace
+      char* end = p + strlen(p);
+      while (end > p && is_ifs_space(end[-1], ifs)) end--;
+      *end = '\0';
+      set_var(names[k], p);
+      break;
+    }
+
+    char* field = p;
+    while (*p && !strchr(ifs, *p)) p++;
+    char saved = *p;
+    *p = '\0';
+    set_var(names[k], field);
+    *p = saved;
+
+    // One delimiter, with any IFS whitespace around it
+    while (*p && is_ifs_space(*p, ifs)) p++;
+    if (*p && strchr(ifs, *p)) p++;
+    while (*p && is_ifs_space(*p, ifs)) p++;
+  }
+
+  free(line);
+  return status;
+}
+
+// Commands are parsed once into an AST and executed from it, so loop and
+// function bodies never go back through the lexer. Nodes and word parts are
+// bump-allocated from the arena of the command line that created them; argv
+// strings built while executing come from argv_arena and are released with a
+// mark/restore pair around each command.
+#define ARENA_CHUNK_SIZE 8192
+
+typedef struct arena_chunk {
+  struct arena_chunk* next;
+  size_t used;
+  size_t cap;
+  char* data;
+} arena_chunk;
+
+typedef struct {
+  arena_chunk* head;
+  int sub;  // MEM_PARSE, or MEM_EXPAND for argv_arena
+} arena;
+
+typedef struct {
+  arena_chunk* chunk;
+  size_t used;
+} arena_mark;
+
+static void* arena_alloc(arena* a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (!a->head || a->head->cap - a->head->used < size) {
+    size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    arena_chunk* c = mem_malloc(a->sub, sizeof(arena_chunk) + cap + 15);
+    if (!c) {
+      perror("malloc");
+      exit(1);
+    }
+    c->data = (char*)(((uintptr_t)(c + 1) + 15) & ~(uintptr_t)15);
+    c->next = a->head;
+    c->used = 0;
+    c->cap = cap;
+    a->head = c;
+  }
+  void* p = a->head->data + a->head->used;
+  a->head->used += size;
+  return p;
+}
+
+static char* arena_strndup(arena* a, const char* s, size_t len) {
+  char* p = arena_alloc(a, len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+static arena_mark arena_save(arena* a) {
+  arena_mark m = {a->head, a->head ? a->head->used : 0};
+  return m;
+}
+
+static void arena_restore(arena* a, arena_mark m) {
+  while (a->head && a->head != m.chunk) {
+    arena_chunk* next = a->head->next;
+    mem_free(a->sub, a->head);
+    a->head = next;
+  }
+  if (a->head) a->head->used = m.used;
+}
+
+static void arena_free(arena* a) {
+  arena_mark empty = {NULL, 0};
+  arena_restore(a, empty);
+}
+
+// A word is a list of parts: literal text, or a parameter, command or process
+// substitution to expand when the command runs. Quoted parts are never
+// field-split.
+enum { PART_LITERAL, PART_PARAM, PART_COMMAND, PART_PROC_IN, PART_PROC_OUT, PART_ARITH };
+
+typedef struct word_part {
+  struct word_part* next;
+  int type;
+  int quoted;
+  size_t len;
+  char* text;        // literal text, the parameter name or the command's source
+  struct node* sub;  // command of a substitution: parsed with the word, run on every expansion
+  struct arith_node* arith;  // $((expr)) without expansions, compiled with the word
+} word_part;
+
+// >, >>, << (here-document; target is the body), <<< (here-string), <, n>&m
+// and n<&m (target is m or -), &> and &>>
+enum {
+  REDIR_OUTPUT,
+  REDIR_APPEND,
+  REDIR_HEREDOC,
+  REDIR_HERESTRING,
+  REDIR_INPUT,
+  REDIR_DUP,
+  REDIR_BOTH,
+  REDIR_BOTH_APPEND
+};
+
+typedef struct redirect {
+  struct redirect* next;
+  int fd;
+  int op;
+  word_part* target;
+} redirect;
+
+enum {
+  NODE_SIMPLE,
+  NODE_PIPELINE,
+  NODE_AND,
+  NODE_OR,
+  NODE_LIST,
+  NODE_IF,
+  NODE_WHILE,
+  NODE_UNTIL,
+  NODE_FOR,
+  NODE_CASE,
+  NODE_CASE_ITEM,
+  NODE_FUNCTION,
+  NODE_GROUP,
+  NODE_SUBSHELL,
+  NODE_ARITH  // ((expr)): words[0] is the expression
+};
+
+typedef struct node {
+  int type;
+  int negate;          // pipeline preceded by !
+  struct node* a;      // condition, left side, body of a function or group
+  struct node* b;      // then-part, right side, loop body
+  struct node* c;      // else-part (elif is a nested NODE_IF)
+  struct node** kids;  // list items, pipeline stages, case items
+  int nkids;
+  word_part** words;   // command words, for-list (NULL means "$@"), case subject/patterns
+  int nwords;
+  word_part** assigns;  // NAME=value words before the command name
+  int nassigns;
+  redirect* redirs;
+  char* name;  // for variable or function name
+} node;
+
+// Functions keep the arena of the line that defined them alive
+typedef struct shell_function {
+  char* name;
+  node* body;
+  struct shell_function* next;
+} shell_function;
+
+static shell_function* functions = NULL;
+static int retain_parse_arena = 0;
+
+static arena argv_arena = {NULL, MEM_EXPAND};
+static const char* shell_name = "chefs_shell";  // $0
+static char** positional = NULL;  // $1 ... $n
+static int positional_count = 0;
+
+// break / continue / return unwind through exec_node until a loop or function takes them
+enum { UNWIND_NONE, UNWIND_BREAK, UNWIND_CONTINUE, UNWIND_RETURN };
+static int unwind = UNWIND_NONE;
+static int unwind_levels = 0;
+static int loop_depth = 0;
+static int function_depth = 0;
+
+static pid_t shell_pid;
+
+static shell_function* find_function(const char* name) {
+  for (shell_function* f = functions; f; f = f->next) {
+    if (strcmp(f->name, name) == 0) return f;
+  }
+  return NULL;
+}
+
+static int is_builtin(const char* cmd);
+
+// Resolved command paths, as bash's hash table keeps them: by name, valid for
+// the $PATH they were found with. A cached path costs one access() to confirm
+// instead of an access() per PATH directory. The front end fills the table
+// ahead of time: while a command name is being typed, prefetch_command hands
+// it to a worker thread, so on slow (network) PATH directories the scan
+// overlaps the typing instead of following Enter.
+#define COMMAND_PATHS 64
+#define COMMAND_PATH_PROBES 8
+
+typedef struct {
+  char* name;
+  char* path;  // NULL: not found on that PATH
+  size_t path_hash;
+} command_path;
+
+static command_path command_paths[COMMAND_PATHS];
+static pthread_mutex_t command_paths_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_wanted = PTHREAD_COND_INITIALIZER;
+static char* prefetch_name = NULL;  // the latest request, taken by the worker
+static char* prefetch_path = NULL;
+static int prefetch_started = 0;
+
+// Search the directories of path for cmd; safe to call from the worker
+static int search_path(const char* path, const char* cmd, char* out, size_t size) {
+  const char* dir = path;
+  for (;;) {
+    const char* end = strchrnul(dir, ':');
+    if (end > dir) {
+      snprintf(out, size, "%.*s/%s", (int)(end - dir), dir, cmd);
+      if (access(out, X_OK) == 0) return 1;
+    }
+    if (*end == '\0') return 0;
+    dir = end + 1;
+  }
+}
+
+// With command_paths_lock held
+static command_path* find_command_path(const char* cmd, size_t path_hash) {
+  size_t home = hash_name(cmd, strlen(cmd));
+  for (size_t k = 0; k < COMMAND_PATH_PROBES; k++) {
+    command_path* c = &command_paths[(home + k) % COMMAND_PATHS];
+    if (c->name && c->path_hash == path_hash && strcmp(c->name, cmd) == 0) return c;
+  }
+  return NULL;
+}
+
+// With command_paths_lock held; an old entry makes way when the probes are full
+static void store_command_path(const char* cmd, size_t path_hash, const char* found) {
+  size_t home = hash_name(cmd, strlen(cmd));
+  command_path* slot = &command_paths[home % COMMAND_PATHS];
+  for (size_t k = 0; k < COMMAND_PATH_PROBES; k++) {
+    command_path* c = &command_paths[(home + k) % COMMAND_PATHS];
+    if (!c->name || strcmp(c->name, cmd) == 0) {
+      slot = c;
+      break;
+    }
+  }
+  mem_free(MEM_CACHES, slot->name);
+  mem_free(MEM_CACHES, slot->path);
+  slot->name = mem_strdup(MEM_CACHES, cmd);
+  slot->path = found ? mem_strdup(MEM_CACHES, found) : NULL;
+  slot->path_hash = path_hash;
+}
+
+static void* prefetch_worker(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&command_paths_lock);
+  for (;;) {
+    while (!prefetch_name) pthread_cond_wait(&prefetch_wanted, &command_paths_lock);
+    char* cmd = prefetch_name;
+    char* path = prefetch_path;
+    prefetch_name = NULL;
+    prefetch_path = NULL;
+    size_t path_hash = hash_name(path, strlen(path));
+    if (!find_command_path(cmd, path_hash)) {
+      // The slow part runs unlocked, so the shell never waits on it
+      pthread_mutex_unlock(&command_paths_lock);
+      char found[PATH_MAX];
+      int ok = search_path(path, cmd, found, sizeof(found));
+      pthread_mutex_lock(&command_paths_lock);
+      store_command_path(cmd, path_hash, ok ? found : NULL);
+    }
+    mem_free(MEM_CACHES, cmd);
+    mem_free(MEM_CACHES, path);
+  }
+  return NULL;
+}
+
+// A fork() while the worker holds the lock must not leave it locked in the child
+static void lock_command_paths(void) { pthread_mutex_lock(&command_paths_lock); }
+static void unlock_command_paths(void) { pthread_mutex_unlock(&command_paths_lock); }
+
+// Start resolving cmd in the background; returns at once
+static void prefetch_command(const char* cmd) {
+  if (*cmd == '\0' || strchr(cmd, '/') || strlen(cmd) > NAME_MAX) return;
+  const char* path = getenv("PATH");
+  if (path == NULL) path = "";
+  size_t path_hash = hash_name(path, strlen(path));
+
+  pthread_mutex_lock(&command_paths_lock);
+  if (!prefetch_started) {
+    pthread_t worker;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&worker, &attr, prefetch_worker, NULL) == 0) {
+      pthread_atfork(lock_command_paths, unlock_command_paths, unlock_command_paths);
+      prefetch_started = 1;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  if (prefetch_started && !find_command_path(cmd, path_hash)) {
+    mem_free(MEM_CACHES, prefetch_name);
+    mem_free(MEM_CACHES, prefetch_path);
+    prefetch_name = mem_strdup(MEM_CACHES, cmd);
+    prefetch_path = mem_strdup(MEM_CACHES, path);
+    pthread_cond_signal(&prefetch_wanted);
+  }
+  pthread_mutex_unlock(&command_paths_lock);
+}
+
+// Search PATH for an executable; names with a slash are used as they are
+static int find_in_path(const char* cmd, char* out, size_t size) {
+  if (strchr(cmd, '/')) {
+    snprintf(out, size, "%s", cmd);
+    return access(out, X_OK) == 0;
+  }
+
+  const char* path = getenv("PATH");
+  if (path == NULL) path = "";
+  size_t path_hash = hash_name(path, strlen(path));
+
+  int cached = 0;
+  pthread_mutex_lock(&command_paths_lock);
+  command_path* c = find_command_path(cmd, path_hash);
+  if (c && c->path) {
+    snprintf(out, size, "%s", c->path);
+    cached = 1;
+  }
+  pthread_mutex_unlock(&command_paths_lock);
+  if (cached && access(out, X_OK) == 0) return 1;
+
+  int found = search_path(path, cmd, out, size);
+  pthread_mutex_lock(&command_paths_lock);
+  store_command_path(cmd, path_hash, found ? out : NULL);
+  pthread_mutex_unlock(&command_paths_lock);
+  return found;
+}
+
+static int builtin_echo(char* args[]) {
+  for (int i = 1; args[i]; i++) {
+    out_write(&builtin_out, args[i], strlen(args[i]));
+    if (args[i + 1]) out_write(&builtin_out, " ", 1);
+  }
+  out_write(&builtin_out, "\n", 1);
+  return 0;
+}
+
+static int builtin_type(char* args[]) {
+  int status = 0;
+  for (int i = 1; args[i]; i++) {
+    char* target = args[i];
+    char fullpath[PATH_MAX];
+
+    if (find_function(target)) {
+      out_printf("%s is a function\n", target);
+    } else if (is_builtin(target)) {
+      out_printf("%s is a shell builtin\n", target);
+    } else if (find_in_path(target, fullpath, sizeof(fullpath))) {
+      out_printf("%s is %s\n", target, fullpath);
+    } else {
+      out_printf("%s: not found\n", target);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+static int builtin_pwd(char* args[]) {
+  (void)args;
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    perror("getcwd() error");
+    return 1;
+  }
+  out_printf("%s\n", cwd);
+  return 0;
+}
+
+static int builtin_cd(char* args[]) {
+  char* path = args[1];
+  if (path == NULL) return 0;
+
+  // home directory handling for cd
+  char fullpath[PATH_MAX];
+  if (path[0] == '~') {
+    char* home = getenv("HOME");
+    if (home == NULL) {
+      out_printf("cd: Home is not set\n");
+      return 1;
+    }
+    if (path[1] == '\0') {
+      path = home;
+    } else {
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", home, path + 2);
+      path = fullpath;
+    }
+  }
+
+  if (chdir(path) != 0) {
+    out_printf("cd: %s: No such file or directory\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+static int builtin_exit(char* args[]) {
+  int code = args[1] ? atoi(args[1]) : 0;
+  // Only the interactive shell owns the history file, not pipeline stages or subshells
+  if (getpid() != shell_pid) child_exit(code);
+  sync_history_file();
+  exit(code);
+}
+
+static int builtin_help(char* args[]) {
+  (void)args;
+  out_printf("\n\033[1;36m ChefsShell - All available commands\033[0m\n");
+  out_printf("\033[2m════════════════════════════════════════════════════════════\033[0m\n\n");
+
+  out_printf("\033[1;33mcache\033[0m [--ttl duration] [--dep file...] [--env name...] [--keep-failed] -- <command>\n");
+  out_printf("  Replay a command's saved output and status while its inputs are unchanged\n");
+  out_printf("  Only runs that exit 0 are saved, unless --keep-failed; signaled runs never are\n");
+  out_printf("  Example: cache --dep Cargo.lock -- cargo tree; cache --clear\n\n");
+
+  out_printf("\033[1;33mcd\033[0m [directory]\n");
+  out_printf("  Change the current working directory\n");
+  out_printf("  Examples: cd /home, cd .., cd ~\n\n");
+
+  out_printf("\033[1;33mmkdir\033[0m [directory]\n");
+  out_printf("  Create a new directory\n");
+  out_printf("  Examples: mkdir new_folder, mkdir -p parent/child\n\n");
+
+  out_printf("\033[1;33mecho\033[0m [text...]\n");
+  out_printf("  Display a line of text\n");
+  out_printf("  Supports redirection (<, >, >>, 2>, 2>&1, &>)\n");
+  out_printf("  Example: echo Hello World\n\n");
+
+  out_printf("\033[1;33mexit\033[0m [code]\n");
+  out_printf("  Exit the shell\n");
+  out_printf("  Example: exit 0\n\n");
+
+  out_printf("\033[1;33mgithub\033[0m\n");
+  out_printf("  Opens my GitHub profile link\n\n");
+
+  out_printf("\033[1;33mhelp\033[0m\n");
+  out_printf("  Display this help message\n\n");
+
+  out_printf("\033[1;33mhistory\033[0m [n]\n");
+  out_printf("  Display command history\n");
+  out_printf("  Options:\n");
+  out_printf("    history        - Show all history\n");
+  out_printf("    history n      - Show last n commands\n");
+  out_printf("    history -a     - Append new history to $HISTFILE, read other sessions'\n");
+  out_printf("    history -a file - Append new history to file\n");
+  out_printf("    history -w file - Write all history to file\n");
+  out_printf("    history -r file - Read history from file\n\n");
+
+  out_printf("\033[1;33mlinkedin\033[0m\n");
+  out_printf("  Opens my LinkedIn profile link\n\n");
+
+  out_printf("\033[1;33mmemstat\033[0m [-j]\n");
+  out_printf("  Show the shell's resident and peak memory and what each part of it holds\n");
+  out_printf("  -j prints one line of JSON, e.g. for monitoring long sessions\n\n");
+
+  out_printf("\033[1;33mfetchme\033[0m\n");
+  out_printf("  Display system and my information\n\n");
+
+  out_printf("\033[1;33mparallel\033[0m [-j N] <command> [args...] ::: <arg...>\n");
+  out_printf("  Run command once per arg ({} marks where it goes), N at a time (default: CPUs)\n");
+  out_printf("  Output is printed job by job in argument order; without ::: args are stdin lines\n");
+  out_printf("  Example: parallel -j 4 gzip ::: *.log\n\n");
+
+  out_printf("\033[1;33mpwd\033[0m\n");
+  out_printf("  Print current working directory\n\n");
+
+  out_printf("\033[1;33mprintf\033[0m <format> [arguments...]\n");
+  out_printf("  Print formatted text (%%s, %%d, %%x, %%f, %%b, ...)\n");
+  out_printf("  Example: printf \"%%s=%%d\\n\" count 3\n\n");
+
+  out_printf("\033[1;33mread\033[0m [-r] [-p prompt] [name...]\n");
+  out_printf("  Read a line from standard input into variables\n");
+  out_printf("  Example: read first rest\n\n");
+
+  out_printf("\033[1;33mresume\033[0m\n");
+  out_printf("  View resume on Google Drive\n\n");
+
+  out_printf("\033[1;33mscriptcache\033[0m [list|clear|dir]\n");
+  out_printf("  Show or clear the compiled forms of scripts run before\n\n");
+
+  out_printf("\033[1;33msource\033[0m <file> [args...], \033[1;33m.\033[0m <file>\n");
+  out_printf("  Run a script in the current shell\n");
+  out_printf("  Example: source ~/.chefsrc\n\n");
+
+  out_printf("\033[1;33mtest\033[0m <expression>, \033[1;33m[\033[0m <expression> ]\n");
+  out_printf("  Evaluate a condition (-f, -d, -z, =, -eq, -lt, !, -a, -o, ...)\n");
+  out_printf("  Example: [ -f notes.txt ]\n\n");
+
+  out_printf("\033[1;33mtimeout\033[0m [--foreground] [-s signal] [-k duration] <duration> <command>\n");
+  out_printf("  Run a command, stopping it and everything it started after duration (exit 124)\n");
+  out_printf("  One command, function or builtin; wrap a pipeline in a function to time it\n");
+  out_printf("  Example: timeout 2m make test\n\n");
+
+  out_printf("\033[1;33mtrue\033[0m, \033[1;33mfalse\033[0m\n");
+  out_printf("  Return a successful or failing status\n\n");
+
+  out_printf("\033[1;33mtype\033[0m <command>\n");
+  out_printf("  Display command type (builtin or path to executable)\n");
+  out_printf("  Example: type ls\n\n");
+
+  out_printf("\033[1;33myoutube\033[0m\n");
+  out_printf("  Opens my YouTube channel link\n\n");
+
+  out_printf("\033[1;32mScripting:\033[0m\n");
+  out_printf("  if/elif/else/fi, while/until ... do/done, for name in words; do ... done,\n");
+  out_printf("  case word in pattern) ... ;; esac, name() { ...; }, break, continue, return\n");
+  out_printf("  $(command) and `command` substitute the output of a command\n");
+  out_printf("  <(command) and >(command) pass a command's output or input as a file\n");
+  out_printf("  <<EOF, <<-EOF and <<< word feed text to a command's stdin\n");
+  out_printf("  $((expr)), ((expr)) and let expr evaluate 64-bit integer arithmetic\n");
+  out_printf("  $PIPESTATUS lists the exit status of every stage of the last pipeline\n");
+  out_printf("  Example: for f in $(ls); do echo $f; done\n\n");
+
+  out_printf("\033[1;32mExternal Commands:\033[0m\n");
+  out_printf("  Any executable in $PATH can be run\n");
+  out_printf("  Examples: ls, cat, grep, etc.\n\n");
+  return 0;
+}
+
+static int builtin_github(char* args[]) {
+  (void)args;
+  out_printf("\n\033[1;36m GitHub Profile\033[0m\n");
+  out_printf("\033[4;34mhttps://github.com/yogesh-rana-2301\033[0m\n\n");
+  return 0;
+}
+
+static int builtin_linkedin(char* args[]) {
+  (void)args;
+  out_printf("\n\033[1;36m  LinkedIn Profile\033[0m\n");
+  out_printf("\033[4;34mhttps://linkedin.com/in/yogesh-rana-sde\033[0m\n\n");
+  return 0;
+}
+
+static int builtin_resume(char* args[]) {
+  (void)args;
+  out_printf("\n\033[1;36m Resume\033[0m\n");
+  out_printf("\033[4;34mhttps://bit.ly/3LZn2Ia\033[0m\n\n");
+  return 0;
+}
+
+static int builtin_youtube(char* args[]) {
+  (void)args;
+  out_printf("\n\033[1;36m YouTube Channel\033[0m\n");
+  out_printf("\033[4;34mhttps://youtube.com/@SameerRana-2004\033[0m\n\n");
+  return 0;
+}
+
+// Personal info display
+static int builtin_fetchme(char* args[]) {
+  (void)args;
+  // Get system info
+  char hostname[256];
+  gethostname(hostname, sizeof(hostname));
+
+  char* user = getenv("USER");
+  if (user == NULL) user = "user";
+
+  out_printf("\n");
+
+  // Displaying Moebius Triangle logo on left, info on right
+  out_printf("   \033[1;33m           ____\033[0m                      \033[1;32m%s\033[0m@\033[1;32m%s\033[0m\n", user, hostname);
+  out_printf("   \033[1;33m          /   /\\\033[0m                      \033[1;90m---------------------------\033[0m\n");
+  out_printf("   \033[1;33m         /___/  \\\033[0m                     \033[1;36mName\033[0m:     Yogesh Rana\n");
+  out_printf("   \033[1;33m        /   /\\  /\\\033[0m                    \033[1;36mMajor\033[0m:    Computer Science (CS)\n");
+  out_printf("   \033[1;33m       /   /  \\/  \\\033[0m                   \033[1;36mStack\033[0m:    C++, Python, Web Dev\n");
+  out_printf("   \033[1;33m      /   /   /\\   \\\033[0m                  \033[1;36mFocus\033[0m:    DSA & System Design\n");
+  out_printf("   \033[1;36m     /   /   /  \\   \\\033[0m                 \033[1;36mGoal\033[0m:     Money\n");
+  out_printf("   \033[1;36m    /   /   /\\   \\   \\\033[0m                \033[1;36mLoc\033[0m:      Chandigarh, India\n");
+  out_printf("   \033[1;36m   /   /   /  \\   \\   \\\033[0m               \033[1;36mStatus\033[0m:   Open to Work\n");
+  out_printf("   \033[1;34m  /___/___/____\\   \\   \\\033[0m              \033[1;36mShell\033[0m:    ChefsShell v1.0\n");
+  out_printf("   \033[1;34m /   /          \\   \\  /\\\033[0m             \033[1;36mTerminal\033[0m: xterm-256color\n");
+  out_printf("   \033[1;34m/___/____________\\___\\/  \\\033[0m            \033[1;36mOS\033[0m:       Windows 11\n");
+  out_printf("   \033[1;35m\\   \\             \\   \\  /\033[0m            \033[1;36mCPU\033[0m:      Intel Core i7\n");
+  out_printf("   \033[1;35m \\___\\_____________\\___\\/\033[0m             \033[1;36mGPU\033[0m:      AMD\n");
+
+  out_printf("\n");
+
+  // decoration color pallete
+  out_printf("                                         \033[1;90m█\033[0m\033[1;91m█\033[0m\033[1;92m█\033[0m\033[1;93m█\033[0m\033[1;94m█\033[0m\033[1;95m█\033[0m\033[1;96m█\033[0m\033[1;97m█\033[0m\n");
+  out_printf("\n");
+
+  // Resume Box
+  out_printf("   \033[1;36m╔════════════════════════════════════╗\033[0m\n");
+  out_printf("   \033[1;36m║\033[0m \033[1;37m Resume:      \033[0m                   \033[1;36m  ║\033[0m\n");
+  out_printf("   \033[1;36m╠════════════════════════════════════╣\033[0m\n");
+  out_printf("   \033[1;36m║\033[0m  \033[4;34mhttps://bit.ly/3LZn2Ia\033[0m  \033[1;36m          ║\033[0m\n");
+  out_printf("   \033[1;36m╚════════════════════════════════════╝\033[0m\n\n");
+  return 0;
+}
+
+static int builtin_history(char* args[]) {
+  ensure_history_loaded();
+
+  // history -a alone: share new entries through $HISTFILE now rather than after the command
+  if (args[1] && strcmp(args[1], "-a") == 0 && !args[2]) {
+    sync_history_file();
+    return 0;
+  }
+
+  // add history to a file (append basically )
+  if (args[1] && strcmp(args[1], "-a") == 0 && args[2]) {
+    FILE* fp = fopen(args[2], "a");
+    if (!fp) {
+      out_printf("history: cannot open %s\n", args[2]);
+      return 1;
+    }
+
+    write_history_entries(fp, shell_history.count - shell_history.unappended);
+    shell_history.unappended = 0;
+
+    fclose(fp);
+    return 0;
+  }
+
+  // write history to file
+  if (args[1] && strcmp(args[1], "-w") == 0 && args[2]) {
+    FILE* fp = fopen(args[2], "w");
+    if (!fp) {
+      out_printf("history: cannot open %s\n", args[2]);
+      return 1;
+    }
+
+    write_history_entries(fp, 0);
+
+    fclose(fp);
+    return 0;
+  }
+
+  // Case: history -r <file>
+  if (args[1] && strcmp(args[1], "-r") == 0 && args[2]) {
+    if (load_history_from_file(args[2]) < 0) {
+      out_printf("history: cannot open %s\n", args[2]);
+      return 1;
+    }
+    return 0;
+  }
+
+  int limit = -1;  // -1 means show all
+  if (args[1] && args[1][0] >= '0' && args[1][0] <= '9') {
+    limit = atoi(args[1]);
+  }
+
+  int total = shell_history.count;
+
+  // Calculate starting index
+  int start = 0;
+  if (limit > 0 && limit < total) {
+    start = total - limit;
+  }
+
+  for (int i = start; i < total; i++) {
+    out_printf("%5d  %s\n", i + 1, hist_line(i));
+  }
+  return 0;
+}
+
+static int loop_control(char* args[], int kind) {
+  if (loop_depth == 0) {
+    err_printf("%s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+    return 0;
+  }
+  int levels = args[1] ? atoi(args[1]) : 1;
+  if (levels < 1) {
+    err_printf("%s: %s: loop count out of range\n", args[0], args[1]);
+    return 1;
+  }
+  unwind = kind;
+  unwind_levels = levels > loop_depth ? loop_depth : levels;
+  return 0;
+}
+
+static int builtin_break(char* args[]) { return loop_control(args, UNWIND_BREAK); }
+
+static int builtin_continue(char* args[]) { return loop_control(args, UNWIND_CONTINUE); }
+
+static int builtin_return(char* args[]) {
+  if (function_depth == 0) {
+    err_printf("return: can only `return' from a function\n");
+    return 1;
+  }
+  unwind = UNWIND_RETURN;
+  return args[1] ? atoi(args[1]) & 0xff : last_status;
+}
+
+// A "Vm...:  1234 kB" line of /proc/self/status, in bytes; 0 if not there
+static size_t proc_status_bytes(const char* key) {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) return 0;
+  char line[256];
+  size_t len = strlen(key), kb = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, len) == 0 && line[len] == ':') {
+      kb = strtoull(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kb * 1024;
+}
+
+// memstat [-j]: resident memory, malloc's totals, and what the counted
+// subsystems (and the front end's sources) hold. Whatever the heap holds
+// beyond those is reported as untracked.
+static int builtin_memstat(char* args[]) {
+  int json = 0;
+  for (int i = 1; args[i]; i++) {
+    if (strcmp(args[i], "-j") == 0 || strcmp(args[i], "--json") == 0) {
+      json = 1;
+    } else {
+      err_printf("memstat: %s: invalid option\nmemstat: usage: memstat [-j]\n", args[i]);
+      return 2;
+    }
+  }
+
+  size_t rss = proc_status_bytes("VmRSS");
+  size_t rss_peak = proc_status_bytes("VmHWM");
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  // Small blocks come from the arenas, large ones are mapped one by one
+  size_t heap = (size_t)mi.uordblks + (size_t)mi.hblkhd;
+  size_t heap_system = (size_t)mi.arena + (size_t)mi.hblkhd;
+  size_t fixed = sizeof(out_storage) + sizeof(read_buffers);
+
+  mem_counter now[MEM_SUBSYSTEMS];
+  size_t tracked = 0;
+  for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+    now[i].bytes = __atomic_load_n(&mem_counters[i].bytes, __ATOMIC_RELAXED);
+    now[i].peak = __atomic_load_n(&mem_counters[i].peak, __ATOMIC_RELAXED);
+    now[i].blocks = __atomic_load_n(&mem_counters[i].blocks, __ATOMIC_RELAXED);
+    now[i].mapped = __atomic_load_n(&mem_counters[i].mapped, __ATOMIC_RELAXED);
+    tracked += now[i].bytes;
+  }
+  size_t source_bytes[MEM_SOURCES];
+  for (int i = 0; i < MEM_SOURCES && mem_sources[i].name; i++) {
+    source_bytes[i] = mem_sources[i].bytes();
+    tracked += source_bytes[i];
+  }
+  size_t untracked = heap > tracked ? heap - tracked : 0;
+
+  if (json) {
+    out_printf("{\"pid\":%d,\"rss\":%zu,\"rss_peak\":%zu,\"heap\":%zu,\"heap_system\":%zu,\"static\":%zu,"
+               "\"subsystems\":{",
+               (int)getpid(), rss, rss_peak, heap, heap_system, fixed);
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+      out_printf("%s\"%s\":{\"bytes\":%zu,\"peak\":%zu,\"blocks\":%zu,\"mapped\":%zu}", i ? "," : "", mem_names[i],
+                 now[i].bytes, now[i].peak, now[i].blocks, now[i].mapped);
+    }
+    for (int i = 0; i < MEM_SOURCES && mem_sources[i].name; i++) {
+      out_printf(",\"%s\":{\"bytes\":%zu}", mem_sources[i].name, source_bytes[i]);
+    }
+    out_printf("},\"untracked\":%zu}\n", untracked);
+    return 0;
+  }
+
+  out_printf("%-12s %10zu  peak %zu\n", "rss", rss, rss_peak);
+  out_printf("%-12s %10zu  of %zu taken from the system\n", "heap", heap, heap_system);
+  out_printf("%-12s %10zu  output and read buffers\n\n", "static", fixed);
+  out_printf("%-12s %10s %10s %8s %10s\n", "subsystem", "bytes", "peak", "blocks", "mapped");
+  for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+    out_printf("%-12s %10zu %10zu %8zu %10zu\n", mem_names[i], now[i].bytes, now[i].peak, now[i].blocks,
+               now[i].mapped);
+  }
+  for (int i = 0; i < MEM_SOURCES && mem_sources[i].name; i++) {
+    out_printf("%-12s %10zu %10s %8s %10s\n", mem_sources[i].name, source_bytes[i], "-", "-", "-");
+  }
+  out_printf("%-12s %10zu\n", "untracked", untracked);
+  return 0;
+}
+
+static int builtin_source(char* args[]);
+static int builtin_scriptcache(char* args[]);
+static int builtin_cache(char* args[]);
+static int builtin_let(char* args[]);
+static int builtin_parallel(char* args[]);
+static int builtin_timeout(char* args[]);
+
+static builtin_command builtin_commands[] = {
+    {".", builtin_source, 0},
+    {"[", builtin_test, 1},
+    {"break", builtin_break, 0},
+    {"cache", builtin_cache, 0},
+    {"cd", builtin_cd, 0},
+    {"continue", builtin_continue, 0},
+    {"echo", builtin_echo, 1},
+    {"exit", builtin_exit, 0},
+    {"false", builtin_false, 1},
+    {"fetchme", builtin_fetchme, 1},
+    {"github", builtin_github, 1},
+    {"help", builtin_help, 1},
+    {"history", builtin_history, 0},
+    {"let", builtin_let, 0},
+    {"linkedin", builtin_linkedin, 1},
+    {"memstat", builtin_memstat, 1},
+    {"parallel", builtin_parallel, 0},
+    {"printf", builtin_printf, 1},
+    {"pwd", builtin_pwd, 1},
+    {"read", builtin_read, 0},
+    {"resume", builtin_resume, 1},
+    {"return", builtin_return, 0},
+    {"scriptcache", builtin_scriptcache, 0},
+    {"source", builtin_source, 0},
+    {"test", builtin_test, 1},
+    {"timeout", builtin_timeout, 0},
+    {"true", builtin_true, 1},
+    {"type", builtin_type, 1},
+    {"youtube", builtin_youtube, 1},
+    {NULL, NULL, 0}};
+
+#define BUILTIN_COUNT (sizeof(builtin_commands) / sizeof(builtin_commands[0]) - 1)
+
+static int compare_builtin(const void* key, const void* entry) {
+  return strcmp((const char*)key, ((const builtin_command*)entry)->name);
+}
+
+static builtin_command* find_builtin_command(const char* cmd) {
+  return bsearch(cmd, builtin_commands, BUILTIN_COUNT, sizeof(builtin_command), compare_builtin);
+}
+
+static int is_builtin(const char* cmd) { return find_builtin_command(cmd) != NULL; }
+
+// Parser: a small recursive-descent parser over a token stream. Reserved words
+// (if, then, while, ...) are plain WORD tokens recognized by position.
+enum {
+  TOK_EOF,
+  TOK_WORD,
+  TOK_NEWLINE,
+  TOK_SEMI,
+  TOK_DSEMI,
+  TOK_PIPE,
+  TOK_AND_IF,
+  TOK_OR_IF,
+  TOK_LPAREN,
+  TOK_RPAREN,
+  TOK_REDIRECT
+};
+
+// PARSE_INCOMPLETE means the input ended inside a quote or compound command
+enum { PARSE_OK, PARSE_INCOMPLETE, PARSE_ERROR };
+
+typedef struct {
+  int type;
+  const char* start;
+  size_t len;
+  int fd;  // TOK_REDIRECT: descriptor and REDIR_* operator
+  int op;
+  int strip_tabs;  // <<-
+} token;
+
+// A here-document whose body starts after the next newline
+typedef struct {
+  redirect* r;
+  char* delimiter;
+  int quoted;  // quoted delimiter: the body is taken literally
+  int strip_tabs;
+} pending_heredoc;
+
+#define MAX_PENDING_HEREDOCS 16
+
+typedef struct {
+  const char* src;
+  size_t src_len;
+  const uint64_t* special;  // index_specials(src), while parse_all runs
+  size_t pos;
+  token tok;
+  int status;
+  token error_tok;
+  arena* arena;
+  pending_heredoc heredocs[MAX_PENDING_HEREDOCS];
+  int nheredocs;
+} parser;
+
+typedef struct {
+  void** items;
+  int count;
+  int cap;
+} ptr_vec;
+
+static void vec_push(ptr_vec* v, void* item) {
+  if (v->count == v->cap) {
+    v->cap = v->cap ? v->cap * 2 : 8;
+    v->items = realloc(v->items, v->cap * sizeof(void*));
+    if (!v->items) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  v->items[v->count++] = item;
+}
+
+// Move a finished vector into the arena; returns NULL for an empty one
+static void** vec_finish(arena* a, ptr_vec* v) {
+  void** items = NULL;
+  if (v->count > 0) {
+    items = arena_alloc(a, v->count * sizeof(void*));
+    memcpy(items, v->items, v->count * sizeof(void*));
+  }
+  free(v->items);
+  v->items = NULL;
+  v->cap = 0;
+  return items;
+}
+
+static size_t skip_substitution(const char* s, size_t i);
+
+static size_t skip_backquote(const char* s, size_t i) {
+  while (s[i] && s[i] != '`') {
+    if (s[i] == '\\' && s[i + 1]) i++;
+    i++;
+  }
+  return s[i] ? i + 1 : 0;
+}
+
+// s[i] is just after an opening "; returns the index after the closing one, 0 if there is none
+static size_t skip_dquote(const char* s, size_t i) {
+  while (s[i] && s[i] != '"') {
+    if (s[i] == '\\' && s[i + 1]) {
+      i += 2;
+    } else if (s[i] == '$' && s[i + 1] == '(') {
+      i = skip_substitution(s, i + 2);
+      if (!i) return 0;
+    } else if (s[i] == '`') {
+      i = skip_backquote(s, i + 1);
+      if (!i) return 0;
+    } else {
+      i++;
+    }
+  }
+  return s[i] ? i + 1 : 0;
+}
+
+// s[i] is just after "$("; returns the index after the matching ), 0 if there is none
+static size_t skip_substitution(const char* s, size_t i) {
+  int depth = 1;
+  while (s[i]) {
+    char c = s[i];
+    if (c == '\\' && s[i + 1]) {
+      i += 2;
+    } else if (c == '\'') {
+      const char* close = strchr(s + i + 1, '\'');
+      if (!close) return 0;
+      i = close - s + 1;
+    } else if (c == '"') {
+      i = skip_dquote(s, i + 1);
+      if (!i) return 0;
+    } else if (c == '`') {
+      i = skip_backquote(s, i + 1);
+      if (!i) return 0;
+    } else {
+      if (c == '(') depth++;
+      if (c == ')' && --depth == 0) return i + 1;
+      i++;
+    }
+  }
+  return 0;
+}
+
+static word_part* parse_heredoc_body(parser* p, const char* body, size_t len, int quoted);
+
+// Read the bodies of the here-documents started on the line that ends at s[i];
+// returns the index after the last delimiter line
+static size_t read_heredocs(parser* p, size_t i) {
+  const char* s = p->src;
+  size_t k = i + 1;
+  for (int h = 0; h < p->nheredocs; h++) {
+    pending_heredoc* hd = &p->heredocs[h];
+    size_t delim_len = strlen(hd->delimiter);
+    char* body = malloc(strlen(s + k) + 1);
+    size_t body_len = 0;
+
+    for (;;) {
+      size_t start = k;
+      if (hd->strip_tabs) {
+        while (s[start] == '\t') start++;
+      }
+      size_t end = start;
+      while (s[end] && s[end] != '\n') end++;
+      if (end - start == delim_len && strncmp(s + start, hd->delimiter, delim_len) == 0) {
+        k = s[end] ? end + 1 : end;
+        break;
+      }
+      if (!s[end]) {
+        // Delimiter not seen yet: more input needed
+        free(body);
+        p->status = PARSE_INCOMPLETE;
+        return strlen(s);
+      }
+      memcpy(body + body_len, s + start, end + 1 - start);
+      body_len += end + 1 - start;
+      k = end + 1;
+    }
+
+    hd->r->target = parse_heredoc_body(p, body, body_len, hd->quoted);
+    free(body);
+  }
+  p->nheredocs = 0;
+  return k;
+}
+
+// Character index for the lexer. Outside quotes a word only ends or changes
+// meaning at a blank, a control character, a quote, a backslash, $, ` or an
+// operator character. Before lexing, parse_all marks every such byte of the source
+// in a bitmap, 64 bytes per word: the SSE2 and AVX2 versions compare 16 or 32
+// bytes at a time against the set and keep the movemask. The lexer and the word
+// parser then jump straight to the next set bit instead of testing each character.
+// CHEFS_LEXER=scalar|sse2|avx2 picks a version (for benchmarking); by default the
+// widest one the CPU supports is used.
+static const unsigned char word_special[256] = {
+    [0 ... 0x20] = 1, [';'] = 1, ['|'] = 1, ['&'] = 1, ['('] = 1, [')'] = 1, ['<'] = 1,
+    ['>'] = 1,        ['\\'] = 1, ['\''] = 1, ['"'] = 1, ['`'] = 1, ['$'] = 1,
+};
+
+// Bit k is set when block[k] is special
+static uint64_t special_mask_scalar(const char* block) {
+  uint64_t mask = 0;
+  for (int k = 0; k < 64; k++) {
+    mask |= (uint64_t)word_special[(unsigned char)block[k]] << k;
+  }
+  return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static inline uint64_t special_mask_16(const char* p) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  // Unsigned v <= 0x20 catches NUL, blanks and newlines
+  __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x20)), v);
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('`')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+  return (uint16_t)_mm_movemask_epi8(m);
+}
+
+static __attribute__((target("sse2"))) uint64_t special_mask_sse2(const char* block) {
+  return special_mask_16(block) | special_mask_16(block + 16) << 16 |
+         special_mask_16(block + 32) << 32 | special_mask_16(block + 48) << 48;
+}
+
+__attribute__((target("avx2"))) static inline uint64_t special_mask_32(const char* p) {
+  __m256i v = _mm256_loadu_si256((const __m256i*)p);
+  __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x20)), v);
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('`')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+  return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+static __attribute__((target("avx2"))) uint64_t special_mask_avx2(const char* block) {
+  return special_mask_32(block) | special_mask_32(block + 32) << 32;
+}
+#endif
+
+static uint64_t special_mask_select(const char* block);
+static uint64_t (*special_mask)(const char* block) = special_mask_select;
+
+// Use the named version; -1 if it is unknown or the CPU lacks it
+static int set_lexer(const char* name) {
+  if (strcmp(name, "scalar") == 0) {
+    special_mask = special_mask_scalar;
+    return 0;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    special_mask = special_mask_sse2;
+    return 0;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    special_mask = special_mask_avx2;
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+// First call: pick the version, then forward to it
+static uint64_t special_mask_select(const char* block) {
+  const char* want = getenv("CHEFS_LEXER");
+  if (want == NULL || set_lexer(want) != 0) {
+    if (set_lexer("avx2") != 0 && set_lexer("sse2") != 0) set_lexer("scalar");
+  }
+  return special_mask(block);
+}
+
+// Bitmap of the special bytes of s[0..len); bit len, for the NUL, is always set
+static uint64_t* index_specials(const char* s, size_t len) {
+  size_t full = len / 64;
+  uint64_t* bits = malloc((full + 1) * sizeof(uint64_t));
+  if (!bits) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t w = 0; w < full; w++) bits[w] = special_mask(s + w * 64);
+  // The last block is padded with NULs, which are special themselves
+  char tail[64] = {0};
+  memcpy(tail, s + full * 64, len - full * 64);
+  bits[full] = special_mask(tail);
+  return bits;
+}
+
+// Index of the first special byte of p->src at or after i
+static size_t next_special(const parser* p, size_t i) {
+  size_t w = i / 64;
+  uint64_t bits = p->special[w] & (~(uint64_t)0 << (i % 64));
+  while (!bits) bits = p->special[++w];
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+// The same for a NUL-terminated s that may or may not lie inside p->src
+static size_t find_special(const parser* p, const char* s, size_t i) {
+  if (p->special && s >= p->src && s <= p->src + p->src_len) {
+    size_t base = s - p->src;
+    return next_special(p, base + i) - base;
+  }
+  while (!word_special[(unsigned char)s[i]]) i++;
+  return i;
+}
+
+static void lex_next(parser* p) {
+  const char* s = p->src;
+  size_t i = p->pos;
+
+  for (;;) {
+    while (s[i] == ' ' || s[i] == '\t') i++;
+    if (s[i] == '\\' && s[i + 1] == '\n') {
+      i += 2;
+      continue;
+    }
+    if (s[i] == '#') {
+      i = strchrnul(s + i, '\n') - s;
+    }
+    break;
+  }
+
+  token* t = &p->tok;
+  t->start = s + i;
+  t->len = 1;
+  t->fd = -1;
+  t->op = REDIR_OUTPUT;
+  t->strip_tabs = 0;
+
+  char c = s[i];
+  size_t digits = 0;
+  while (isdigit((unsigned char)s[i + digits])) digits++;
+
+  if (c == '\0') {
+    t->type = TOK_EOF;
+    t->len = 0;
+    if (p->nheredocs > 0) p->status = PARSE_INCOMPLETE;
+  } else if (c == '\n') {
+    t->type = TOK_NEWLINE;
+    if (p->nheredocs > 0) {
+      p->pos = read_heredocs(p, i);
+      return;
+    }
+  } else if (c == ';') {
+    t->type = s[i + 1] == ';' ? TOK_DSEMI : TOK_SEMI;
+    t->len = t->type == TOK_DSEMI ? 2 : 1;
+  } else if (c == '|') {
+    t->type = s[i + 1] == '|' ? TOK_OR_IF : TOK_PIPE;
+    t->len = t->type == TOK_OR_IF ? 2 : 1;
+  } else if (c == '&' && s[i + 1] == '&') {
+    t->type = TOK_AND_IF;
+    t->len = 2;
+  } else if (c == '(') {
+    t->type = TOK_LPAREN;
+  } else if (c == ')') {
+    t->type = TOK_RPAREN;
+  } else if (c == '&' && s[i + 1] == '>') {
+    // &>, &>>
+    size_t j = i + 2;
+    t->fd = 1;
+    t->op = REDIR_BOTH;
+    if (s[j] == '>') {
+      t->op = REDIR_BOTH_APPEND;
+      j++;
+    }
+    t->type = TOK_REDIRECT;
+    t->len = j - i;
+  } else if ((c == '>' && s[i + 1] != '(') || (digits > 0 && s[i + digits] == '>')) {
+    // >, >>, >&, with an optional fd
+    size_t j = i + digits;
+    t->fd = digits > 0 ? atoi(s + i) : 1;
+    j++;
+    if (s[j] == '>') {
+      t->op = REDIR_APPEND;
+      j++;
+    } else if (s[j] == '&') {
+      t->op = REDIR_DUP;
+      j++;
+    }
+    t->type = TOK_REDIRECT;
+    t->len = j - i;
+  } else if (s[i + digits] == '<' && s[i + digits + 1] == '<') {
+    // <<, <<-, <<<, with an optional fd
+    size_t j = i + digits + 2;
+    t->fd = digits > 0 ? atoi(s + i) : 0;
+    t->op = REDIR_HEREDOC;
+    if (s[j] == '<') {
+      t->op = REDIR_HERESTRING;
+      j++;
+    } else if (s[j] == '-') {
+      t->strip_tabs = 1;
+      j++;
+    }
+    t->type = TOK_REDIRECT;
+    t->len = j - i;
+  } else if ((c == '<' && s[i + 1] != '(') || (digits > 0 && s[i + digits] == '<')) {
+    // <, <&, with an optional fd
+    size_t j = i + digits + 1;
+    t->fd = digits > 0 ? atoi(s + i) : 0;
+    t->op = REDIR_INPUT;
+    if (s[j] == '&') {
+      t->op = REDIR_DUP;
+      j++;
+    }
+    t->type = TOK_REDIRECT;
+    t->len = j - i;
+  } else {
+    size_t j = i;
+    while (s[j]) {
+      char d = s[j];
+      if ((d == '<' || d == '>') && s[j + 1] == '(') {
+        // <(cmd) and >(cmd) are part of the word
+        size_t end = skip_substitution(s, j + 2);
+        if (!end) {
+          p->status = PARSE_INCOMPLETE;
+          j += strlen(s + j);
+          break;
+        }
+        j = end;
+        continue;
+      }
+      if (d == ' ' || d == '\t' || d == '\n' || d == ';' || d == '|' || d == '(' || d == ')' ||
+          d == '>' || d == '<' || (d == '&' && (s[j + 1] == '&' || s[j + 1] == '>'))) {
+        break;
+      }
+      if (d == '\\') {
+        if (s[j + 1] == '\0') {
+          p->status = PARSE_INCOMPLETE;
+          j++;
+          break;
+        }
+        j += 2;
+      } else if (d == '\'') {
+        const char* close = strchr(s + j + 1, '\'');
+        if (!close) {
+          p->status = PARSE_INCOMPLETE;
+          j += strlen(s + j);
+          break;
+        }
+        j = close - s + 1;
+      } else if (d == '"' || d == '`' || (d == '$' && s[j + 1] == '(')) {
+        size_t end;
+        if (d == '"') {
+          end = skip_dquote(s, j + 1);
+        } else if (d == '`') {
+          end = skip_backquote(s, j + 1);
+        } else {
+          end = skip_substitution(s, j + 2);
+        }
+        if (!end) {
+          p->status = PARSE_INCOMPLETE;
+          j += strlen(s + j);
+          break;
+        }
+        j = end;
+      } else {
+        j = next_special(p, j + 1);
+      }
+    }
+    t->type = TOK_WORD;
+    t->len = j - i;
+  }
+  p->pos = i + t->len;
+}
+
+static void parse_fail(parser* p) {
+  if (p->status != PARSE_OK) return;
+  p->status = p->tok.type == TOK_EOF ? PARSE_INCOMPLETE : PARSE_ERROR;
+  p->error_tok = p->tok;
+}
+
+static int tok_is(parser* p, const char* word) {
+  size_t len = strlen(word);
+  return p->tok.type == TOK_WORD && p->tok.len == len && strncmp(p->tok.start, word, len) == 0;
+}
+
+static int expect_word(parser* p, const char* word) {
+  if (!tok_is(p, word)) {
+    parse_fail(p);
+    return 0;
+  }
+  lex_next(p);
+  return 1;
+}
+
+static void skip_newlines(parser* p) {
+  while (p->tok.type == TOK_NEWLINE) lex_next(p);
+}
+
+static int is_name(const char* s, size_t len) {
+  if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return 0;
+  for (size_t i = 1; i < len; i++) {
+    if (!(isalnum((unsigned char)s[i]) || s[i] == '_')) return 0;
+  }
+  return 1;
+}
+
+static node* new_node(parser* p, int type) {
+  node* n = arena_alloc(p->arena, sizeof(node));
+  memset(n, 0, sizeof(node));
+  n->type = type;
+  return n;
+}
+
+// Arithmetic for $((expr)), ((expr)) and let: a Pratt parser compiles an
+// expression into a small tree, which is evaluated with 64-bit wrap-around
+// integers. Expressions without expansions are compiled once, with the AST they
+// appear in.
+enum {
+  ARITH_NUM,
+  ARITH_VAR,
+  ARITH_NEG,
+  ARITH_NOT,
+  ARITH_BITNOT,
+  ARITH_PREINC,
+  ARITH_PREDEC,
+  ARITH_POSTINC,
+  ARITH_POSTDEC,
+  ARITH_MUL,
+  ARITH_DIV,
+  ARITH_MOD,
+  ARITH_ADD,
+  ARITH_SUB,
+  ARITH_SHL,
+  ARITH_SHR,
+  ARITH_LT,
+  ARITH_LE,
+  ARITH_GT,
+  ARITH_GE,
+  ARITH_EQ,
+  ARITH_NE,
+  ARITH_BITAND,
+  ARITH_XOR,
+  ARITH_BITOR,
+  ARITH_POW,
+  ARITH_AND,
+  ARITH_OR,
+  ARITH_COND,
+  ARITH_ASSIGN,
+  ARITH_COMMA
+};
+
+typedef struct arith_node {
+  int op;
+  int assign_op;  // ARITH_ASSIGN: operator of +=, -=, ...; ARITH_ASSIGN for plain =
+  int64_t value;
+  char* name;
+  struct arith_node* a;
+  struct arith_node* b;
+  struct arith_node* c;
+} arith_node;
+
+// Binding powers, loosest first
+enum {
+  PREC_COMMA = 1,
+  PREC_ASSIGN,
+  PREC_COND,
+  PREC_OR,
+  PREC_AND,
+  PREC_BITOR,
+  PREC_XOR,
+  PREC_BITAND,
+  PREC_EQUALITY,
+  PREC_RELATIONAL,
+  PREC_SHIFT,
+  PREC_ADDITIVE,
+  PREC_MULTIPLICATIVE,
+  PREC_POW,
+  PREC_UNARY
+};
+
+typedef struct {
+  const char* text;
+  int op;
+  int prec;
+} arith_operator;
+
+// Longest spellings first, so "<<=" is not read as "<<" then "="
+static const arith_operator arith_operators[] = {
+    {"<<=", ARITH_SHL, PREC_ASSIGN},     {">>=", ARITH_SHR, PREC_ASSIGN},   {"**", ARITH_POW, PREC_POW},
+    {"&&", ARITH_AND, PREC_AND},         {"||", ARITH_OR, PREC_OR},         {"==", ARITH_EQ, PREC_EQUALITY},
+    {"!=", ARITH_NE, PREC_EQUALITY},     {"<=", ARITH_LE, PREC_RELATIONAL}, {">=", ARITH_GE, PREC_RELATIONAL},
+    {"<<", ARITH_SHL, PREC_SHIFT},       {">>", ARITH_SHR, PREC_SHIFT},     {"+=", ARITH_ADD, PREC_ASSIGN},
+    {"-=", ARITH_SUB, PREC_ASSIGN},      {"*=", ARITH_MUL, PREC_ASSIGN},    {"/=", ARITH_DIV, PREC_ASSIGN},
+    {"%=", ARITH_MOD, PREC_ASSIGN},      {"&=", ARITH_BITAND, PREC_ASSIGN}, {"^=", ARITH_XOR, PREC_ASSIGN},
+    {"|=", ARITH_BITOR, PREC_ASSIGN},    {"*", ARITH_MUL, PREC_MULTIPLICATIVE},
+    {"/", ARITH_DIV, PREC_MULTIPLICATIVE}, {"%", ARITH_MOD, PREC_MULTIPLICATIVE},
+    {"+", ARITH_ADD, PREC_ADDITIVE},     {"-", ARITH_SUB, PREC_ADDITIVE},   {"<", ARITH_LT, PREC_RELATIONAL},
+    {">", ARITH_GT, PREC_RELATIONAL},    {"&", ARITH_BITAND, PREC_BITAND},  {"^", ARITH_XOR, PREC_XOR},
+    {"|", ARITH_BITOR, PREC_BITOR},      {"=", ARITH_ASSIGN, PREC_ASSIGN},  {"?", ARITH_COND, PREC_COND},
+    {",", ARITH_COMMA, PREC_COMMA}};
+
+typedef struct {
+  const char* s;
+  size_t pos;
+  size_t len;
+  arena* a;
+  const char* error;
+} arith_parser;
+
+static void arith_skip_space(arith_parser* ap) {
+  while (ap->pos < ap->len && isspace((unsigned char)ap->s[ap->pos])) ap->pos++;
+}
+
+static int arith_accept(arith_parser* ap, const char* text) {
+  arith_skip_space(ap);
+  size_t n = strlen(text);
+  if (ap->pos + n > ap->len || memcmp(ap->s + ap->pos, text, n) != 0) return 0;
+  ap->pos += n;
+  return 1;
+}
+
+// An integer constant as bash reads one: decimal, 0x hex, 0 octal, or
+// base#digits for a base from 2 to 64, with digits 0-9, a-z, A-Z, @ and _
+// (letters of either case are 10-35 up to base 36). Values too long for 64
+// bits wrap around. Returns the length read; *error is set if it is invalid.
+static size_t arith_number(const char* s, size_t len, int64_t* out, const char** error) {
+  uint64_t base = 10, value = 0;
+  size_t i = 0;
+  if (len >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    i = 2;
+  } else if (s[0] == '0') {
+    base = 8;
+  } else {
+    size_t j = 0;
+    uint64_t prefix = 0;
+    while (j < len && isdigit((unsigned char)s[j])) prefix = prefix * 10 + (s[j++] - '0');
+    if (j < len && s[j] == '#') {
+      if (prefix < 2 || prefix > 64) *error = "invalid arithmetic base";
+      base = prefix;
+      i = j + 1;
+      if (i == len || !(isalnum((unsigned char)s[i]) || s[i] == '@' || s[i] == '_')) {
+        *error = "invalid integer constant";
+      }
+    }
+  }
+  int extended = s[i ? i - 1 : 0] == '#';
+  for (; i < len && (isalnum((unsigned char)s[i]) || (extended && (s[i] == '@' || s[i] == '_'))); i++) {
+    char c = s[i];
+    uint64_t digit = isdigit((unsigned char)c) ? (uint64_t)(c - '0')
+                     : islower((unsigned char)c) ? (uint64_t)(c - 'a' + 10)
+                     : isupper((unsigned char)c) ? (uint64_t)(c - 'A' + (base > 36 ? 36 : 10))
+                     : c == '@' ? 62 : 63;
+    if (digit >= base && !*error) *error = "value too great for base";
+    value = value * base + digit;
+  }
+  *out = (int64_t)value;
+  return i;
+}
+
+static arith_node* arith_new(arith_parser* ap, int op, arith_node* a, arith_node* b) {
+  arith_node* n = arena_alloc(ap->a, sizeof(arith_node));
+  memset(n, 0, sizeof(*n));
+  n->op = op;
+  n->a = a;
+  n->b = b;
+  return n;
+}
+
+static arith_node* arith_expr(arith_parser* ap, int min_prec);
+
+static arith_node* arith_prefix(arith_parser* ap) {
+  arith_skip_space(ap);
+  if (ap->pos == ap->len) {
+    ap->error = "operand expected";
+    return NULL;
+  }
+  const char* s = ap->s;
+  char c = s[ap->pos];
+
+  if (isdigit((unsigned char)c)) {
+    arith_node* num = arith_new(ap, ARITH_NUM, NULL, NULL);
+    const char* error = NULL;
+    ap->pos += arith_number(s + ap->pos, ap->len - ap->pos, &num->value, &error);
+    if (error) ap->error = error;
+    return num;
+  }
+
+  if (isalpha((unsigned char)c) || c == '_') {
+    size_t start = ap->pos;
+    while (ap->pos < ap->len && (isalnum((unsigned char)s[ap->pos]) || s[ap->pos] == '_')) ap->pos++;
+    arith_node* var = arith_new(ap, ARITH_VAR, NULL, NULL);
+    var->name = arena_strndup(ap->a, s + start, ap->pos - start);
+    if (arith_accept(ap, "++")) {
+      var->op = ARITH_POSTINC;
+    } else if (arith_accept(ap, "--")) {
+      var->op = ARITH_POSTDEC;
+    }
+    return var;
+  }
+
+  if (arith_accept(ap, "(")) {
+    arith_node* inner = arith_expr(ap, PREC_COMMA);
+    if (inner && !arith_accept(ap, ")")) ap->error = "missing `)'";
+    return inner;
+  }
+
+  int op = -1;
+  if (arith_accept(ap, "++")) {
+    op = ARITH_PREINC;
+  } else if (arith_accept(ap, "--")) {
+    op = ARITH_PREDEC;
+  }
+  if (op >= 0) {
+    arith_node* var = arith_prefix(ap);
+    if (var && var->op != ARITH_VAR) {
+      ap->error = "assignment requires a variable";
+      return NULL;
+    }
+    if (var) var->op = op;
+    return var;
+  }
+
+  if (arith_accept(ap, "-")) {
+    op = ARITH_NEG;
+  } else if (arith_accept(ap, "!")) {
+    op = ARITH_NOT;
+  } else if (arith_accept(ap, "~")) {
+    op = ARITH_BITNOT;
+  } else if (arith_accept(ap, "+")) {
+    return arith_expr(ap, PREC_UNARY);
+  } else {
+    ap->error = "operand expected";
+    return NULL;
+  }
+  arith_node* operand = arith_expr(ap, PREC_UNARY);
+  return operand ? arith_new(ap, op, operand, NULL) : NULL;
+}
+
+static arith_node* arith_expr(arith_parser* ap, int min_prec) {
+  arith_node* left = arith_prefix(ap);
+  while (left && !ap->error) {
+    arith_skip_space(ap);
+    const arith_operator* found = NULL;
+    for (size_t i = 0; i < sizeof(arith_operators) / sizeof(arith_operators[0]); i++) {
+      size_t n = strlen(arith_operators[i].text);
+      if (ap->pos + n <= ap->len && memcmp(ap->s + ap->pos, arith_operators[i].text, n) == 0) {
+        found = &arith_operators[i];
+        break;
+      }
+    }
+    if (!found || found->prec < min_prec) break;
+    ap->pos += strlen(found->text);
+
+    if (found->op == ARITH_COND) {
+      arith_node* cond = arith_new(ap, ARITH_COND, left, arith_expr(ap, PREC_COMMA));
+      if (!ap->error && !arith_accept(ap, ":")) ap->error = "`:' expected for conditional expression";
+      if (ap->error) return NULL;
+      cond->c = arith_expr(ap, PREC_COND);
+      left = cond;
+    } else if (found->prec == PREC_ASSIGN) {
+      if (left->op != ARITH_VAR) {
+        ap->error = "attempted assignment to non-variable";
+        return NULL;
+      }
+      // Right-associative: a = b = 1
+      arith_node* assign = arith_new(ap, ARITH_ASSIGN, left, arith_expr(ap, PREC_ASSIGN));
+      assign->assign_op = found->op;
+      left = assign;
+    } else {
+      // ** is right-associative, the rest left-associative
+      int next = found->op == ARITH_POW ? found->prec : found->prec + 1;
+      left = arith_new(ap, found->op, left, arith_expr(ap, next));
+    }
+  }
+  return ap->error ? NULL : left;
+}
+
+// Compile an expression into a; NULL with *error set if it does not parse
+static arith_node* arith_compile(arena* a, const char* s, size_t len, const char** error) {
+  arith_parser ap = {s, 0, len, a, NULL};
+  arith_skip_space(&ap);
+  if (ap.pos == len) {
+    // An empty expression is 0
+    return arith_new(&ap, ARITH_NUM, NULL, NULL);
+  }
+  arith_node* tree = arith_expr(&ap, PREC_COMMA);
+  arith_skip_space(&ap);
+  if (!ap.error && ap.pos < len) ap.error = "syntax error in expression";
+  *error = ap.error ? ap.error : "operand expected";
+  return ap.error ? NULL : tree;
+}
+
+static const char* arith_error = NULL;  // set by a failed evaluation
+static int arith_depth = 0;             // variables whose values are expressions themselves
+
+static int64_t arith_eval(arith_node* n);
+
+static int64_t arith_var(const char* name) {
+  const char* value = get_var(name);
+  if (!value) return 0;
+  while (isspace((unsigned char)*value)) value++;
+  if (!*value) return 0;
+  int64_t number;
+  if (isdigit((unsigned char)*value)) {
+    const char* error = NULL;
+    const char* end = value + arith_number(value, strlen(value), &number, &error);
+    while (isspace((unsigned char)*end)) end++;
+    if (!*end && !error) return number;
+  }
+
+  // x=y+1 evaluates y+1
+  if (arith_depth >= 32) {
+    arith_error = "expression recursion level exceeded";
+    return 0;
+  }
+  const char* error;
+  arith_node* tree = arith_compile(&argv_arena, value, strlen(value), &error);
+  if (!tree) {
+    arith_error = error;
+    return 0;
+  }
+  arith_depth++;
+  number = arith_eval(tree);
+  arith_depth--;
+  return number;
+}
+
+static int64_t arith_store(const char* name, int64_t value) {
+  char text[32];
+  snprintf(text, sizeof(text), "%lld", (long long)value);
+  set_var(name, text);
+  return value;
+}
+
+static int64_t arith_binary(int op, int64_t x, int64_t y) {
+  uint64_t ux = x, uy = y;
+  switch (op) {
+    case ARITH_MUL:
+      return (int64_t)(ux * uy);
+    case ARITH_DIV:
+    case ARITH_MOD:
+      if (y == 0) {
+        arith_error = "division by 0";
+        return 0;
+      }
+      if (y == -1) return op == ARITH_DIV ? (int64_t)(0 - ux) : 0;  // INT64_MIN / -1 wraps
+      return op == ARITH_DIV ? x / y : x % y;
+    case ARITH_ADD:
+      return (int64_t)(ux + uy);
+    case ARITH_SUB:
+      return (int64_t)(ux - uy);
+    case ARITH_SHL:
+      return (int64_t)(ux << (y & 63));
+    case ARITH_SHR:
+      return x >> (y & 63);
+    case ARITH_LT:
+      return x < y;
+    case ARITH_LE:
+      return x <= y;
+    case ARITH_GT:
+      return x > y;
+    case ARITH_GE:
+      return x >= y;
+    case ARITH_EQ:
+      return x == y;
+    case ARITH_NE:
+      return x != y;
+    case ARITH_BITAND:
+      return x & y;
+    case ARITH_XOR:
+      return x ^ y;
+    case ARITH_BITOR:
+      return x | y;
+    case ARITH_POW: {
+      if (y < 0) {
+        arith_error = "exponent less than 0";
+        return 0;
+      }
+      uint64_t result = 1;
+      for (; y; y >>= 1, ux *= ux) {
+        if (y & 1) result *= ux;
+      }
+      return (int64_t)result;
+    }
+  }
+  return 0;
+}
+
+static int64_t arith_eval(arith_node* n) {
+  if (arith_error) return 0;
+  switch (n->op) {
+    case ARITH_NUM:
+      return n->value;
+    case ARITH_VAR:
+      return arith_var(n->name);
+    case ARITH_NEG:
+      return (int64_t)(0 - (uint64_t)arith_eval(n->a));
+    case ARITH_NOT:
+      return !arith_eval(n->a);
+    case ARITH_BITNOT:
+      return ~arith_eval(n->a);
+    case ARITH_PREINC:
+    case ARITH_PREDEC:
+    case ARITH_POSTINC:
+    case ARITH_POSTDEC: {
+      int64_t old = arith_var(n->name);
+      int64_t delta = n->op == ARITH_PREINC || n->op == ARITH_POSTINC ? 1 : -1;
+      int64_t updated = arith_store(n->name, (int64_t)((uint64_t)old + delta));
+      return n->op == ARITH_PREINC || n->op == ARITH_PREDEC ? updated : old;
+    }
+    case ARITH_AND:
+      return arith_eval(n->a) && arith_eval(n->b);
+    case ARITH_OR:
+      return arith_eval(n->a) || arith_eval(n->b);
+    case ARITH_COND:
+      return arith_eval(n->a) ? arith_eval(n->b) : arith_eval(n->c);
+    case ARITH_COMMA:
+      arith_eval(n->a);
+      return arith_eval(n->b);
+    case ARITH_ASSIGN: {
+      int64_t value = arith_eval(n->b);
+      if (n->assign_op != ARITH_ASSIGN) value = arith_binary(n->assign_op, arith_var(n->a->name), value);
+      return arith_error ? 0 : arith_store(n->a->name, value);
+    }
+  }
+  int64_t x = arith_eval(n->a);
+  int64_t y = arith_eval(n->b);
+  return arith_binary(n->op, x, y);
+}
+
+static int arith_failed = 0;  // an expansion of the current command hit an arithmetic error
+
+// Evaluate tree, or text when it has none; -1 after reporting an error
+static int arith_evaluate(arith_node* tree, const char* text, int64_t* value) {
+  const char* error;
+  if (!tree) tree = arith_compile(&argv_arena, text, strlen(text), &error);
+  if (tree) {
+    arith_error = NULL;
+    *value = arith_eval(tree);
+    error = arith_error;
+  }
+  if (!tree || error) {
+    err_printf("chefs_shell: %s: %s\n", text, error);
+    arith_failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+// let expr...: evaluates each argument, succeeding when the last is non-zero
+static int builtin_let(char* args[]) {
+  if (!args[1]) {
+    err_printf("let: expression expected\n");
+    return 1;
+  }
+  int64_t value = 0;
+  for (int i = 1; args[i]; i++) {
+    if (arith_evaluate(NULL, args[i], &value) < 0) return 1;
+  }
+  return value == 0;
+}
+
+static word_part* add_part(arena* a, word_part*** tail, int type, int quoted, const char* text, size_t len) {
+  word_part* part = arena_alloc(a, sizeof(word_part));
+  part->next = NULL;
+  part->type = type;
+  part->quoted = quoted;
+  part->len = len;
+  part->text = arena_strndup(a, text, len);
+  part->sub = NULL;
+  part->arith = NULL;
+  **tail = part;
+  *tail = &part->next;
+  return part;
+}
+
+// Parse the $... at s[i] into a parameter part; returns the index after it,
+// or i when the $ is just a literal
+static size_t parse_param(arena* a, word_part*** tail, const char* s, size_t i, size_t end, int quoted) {
+  size_t j = i + 1;
+  if (j < end && s[j] == '{') {
+    const char* close = memchr(s + j, '}', end - j);
+    if (!close) return i;
+    add_part(a, tail, PART_PARAM, quoted, s + j + 1, close - (s + j + 1));
+    return close - s + 1;
+  }
+  if (j < end && (strchr("?$#@*!", s[j]) || isdigit((unsigned char)s[j]))) {
+    add_part(a, tail, PART_PARAM, quoted, s + j, 1);
+    return j + 1;
+  }
+  size_t k = j;
+  while (k < end && (isalnum((unsigned char)s[k]) || s[k] == '_')) k++;
+  if (k == j || isdigit((unsigned char)s[j])) return i;
+  add_part(a, tail, PART_PARAM, quoted, s + j, k - j);
+  return k;
+}
+
+// Accumulates the literal run of a word until a parameter or quoting change ends it
+typedef struct {
+  parser* p;
+  arena* a;
+  word_part** tail;
+  char* lit;
+  size_t len;
+  int quoted;
+} word_builder;
+
+static void wb_flush(word_builder* b) {
+  if (b->len > 0) add_part(b->a, &b->tail, PART_LITERAL, b->quoted, b->lit, b->len);
+  b->len = 0;
+}
+
+static void wb_put(word_builder* b, char c, int quoted) {
+  if (b->len > 0 && b->quoted != quoted) wb_flush(b);
+  b->quoted = quoted;
+  b->lit[b->len++] = c;
+}
+
+static void wb_put_run(word_builder* b, const char* run, size_t n, int quoted) {
+  if (b->len > 0 && b->quoted != quoted) wb_flush(b);
+  b->quoted = quoted;
+  memcpy(b->lit + b->len, run, n);
+  b->len += n;
+}
+
+// '' and "" still make an (empty) quoted field
+static void wb_empty_quoted(word_builder* b) {
+  wb_flush(b);
+  add_part(b->a, &b->tail, PART_LITERAL, 1, "", 0);
+}
+
+// A $ at s[i]: a parameter part, or a literal $ when nothing valid follows
+static size_t wb_dollar(word_builder* b, const char* s, size_t i, size_t len, int quoted) {
+  wb_flush(b);
+  size_t next = parse_param(b->a, &b->tail, s, i, len, quoted);
+  if (next == i) {
+    wb_put(b, '$', quoted);
+    next++;
+  }
+  return next;
+}
+
+static node* parse_list(parser* p);
+
+// Parse a whole source text with p; returns NULL for an empty one
+static node* parse_all(parser* p) {
+  node* root = NULL;
+  uint64_t* special = index_specials(p->src, p->src_len = strlen(p->src));
+  p->special = special;
+  lex_next(p);
+  skip_newlines(p);
+  if (p->tok.type != TOK_EOF) {
+    root = parse_list(p);
+    if (p->status == PARSE_OK && p->tok.type != TOK_EOF) parse_fail(p);
+  }
+  p->special = NULL;
+  free(special);
+  return root;
+}
+
+// The command of a $(...) or `...` is parsed along with the word it is in;
+// an error inside it is an error in the enclosing command
+static node* parse_nested(parser* outer, const char* text, size_t len) {
+  parser p = {0};
+  p.src = arena_strndup(outer->arena, text, len);
+  p.arena = outer->arena;
+  node* root = parse_all(&p);
+  if (p.status != PARSE_OK && outer->status == PARSE_OK) {
+    outer->status = PARSE_ERROR;
+    outer->error_tok = p.error_tok;
+    if (p.status == PARSE_INCOMPLETE) outer->error_tok.type = TOK_EOF;
+  }
+  return root;
+}
+
+// <(...) or >(...) at s[i]; returns the index after it
+static size_t wb_process(word_builder* b, const char* s, size_t i) {
+  size_t end = skip_substitution(s, i + 2);
+  wb_flush(b);
+  int type = s[i] == '<' ? PART_PROC_IN : PART_PROC_OUT;
+  word_part* part = add_part(b->a, &b->tail, type, 0, s + i + 2, end - 1 - (i + 2));
+  part->sub = parse_nested(b->p, part->text, part->len);
+  return end;
+}
+
+// $(...) at s[i], or `...` when backquoted; returns the index after it
+static word_part* parse_word(parser* p, const char* s, size_t len);
+
+// i is just past "((": the end of a matching "))", or 0 if the parentheses
+// close some other way and this is a nested subshell instead
+static size_t skip_arithmetic(const char* s, size_t i) {
+  int depth = 0;
+  for (; s[i]; i++) {
+    if (s[i] == '(') depth++;
+    if (s[i] == ')' && depth-- == 0) return s[i + 1] == ')' ? i + 2 : 0;
+  }
+  return 0;
+}
+
+// Compile the expression of a $((...)) or ((...)) part now if it has no
+// expansions; otherwise keep it as a word in part->sub, expanded and compiled
+// on every evaluation
+static void compile_arith_part(parser* p, word_part* part) {
+  if (strpbrk(part->text, "$`\"'\\")) {
+    node* n = new_node(p, NODE_SIMPLE);
+    n->words = arena_alloc(p->arena, sizeof(word_part*));
+    n->words[0] = parse_word(p, part->text, part->len);
+    n->nwords = 1;
+    part->sub = n;
+    return;
+  }
+  const char* error;
+  // A bad expression is reported when it runs
+  part->arith = arith_compile(p->arena, part->text, part->len, &error);
+}
+
+static size_t wb_command(word_builder* b, const char* s, size_t i, int quoted, int backquoted) {
+  if (!backquoted && s[i + 2] == '(') {
+    size_t end = skip_arithmetic(s, i + 3);
+    if (end) {
+      wb_flush(b);
+      word_part* part = add_part(b->a, &b->tail, PART_ARITH, quoted, s + i + 3, end - 2 - (i + 3));
+      compile_arith_part(b->p, part);
+      return end;
+    }
+  }
+  size_t start = i + (backquoted ? 1 : 2);
+  size_t end = backquoted ? skip_backquote(s, start) : skip_substitution(s, start);
+  if (!end) {
+    // Unterminated inside a here-document body: keep it as text
+    wb_put(b, s[i], quoted);
+    return i + 1;
+  }
+  size_t len = end - 1 - start;
+  char* text = malloc(len + 1);
+  size_t n = 0;
+  for (size_t k = start; k < end - 1; k++) {
+    // Inside backquotes, \ \` and \$ stand for the character itself
+    if (backquoted && s[k] == '\\' && strchr("\\`$", s[k + 1])) k++;
+    text[n++] = s[k];
+  }
+
+  wb_flush(b);
+  word_part* part = add_part(b->a, &b->tail, PART_COMMAND, quoted, text, n);
+  part->sub = parse_nested(b->p, text, n);
+  free(text);
+  return end;
+}
+
+// Split a word token into literal, parameter and command parts, removing quotes
+static word_part* parse_word(parser* p, const char* s, size_t len) {
+  word_part* head = NULL;
+  word_builder b = {p, p->arena, &head, malloc(len + 1), 0, 0};
+  size_t i = 0;
+
+  while (i < len) {
+    char c = s[i];
+    if (c == '\\') {
+      if (i + 1 < len && s[i + 1] != '\n') wb_put(&b, s[i + 1], 1);
+      i += 2;
+    } else if (c == '\'') {
+      size_t start = ++i;
+      const char* close = memchr(s + start, '\'', len - start);
+      i = close ? (size_t)(close - s) : len;
+      if (i == start) wb_empty_quoted(&b);
+      wb_put_run(&b, s + start, i - start, 1);
+      i++;
+    } else if (c == '"') {
+      i++;
+      if (i < len && s[i] == '"') wb_empty_quoted(&b);
+      while (i < len && s[i] != '"') {
+        if (s[i] == '\\' && i + 1 < len && strchr("$\"\\`\n", s[i + 1])) {
+          if (s[i + 1] != '\n') wb_put(&b, s[i + 1], 1);
+          i += 2;
+        } else if (s[i] == '$' && s[i + 1] == '(') {
+          i = wb_command(&b, s, i, 1, 0);
+        } else if (s[i] == '`') {
+          i = wb_command(&b, s, i, 1, 1);
+        } else if (s[i] == '$') {
+          i = wb_dollar(&b, s, i, len, 1);
+        } else {
+          wb_put(&b, s[i++], 1);
+        }
+      }
+      i++;
+    } else if ((c == '<' || c == '>') && s[i + 1] == '(') {
+      i = wb_process(&b, s, i);
+    } else if (c == '$' && s[i + 1] == '(') {
+      i = wb_command(&b, s, i, 0, 0);
+    } else if (c == '`') {
+      i = wb_command(&b, s, i, 0, 1);
+    } else if (c == '$') {
+      i = wb_dollar(&b, s, i, len, 0);
+    } else {
+      // The whole unquoted run up to the next special character at once; s is
+      // NUL-terminated past len, so the search stops in time
+      size_t end = find_special(p, s, i + 1);
+      if (end > len) end = len;
+      wb_put_run(&b, s + i, end - i, 0);
+      i = end;
+    }
+  }
+  wb_flush(&b);
+
+  free(b.lit);
+  return head;
+}
+
+// A here-document body: parameters and command substitutions expand unless the
+// delimiter was quoted, quotes are ordinary characters, and nothing is split
+static word_part* parse_heredoc_body(parser* p, const char* body, size_t len, int quoted) {
+  word_part* head = NULL;
+  word_builder b = {p, p->arena, &head, malloc(len + 1), 0, 1};
+  if (quoted || len == 0) {
+    add_part(p->arena, &b.tail, PART_LITERAL, 1, body, len);
+    free(b.lit);
+    return head;
+  }
+
+  size_t i = 0;
+  while (i < len) {
+    if (body[i] == '\\' && i + 1 < len && strchr("$`\\\n", body[i + 1])) {
+      if (body[i + 1] != '\n') wb_put(&b, body[i + 1], 1);
+      i += 2;
+    } else if (body[i] == '$' && body[i + 1] == '(') {
+      i = wb_command(&b, body, i, 1, 0);
+    } else if (body[i] == '`') {
+      i = wb_command(&b, body, i, 1, 1);
+    } else if (body[i] == '$') {
+      i = wb_dollar(&b, body, i, len, 1);
+    } else {
+      wb_put(&b, body[i++], 1);
+    }
+  }
+  wb_flush(&b);
+  free(b.lit);
+  return head;
+}
+
+static word_part* take_word(parser* p) {
+  word_part* w = parse_word(p, p->tok.start, p->tok.len);
+  lex_next(p);
+  return w;
+}
+
+static node* parse_command(parser* p);
+
+// Tokens that end a list: closing reserved words and terminators
+static int at_list_end(parser* p) {
+  int t = p->tok.type;
+  return t == TOK_EOF || t == TOK_RPAREN || t == TOK_DSEMI || tok_is(p, "then") || tok_is(p, "else") ||
+         tok_is(p, "elif") || tok_is(p, "fi") || tok_is(p, "do") || tok_is(p, "done") ||
+         tok_is(p, "esac") || tok_is(p, "}");
+}
+
+// A redirection operator and its target word
+static redirect* parse_redirect(parser* p) {
+  redirect* r = arena_alloc(p->arena, sizeof(redirect));
+  r->next = NULL;
+  r->fd = p->tok.fd;
+  r->op = p->tok.op;
+  r->target = NULL;
+  int strip_tabs = p->tok.strip_tabs;
+  lex_next(p);
+  if (p->tok.type != TOK_WORD) {
+    // A missing target is an error even at the end of the line
+    if (p->tok.type == TOK_EOF) p->tok.type = TOK_NEWLINE;
+    parse_fail(p);
+    return NULL;
+  }
+  if (r->op != REDIR_HEREDOC) {
+    r->target = take_word(p);
+    return r;
+  }
+
+  // The body is read when the lexer reaches the end of this line
+  if (p->nheredocs == MAX_PENDING_HEREDOCS) {
+    parse_fail(p);
+    return NULL;
+  }
+  pending_heredoc* hd = &p->heredocs[p->nheredocs++];
+  hd->r = r;
+  hd->strip_tabs = strip_tabs;
+  hd->quoted = strpbrk(arena_strndup(p->arena, p->tok.start, p->tok.len), "'\"\\") != NULL;
+  hd->delimiter = arena_alloc(p->arena, p->tok.len + 1);
+  size_t n = 0;
+  for (size_t i = 0; i < p->tok.len; i++) {
+    char c = p->tok.start[i];
+    if (c == '\\' && i + 1 < p->tok.len) {
+      hd->delimiter[n++] = p->tok.start[++i];
+    } else if (c != '\'' && c != '"') {
+      hd->delimiter[n++] = c;
+    }
+  }
+  hd->delimiter[n] = '\0';
+  lex_next(p);
+  return r;
+}
+
+static node* parse_simple(parser* p) {
+  node* n = new_node(p, NODE_SIMPLE);
+  ptr_vec words = {0};
+  ptr_vec assigns = {0};
+  redirect** redir_tail = &n->redirs;
+
+  while (p->status == PARSE_OK) {
+    if (p->tok.type == TOK_REDIRECT) {
+      *redir_tail = parse_redirect(p);
+      if (*redir_tail) redir_tail = &(*redir_tail)->next;
+    } else if (p->tok.type == TOK_WORD) {
+      const char* eq = memchr(p->tok.start, '=', p->tok.len);
+      if (words.count == 0 && eq && is_name(p->tok.start, eq - p->tok.start)) {
+        vec_push(&assigns, take_word(p));
+      } else {
+        vec_push(&words, take_word(p));
+      }
+    } else {
+      break;
+    }
+  }
+
+  n->nwords = words.count;
+  n->words = (word_part**)vec_finish(p->arena, &words);
+  n->nassigns = assigns.count;
+  n->assigns = (word_part**)vec_finish(p->arena, &assigns);
+  if (n->nwords == 0 && n->nassigns == 0 && !n->redirs) parse_fail(p);
+  return n;
+}
+
+static node* parse_if(parser* p) {
+  node* n = new_node(p, NODE_IF);
+  lex_next(p);  // if / elif
+  n->a = parse_list(p);
+  if (!expect_word(p, "then")) return n;
+  n->b = parse_list(p);
+  if (tok_is(p, "elif")) {
+    n->c = parse_if(p);
+    return n;
+  }
+  if (tok_is(p, "else")) {
+    lex_next(p);
+    n->c = parse_list(p);
+  }
+  expect_word(p, "fi");
+  return n;
+}
+
+static node* parse_do_group(parser* p) {
+  if (!expect_word(p, "do")) return NULL;
+  node* body = parse_list(p);
+  expect_word(p, "done");
+  return body;
+}
+
+static node* parse_for(parser* p) {
+  node* n = new_node(p, NODE_FOR);
+  lex_next(p);
+  if (p->tok.type != TOK_WORD || !is_name(p->tok.start, p->tok.len)) {
+    parse_fail(p);
+    return n;
+  }
+  n->name = arena_strndup(p->arena, p->tok.start, p->tok.len);
+  lex_next(p);
+  skip_newlines(p);
+
+  if (tok_is(p, "in")) {
+    lex_next(p);
+    ptr_vec words = {0};
+    while (p->tok.type == TOK_WORD) vec_push(&words, take_word(p));
+    n->nwords = words.count;
+    n->words = (word_part**)vec_finish(p->arena, &words);
+    if (!n->words) n->words = arena_alloc(p->arena, sizeof(word_part*));  // "in" with no words
+    if (p->tok.type != TOK_SEMI && p->tok.type != TOK_NEWLINE) {
+      parse_fail(p);
+      return n;
+    }
+    lex_next(p);
+  } else if (p->tok.type == TOK_SEMI) {
+    lex_next(p);
+  }
+  skip_newlines(p);
+  n->b = parse_do_group(p);
+  return n;
+}
+
+static node* parse_case(parser* p) {
+  node* n = new_node(p, NODE_CASE);
+  lex_next(p);
+  if (p->tok.type != TOK_WORD) {
+    parse_fail(p);
+    return n;
+  }
+  n->words = arena_alloc(p->arena, sizeof(word_part*));
+  n->words[0] = take_word(p);
+  n->nwords = 1;
+  skip_newlines(p);
+  if (!expect_word(p, "in")) return n;
+  skip_newlines(p);
+
+  ptr_vec items = {0};
+  while (p->status == PARSE_OK && !tok_is(p, "esac")) {
+    node* item = new_node(p, NODE_CASE_ITEM);
+    ptr_vec patterns = {0};
+    if (p->tok.type == TOK_LPAREN) lex_next(p);
+    for (;;) {
+      if (p->tok.type != TOK_WORD) {
+        parse_fail(p);
+        break;
+      }
+      vec_push(&patterns, take_word(p));
+      if (p->tok.type != TOK_PIPE) break;
+      lex_next(p);
+    }
+    item->nwords = patterns.count;
+    item->words = (word_part**)vec_finish(p->arena, &patterns);
+    if (p->status != PARSE_OK) break;
+    if (p->tok.type != TOK_RPAREN) {
+      parse_fail(p);
+      break;
+    }
+    lex_next(p);
+    skip_newlines(p);
+    if (p->tok.type != TOK_DSEMI && !tok_is(p, "esac")) item->a = parse_list(p);
+    vec_push(&items, item);
+    if (p->tok.type == TOK_DSEMI) {
+      lex_next(p);
+      skip_newlines(p);
+    } else if (!tok_is(p, "esac")) {
+      parse_fail(p);
+    }
+  }
+  n->nkids = items.count;
+  n->kids = (node**)vec_finish(p->arena, &items);
+  expect_word(p, "esac");
+  return n;
+}
+
+static node* parse_function_body(parser* p, node* n) {
+  skip_newlines(p);
+  n->a = parse_command(p);
+  return n;
+}
+
+// Is the current word followed by "()"?
+static int is_funcdef(parser* p) {
+  const char* s = p->src + p->pos;
+  while (*s == ' ' || *s == '\t') s++;
+  if (*s++ != '(') return 0;
+  while (*s == ' ' || *s == '\t') s++;
+  return *s == ')';
+}
+
+static node* parse_command(parser* p) {
+  node* n;
+  if (p->status != PARSE_OK) return NULL;
+
+  size_t arith_end = 0;
+  if (p->tok.type == TOK_LPAREN && p->tok.start[1] == '(') {
+    arith_end = skip_arithmetic(p->src, p->tok.start + 2 - p->src);
+  }
+
+  if (arith_end) {
+    n = new_node(p, NODE_ARITH);
+    word_part* expr = NULL;
+    word_part** tail = &expr;
+    const char* start = p->tok.start + 2;
+    add_part(p->arena, &tail, PART_ARITH, 1, start, p->src + arith_end - 2 - start);
+    compile_arith_part(p, expr);
+    n->words = arena_alloc(p->arena, sizeof(word_part*));
+    n->words[0] = expr;
+    n->nwords = 1;
+    p->pos = arith_end;
+    lex_next(p);
+  } else if (p->tok.type == TOK_LPAREN) {
+    n = new_node(p, NODE_SUBSHELL);
+    lex_next(p);
+    n->a = parse_list(p);
+    if (p->tok.type != TOK_RPAREN) {
+      parse_fail(p);
+      return n;
+    }
+    lex_next(p);
+  } else if (tok_is(p, "{")) {
+    n = new_node(p, NODE_GROUP);
+    lex_next(p);
+    n->a = parse_list(p);
+    expect_word(p, "}");
+  } else if (tok_is(p, "if")) {
+    n = parse_if(p);
+  } else if (tok_is(p, "while") || tok_is(p, "until")) {
+    n = new_node(p, tok_is(p, "while") ? NODE_WHILE : NODE_UNTIL);
+    lex_next(p);
+    n->a = parse_list(p);
+    n->b = parse_do_group(p);
+  } else if (tok_is(p, "for")) {
+    n = parse_for(p);
+  } else if (tok_is(p, "case")) {
+    n = parse_case(p);
+  } else if (tok_is(p, "function")) {
+    n = new_node(p, NODE_FUNCTION);
+    lex_next(p);
+    if (p->tok.type != TOK_WORD) {
+      parse_fail(p);
+      return n;
+    }
+    n->name = arena_strndup(p->arena, p->tok.start, p->tok.len);
+    lex_next(p);
+    if (p->tok.type == TOK_LPAREN) {
+      lex_next(p);
+      if (p->tok.type != TOK_RPAREN) {
+        parse_fail(p);
+        return n;
+      }
+      lex_next(p);
+    }
+    return parse_function_body(p, n);
+  } else if (p->tok.type == TOK_WORD && is_name(p->tok.start, p->tok.len) && is_funcdef(p)) {
+    // name() compound-command
+    n = new_node(p, NODE_FUNCTION);
+    n->name = arena_strndup(p->arena, p->tok.start, p->tok.len);
+    p->pos = strchr(p->src + p->pos, ')') - p->src + 1;
+    lex_next(p);
+    return parse_function_body(p, n);
+  } else {
+    return parse_simple(p);
+  }
+
+  // Redirections after a compound command apply to all of it
+  redirect** tail = &n->redirs;
+  while (p->status == PARSE_OK && p->tok.type == TOK_REDIRECT) {
+    *tail = parse_redirect(p);
+    if (*tail) tail = &(*tail)->next;
+  }
+  return n;
+}
+
+static node* parse_pipeline(parser* p) {
+  int negate = 0;
+  if (tok_is(p, "!")) {
+    negate = 1;
+    lex_next(p);
+  }
+
+  node* first = parse_command(p);
+  if (p->tok.type != TOK_PIPE && !negate) return first;
+
+  node* n = new_node(p, NODE_PIPELINE);
+  n->negate = negate;
+  ptr_vec stages = {0};
+  vec_push(&stages, first);
+  while (p->status == PARSE_OK && p->tok.type == TOK_PIPE) {
+    lex_next(p);
+    skip_newlines(p);
+    vec_push(&stages, parse_command(p));
+  }
+  n->nkids = stages.count;
+  n->kids = (node**)vec_finish(p->arena, &stages);
+  return n;
+}
+
+static node* parse_and_or(parser* p) {
+  node* left = parse_pipeline(p);
+  while (p->status == PARSE_OK && (p->tok.type == TOK_AND_IF || p->tok.type == TOK_OR_IF)) {
+    node* n = new_node(p, p->tok.type == TOK_AND_IF ? NODE_AND : NODE_OR);
+    lex_next(p);
+    skip_newlines(p);
+    n->a = left;
+    n->b = parse_pipeline(p);
+    left = n;
+  }
+  return left;
+}
+
+// A sequence of and-or lists separated by ; or newlines
+static node* parse_list(parser* p) {
+  ptr_vec items = {0};
+  skip_newlines(p);
+  while (p->status == PARSE_OK && !at_list_end(p)) {
+    vec_push(&items, parse_and_or(p));
+    if (p->tok.type == TOK_SEMI || p->tok.type == TOK_NEWLINE) {
+      lex_next(p);
+      skip_newlines(p);
+    } else {
+      break;
+    }
+  }
+  if (items.count == 0) {
+    free(items.items);
+    parse_fail(p);
+    return NULL;
+  }
+  if (items.count == 1) {
+    node* only = items.items[0];
+    free(items.items);
+    return only;
+  }
+  node* n = new_node(p, NODE_LIST);
+  n->nkids = items.count;
+  n->kids = (node**)vec_finish(p->arena, &items);
+  return n;
+}
+
+// A parsed command line: the AST and the arena it lives in
+typedef struct {
+  arena arena;
+  node* root;  // NULL for a blank line
+} program;
+
+static int parse_quietly = 0;  // only checking whether a line is complete
+
+static int parse_program(const char* src, program* prog) {
+  parser p = {0};
+  p.src = src;
+  p.arena = &prog->arena;
+  prog->arena.head = NULL;
+  prog->arena.sub = MEM_PARSE;
+  prog->root = NULL;
+
+  prog->root = parse_all(&p);
+
+  if (p.status == PARSE_ERROR && !parse_quietly) {
+    if (p.error_tok.type == TOK_EOF) {
+      err_printf("chefs_shell: syntax error: unexpected end of command substitution\n");
+    } else if (p.error_tok.type == TOK_NEWLINE) {
+      err_printf("chefs_shell: syntax error near unexpected token `newline'\n");
+    } else {
+      err_printf("chefs_shell: syntax error near unexpected token `%.*s'\n", (int)p.error_tok.len,
+                 p.error_tok.start);
+    }
+  }
+  if (p.status != PARSE_OK) {
+    arena_free(&prog->arena);
+    prog->root = NULL;
+  }
+  return p.status;
+}
+
+// Expansion. Fields are built in a growable scratch buffer and copied into argv_arena.
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} str_buf;
+
+static str_buf field_buf;
+
+static void sb_append(str_buf* b, const char* s, size_t n) {
+  if (b->len + n + 1 > b->cap) {
+    b->cap = (b->len + n + 1) * 2;
+    b->data = realloc(b->data, b->cap);
+    if (!b->data) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+}
+
+typedef struct {
+  char** argv;
+  int argc;
+  int cap;
+} argv_list;
+
+static void argv_push(argv_list* l, char* s) {
+  if (l->argc + 1 >= l->cap) {
+    int cap = l->cap ? l->cap * 2 : 16;
+    char** grown = arena_alloc(&argv_arena, cap * sizeof(char*));
+    if (l->argc) memcpy(grown, l->argv, l->argc * sizeof(char*));
+    l->argv = grown;
+    l->cap = cap;
+  }
+  l->argv[l->argc++] = s;
+  l->argv[l->argc] = NULL;
+}
+
+static void emit_field(argv_list* l) {
+  argv_push(l, arena_strndup(&argv_arena, field_buf.data ? field_buf.data : "", field_buf.len));
+  field_buf.len = 0;
+}
+
+// Value of a parameter; special and positional ones are formatted into num
+static const char* param_value(const char* name, char* num, size_t size) {
+  if (name[1] == '\0') {
+    switch (name[0]) {
+      case '?':
+        snprintf(num, size, "%d", last_status);
+        return num;
+      case '$':
+        snprintf(num, size, "%d", (int)shell_pid);
+        return num;
+      case '#':
+        snprintf(num, size, "%d", positional_count);
+        return num;
+      case '0':
+        return shell_name;
+      case '@':
+      case '*': {
+        // Only reached unquoted or for "$*": positionals joined by spaces
+        size_t len = 0;
+        for (int i = 0; i < positional_count; i++) len += strlen(positional[i]) + 1;
+        char* joined = arena_alloc(&argv_arena, len + 1);
+        joined[0] = '\0';
+        char* end = joined;
+        for (int i = 0; i < positional_count; i++) {
+          if (i > 0) *end++ = ' ';
+          end = stpcpy(end, positional[i]);
+        }
+        return joined;
+      }
+    }
+  }
+  if (isdigit((unsigned char)name[0])) {
+    int index = atoi(name);
+    return index >= 1 && index <= positional_count ? positional[index - 1] : NULL;
+  }
+  if (strcmp(name, "PIPESTATUS") == 0) {
+    // Space-separated, one status per stage
+    char* list = arena_alloc(&argv_arena, pipe_status_count * 4 + 1);
+    char* end = list;
+    *end = '\0';
+    for (int i = 0; i < pipe_status_count; i++) end += sprintf(end, i ? " %d" : "%d", pipe_statuses[i]);
+    return list;
+  }
+  return get_var(name);
+}
+
+static int exec_node(node* n);
+static int wait_status(int status);
+
+static int subst_status = -1;  // status of the last $(...) in the current command, -1 if none
+
+// Can a $(...) run without forking? Only a single builtin that leaves the shell
+// alone (echo, pwd, printf, ...) and is not shadowed by a function.
+static int captures_in_process(node* n) {
+  if (n->type != NODE_SIMPLE || n->nassigns > 0 || n->nwords == 0) return 0;
+  word_part* first = n->words[0];
+  if (first->type != PART_LITERAL || first->next) return 0;
+  builtin_command* builtin = find_builtin_command(first->text);
+  return builtin && builtin->pure && !find_function(first->text);
+}
+
+// Fork the command with its stdout on a pipe and read all of it into *data
+static int capture_child(node* n, char** data, size_t* len) {
+  size_t cap = 4096;
+  *data = mem_malloc(MEM_IO, cap);
+  *len = 0;
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return 1;
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    // Inside an in-process capture the buffer belongs to the parent
+    builtin_out.fd = STDOUT_FILENO;
+    builtin_out.len = 0;
+    child_exit(exec_node(n));
+  }
+
+  close(fds[1]);
+  ssize_t r;
+  while ((r = read(fds[0], *data + *len, cap - *len)) != 0) {
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    *len += r;
+    if (*len == cap) {
+      cap *= 2;
+      *data = mem_realloc(MEM_IO, *data, cap);
+    }
+  }
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return wait_status(status);
+}
+
+// Output of a command substitution without its trailing newlines, in argv_arena
+static char* command_output(node* n) {
+  if (!n) return "";
+
+  // The command expands its own words; keep the field being built out of its way
+  str_buf saved_field = field_buf;
+  memset(&field_buf, 0, sizeof(field_buf));
+
+  char* data;
+  size_t len;
+  int status;
+  if (captures_in_process(n)) {
+    out_flush(&builtin_out);
+    out_buffer saved_out = builtin_out;
+    builtin_out.fd = OUT_CAPTURE;
+    builtin_out.cap = 4096;
+    builtin_out.data = mem_malloc(MEM_IO, builtin_out.cap);
+    builtin_out.len = 0;
+    status = exec_node(n);
+    data = builtin_out.data;
+    len = builtin_out.len;
+    builtin_out = saved_out;
+  } else {
+    status = capture_child(n, &data, &len);
+  }
+
+  while (len > 0 && data[len - 1] == '\n') len--;
+  char* output = arena_strndup(&argv_arena, data, len);
+  mem_free(MEM_IO, data);
+  free(field_buf.data);
+  field_buf = saved_field;
+
+  subst_status = status;
+  last_status = status;
+  return output;
+}
+
+// Process substitutions (and here-document writers) of the running command. The
+// shell keeps its end of each pipe open until the command is done, then closes
+// it and reaps the child.
+#define MAX_PROCESS_SUBSTITUTIONS 32
+
+static int process_sub_fds[MAX_PROCESS_SUBSTITUTIONS];
+static pid_t process_sub_pids[MAX_PROCESS_SUBSTITUTIONS];
+static int process_sub_count = 0;
+
+static void add_process_substitution(int fd, pid_t pid) {
+  if (process_sub_count == MAX_PROCESS_SUBSTITUTIONS) {
+    // Out of slots: finish this one now rather than leak it
+    if (fd >= 0) close(fd);
+    waitpid(pid, NULL, 0);
+    return;
+  }
+  process_sub_fds[process_sub_count] = fd;
+  process_sub_pids[process_sub_count] = pid;
+  process_sub_count++;
+}
+
+static void finish_process_substitutions(int from) {
+  for (int i = from; i < process_sub_count; i++) {
+    if (process_sub_fds[i] >= 0) close(process_sub_fds[i]);
+  }
+  for (int i = from; i < process_sub_count; i++) waitpid(process_sub_pids[i], NULL, 0);
+  process_sub_count = from;
+}
+
+// <(cmd) reads what cmd writes, >(cmd) feeds cmd; either way the word becomes
+// /dev/fd/N for the shell's end of the pipe
+static char* process_substitution(word_part* part) {
+  int reading = part->type == PART_PROC_IN;
+  int fds[2];
+  if (process_sub_count == MAX_PROCESS_SUBSTITUTIONS || pipe2(fds, O_CLOEXEC) < 0) {
+    err_printf("chefs_shell: cannot make pipe for process substitution\n");
+    return "";
+  }
+
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return "";
+  }
+  if (pid == 0) {
+    dup2(fds[reading ? 1 : 0], reading ? STDOUT_FILENO : STDIN_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    builtin_out.fd = STDOUT_FILENO;
+    builtin_out.len = 0;
+    child_exit(part->sub ? exec_node(part->sub) : 0);
+  }
+
+  close(fds[reading ? 1 : 0]);
+  // Moved above the low fds scripts use, and without FD_CLOEXEC so the command inherits it
+  int fd = fcntl(fds[reading ? 0 : 1], F_DUPFD, 10);
+  close(fds[reading ? 0 : 1]);
+  add_process_substitution(fd, pid);
+
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+  return arena_strndup(&argv_arena, path, strlen(path));
+}
+
+#define EXPAND_PATTERN 1
+#define EXPAND_ASSIGNMENT 2
+
+static char* expand_word_string(word_part* w, int flags);
+
+static int arith_part_value(word_part* part, int64_t* value) {
+  if (part->arith) return arith_evaluate(part->arith, part->text, value);
+  if (!part->sub) return arith_evaluate(NULL, part->text, value);
+
+  // Expanding the expression must not disturb the field being built
+  str_buf saved_field = field_buf;
+  memset(&field_buf, 0, sizeof(field_buf));
+  const char* text = expand_word_string(part->sub->words[0], 0);
+  free(field_buf.data);
+  field_buf = saved_field;
+  return arith_evaluate(NULL, text, value);
+}
+
+// Value of a parameter, command, process or arithmetic substitution part; never NULL
+static const char* part_value(word_part* part, char* num, size_t size) {
+  if (part->type == PART_COMMAND) return command_output(part->sub);
+  if (part->type == PART_PROC_IN || part->type == PART_PROC_OUT) return process_substitution(part);
+  if (part->type == PART_ARITH) {
+    int64_t value;
+    if (arith_part_value(part, &value) < 0) return "";
+    snprintf(num, size, "%lld", (long long)value);
+    return num;
+  }
+  const char* value = param_value(part->text, num, size);
+  return value ? value : "";
+}
+
+// ~ or ~user at text, up to the first of stops or the end of the unquoted
+// text (more: a quoted or expanded part follows, as in ~$x or ~"name"): the
+// home directory it names, and in *len the length it replaces. NULL leaves the
+// text alone, as for a user that does not exist.
+static const char* tilde_home(const char* text, size_t len, const char* stops, int more, size_t* prefix_len) {
+  if (len == 0 || text[0] != '~') return NULL;
+  size_t n = 1;
+  while (n < len && !strchr(stops, text[n])) n++;
+  if (n == len && more) return NULL;
+  const char* home = n == 1 ? get_var("HOME") : NULL;
+  if (!home) {
+    char user[256];
+    if (n > sizeof(user)) return NULL;
+    snprintf(user, sizeof(user), "%.*s", (int)n - 1, text + 1);
+    struct passwd* pw = n == 1 ? getpwuid(getuid()) : getpwnam(user);
+    if (!pw) return NULL;
+    home = pw->pw_dir;
+  }
+  *prefix_len = n;
+  return home;
+}
+
+// Where a tilde prefix may start: the start of the word, and in an assignment
+// (eq is its =) also right after the = and after each : that follows it
+static int tilde_may_start(const char* text, const char* eq, size_t i) {
+  return i == 0 || (eq && (text + i == eq + 1 || (text + i > eq + 1 && text[i - 1] == ':')));
+}
+
+// Append the first, literal part of a word with its tilde prefixes expanded
+// (x=~/src, PATH=~/bin:~bob/bin when assignment is set)
+static void append_tildes(word_part* part, int assignment) {
+  const char* text = part->text;
+  size_t len = part->len;
+  const char* eq = assignment ? memchr(text, '=', len) : NULL;
+  for (size_t i = 0; i < len;) {
+    size_t prefix;
+    const char* home = tilde_may_start(text, eq, i)
+                           ? tilde_home(text + i, len - i, eq ? "/:" : "/", part->next != NULL, &prefix)
+                           : NULL;
+    if (home) {
+      sb_append(&field_buf, home, strlen(home));
+      i += prefix;
+      continue;
+    }
+    size_t next = i + 1;
+    while (next < len && !tilde_may_start(text, eq, next)) next++;
+    sb_append(&field_buf, text + i, next - i);
+    i = next;
+  }
+}
+
+static void expand_word_into(word_part* w, argv_list* out) {
+  int started = 0;
+  field_buf.len = 0;
+
+  for (word_part* part = w; part; part = part->next) {
+    if (part->type == PART_LITERAL) {
+      if (part == w && !part->quoted) {
+        append_tildes(part, 0);
+      } else {
+        sb_append(&field_buf, part->text, part->len);
+      }
+      if (part->quoted || part->len) started = 1;
+      continue;
+    }
+
+    // "$@" keeps every positional parameter as its own field
+    if (part->quoted && strcmp(part->text, "@") == 0) {
+      for (int i = 0; i < positional_count; i++) {
+        if (i > 0) emit_field(out);
+        sb_append(&field_buf, positional[i], strlen(positional[i]));
+        started = 1;
+      }
+      continue;
+    }
+
+    char num[32];
+    const char* value = part_value(part, num, sizeof(num));
+    if (part->quoted) {
+      sb_append(&field_buf, value, strlen(value));
+      started = 1;
+      continue;
+    }
+
+    // Unquoted: split on IFS
+    const char* ifs = get_var("IFS");
+    if (!ifs) ifs = " \t\n";
+    for (const char* v = value; *v; v++) {
+      if (strchr(ifs, *v)) {
+        if (started) emit_field(out);
+        started = 0;
+      } else {
+        sb_append(&field_buf, v, 1);
+        started = 1;
+      }
+    }
+  }
+  if (started) emit_field(out);
+}
+
+static char** expand_words(word_part** words, int nwords, int* argc_out) {
+  argv_list l = {0};
+  argv_push(&l, NULL);
+  l.argc = 0;
+  for (int i = 0; i < nwords; i++) expand_word_into(words[i], &l);
+  *argc_out = l.argc;
+  return l.argv;
+}
+
+// Expand to a single string without field splitting (redirect targets, case
+// words with EXPAND_PATTERN, name=value with EXPAND_ASSIGNMENT)
+static char* expand_word_string(word_part* w, int flags) {
+  field_buf.len = 0;
+  for (word_part* part = w; part; part = part->next) {
+    const char* text = part->text;
+    size_t len = part->len;
+    char num[32];
+    if (part == w && part->type == PART_LITERAL && !part->quoted) {
+      append_tildes(part, flags & EXPAND_ASSIGNMENT);
+      continue;
+    }
+    if (part->type != PART_LITERAL) {
+      text = part_value(part, num, sizeof(num));
+      len = strlen(text);
+    }
+    if ((flags & EXPAND_PATTERN) && part->quoted) {
+      // Quoted pattern characters match themselves
+      for (size_t i = 0; i < len; i++) {
+        if (strchr("*?[]\\", text[i])) sb_append(&field_buf, "\\", 1);
+        sb_append(&field_buf, text + i, 1);
+      }
+    } else {
+      sb_append(&field_buf, text, len);
+    }
+  }
+  return arena_strndup(&argv_arena, field_buf.data ? field_buf.data : "", field_buf.len);
+}
+
+// Executor
+static int wait_status(int status) { return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status); }
+
+static void assign_vars(node* n) {
+  for (int i = 0; i < n->nassigns; i++) {
+    char* text = expand_word_string(n->assigns[i], EXPAND_ASSIGNMENT);
+    char* eq = strchr(text, '=');
+    *eq = '\0';
+    set_var(text, eq + 1);
+  }
+}
+
+// Here-documents and here-strings are read from an in-memory file, or from a
+// pipe where memfd_create is not available; never from a file on disk
+static int here_document_fd(const char* data, size_t len) {
+  int fd = memfd_create("chefs_heredoc", MFD_CLOEXEC);
+  if (fd >= 0) {
+    write_all(fd, data, len);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+  if (len <= 65536) {
+    // Fits in the pipe buffer
+    write_all(fds[1], data, len);
+  } else {
+    out_flush(&builtin_out);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      write_all(fds[1], data, len);
+      _exit(0);
+    }
+    if (pid > 0) add_process_substitution(-1, pid);
+  }
+  close(fds[1]);
+  return fds[0];
+}
+
+// A command's redirects compiled into the fd operations that set it up, in
+// source order: each op makes fd a copy of source, or closes fd when source is
+// FD_CLOSED. Files are opened close-on-exec above the fds scripts can name, so
+// applying the ops never clobbers a file that is still to be used.
+#define REDIRECT_FDS 10
+#define MAX_FD_OPS 32
+#define FD_CLOSED -2
+
+typedef struct {
+  int fd;
+  int source;
+} fd_op;
+
+typedef struct {
+  fd_op ops[MAX_FD_OPS];
+  int nops;
+  int opened[MAX_FD_OPS];
+  int nopened;
+} fd_plan;
+
+static void close_fd_plan(fd_plan* plan) {
+  for (int i = 0; i < plan->nopened; i++) close(plan->opened[i]);
+  plan->nopened = 0;
+}
+
+static int plan_op(fd_plan* plan, int fd, int source) {
+  if (plan->nops == MAX_FD_OPS) {
+    err_printf("chefs_shell: too many redirections\n");
+    return -1;
+  }
+  plan->ops[plan->nops].fd = fd;
+  plan->ops[plan->nops].source = source;
+  plan->nops++;
+  return 0;
+}
+
+// Open the file or here-document of a redirect; -1 after reporting an error
+static int open_redirect_target(redirect* r, const char* target) {
+  int fd;
+  if (r->op == REDIR_HEREDOC) {
+    fd = here_document_fd(target, strlen(target));
+  } else if (r->op == REDIR_HERESTRING) {
+    size_t len = strlen(target);
+    char* line = arena_alloc(&argv_arena, len + 1);
+    memcpy(line, target, len);
+    line[len] = '\n';
+    fd = here_document_fd(line, len + 1);
+  } else if (r->op == REDIR_INPUT) {
+    fd = open(target, O_RDONLY | O_CLOEXEC);
+  } else {
+    int append = r->op == REDIR_APPEND || r->op == REDIR_BOTH_APPEND;
+    fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+  }
+  if (fd < 0) {
+    int here = r->op == REDIR_HEREDOC || r->op == REDIR_HERESTRING;
+    err_printf("chefs_shell: %s: %s\n", here ? "here-document" : target, strerror(errno));
+    return -1;
+  }
+  if (fd < REDIRECT_FDS) {
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+    close(fd);
+    fd = high;
+  }
+  return fd;
+}
+
+static int is_fd_number(const char* s) {
+  if (!*s) return 0;
+  for (; *s; s++) {
+    if (!isdigit((unsigned char)*s)) return 0;
+  }
+  return 1;
+}
+
+// Expand and open every redirect of a command into plan. Returns -1 after
+// reporting an error, with nothing left open.
+static int plan_redirects(redirect* r, fd_plan* plan) {
+  plan->nops = 0;
+  plan->nopened = 0;
+  for (; r; r = r->next) {
+    if (r->fd < 0 || r->fd >= REDIRECT_FDS) {
+      err_printf("chefs_shell: %d: redirection not supported\n", r->fd);
+      close_fd_plan(plan);
+      return -1;
+    }
+    char* target = expand_word_string(r->target, 0);
+    int op = r->op;
+    if (op == REDIR_DUP) {
+      if (strcmp(target, "-") == 0) {
+        if (plan_op(plan, r->fd, FD_CLOSED) < 0) break;
+        continue;
+      }
+      if (is_fd_number(target)) {
+        if (plan_op(plan, r->fd, atoi(target)) < 0) break;
+        continue;
+      }
+      if (r->fd != STDOUT_FILENO) {
+        err_printf("chefs_shell: %s: ambiguous redirect\n", target);
+        break;
+      }
+      // >&file is &>file
+      op = REDIR_BOTH;
+    }
+
+    int fd = open_redirect_target(r, target);
+    if (fd < 0) break;
+    plan->opened[plan->nopened++] = fd;
+    if (plan_op(plan, op == REDIR_BOTH || op == REDIR_BOTH_APPEND ? STDOUT_FILENO : r->fd, fd) < 0) break;
+    if ((op == REDIR_BOTH || op == REDIR_BOTH_APPEND) && plan_op(plan, STDERR_FILENO, fd) < 0) break;
+  }
+  if (r) {
+    close_fd_plan(plan);
+    return -1;
+  }
+  return 0;
+}
+
+// Carry out a plan on the real fds; -1 after reporting a bad source fd
+static int apply_fd_plan(fd_plan* plan) {
+  for (int i = 0; i < plan->nops; i++) {
+    fd_op* op = &plan->ops[i];
+    if (op->source == FD_CLOSED) {
+      close(op->fd);
+    } else if (op->source != op->fd && dup2(op->source, op->fd) < 0) {
+      err_printf("chefs_shell: %d: %s\n", op->source, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Work out where fds 0-2 end up without touching them, for commands run inside
+// the shell. A closed fd resolves to FD_CLOSED.
+static int resolve_fd_plan(fd_plan* plan, int fds[3]) {
+  int map[REDIRECT_FDS];
+  for (int i = 0; i < REDIRECT_FDS; i++) map[i] = i;
+  for (int i = 0; i < plan->nops; i++) {
+    fd_op* op = &plan->ops[i];
+    int source = op->source;
+    if (source >= 0 && source < REDIRECT_FDS && op->fd != source) {
+      source = map[source];
+      if (source == FD_CLOSED || fcntl(source, F_GETFD) < 0) {
+        err_printf("chefs_shell: %d: %s\n", op->source, strerror(EBADF));
+        return -1;
+      }
+    }
+    map[op->fd] = source;
+  }
+  for (int i = 0; i < 3; i++) fds[i] = map[i];
+  return 0;
+}
+
+static void restore_fds(int saved[REDIRECT_FDS]) {
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  for (int i = 0; i < REDIRECT_FDS; i++) {
+    if (saved[i] == FD_CLOSED) {
+      close(i);
+    } else if (saved[i] >= 0) {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+}
+
+// Apply a plan to the shell's own fds, saving each fd it touches for restore_fds
+static int apply_fd_plan_saved(fd_plan* plan, int saved[REDIRECT_FDS]) {
+  for (int i = 0; i < REDIRECT_FDS; i++) saved[i] = -1;
+  for (int i = 0; i < plan->nops; i++) {
+    int fd = plan->ops[i].fd;
+    if (saved[fd] != -1) continue;
+    saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+    if (saved[fd] < 0) saved[fd] = FD_CLOSED;
+  }
+  int result = apply_fd_plan(plan);
+  if (result < 0) restore_fds(saved);
+  return result;
+}
+
+// Apply a command's redirects to the shell's own fds for as long as a compound
+// command or function runs; every fd they touch is saved above fd 10, or
+// recorded as closed, and put back by restore_fds
+static int redirect_fds(redirect* redirs, int saved[REDIRECT_FDS]) {
+  fd_plan plan;
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  if (plan_redirects(redirs, &plan) < 0) return -1;
+  int result = apply_fd_plan_saved(&plan, saved);
+  close_fd_plan(&plan);
+  return result;
+}
+
+// Builtins and fast paths read fd 0 themselves, so a redirected stdin is swapped
+// in around them; returns the saved original or -1
+static int swap_stdin(int fd) {
+  if (fd == STDIN_FILENO) return -1;
+  sync_read_buffers();
+  int saved = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+  if (fd == FD_CLOSED) {
+    close(STDIN_FILENO);
+  } else {
+    dup2(fd, STDIN_FILENO);
+  }
+  return saved;
+}
+
+static void restore_stdin(int saved) {
+  if (saved < 0) return;
+  sync_read_buffers();
+  dup2(saved, STDIN_FILENO);
+  close(saved);
+}
+
+// Builtins write through builtin_out and builtin_err_fd, so their redirects are
+// resolved to fds and never applied to the shell's own stdout and stderr
+static int command_not_found(char* argv[]) {
+  err_printf("%s: command not found\n", argv[0]);
+  return 127;
+}
+
+static int run_builtin(builtin_command* b, char* argv[], redirect* redirs) {
+  if (!redirs) return b->run(argv);
+
+  fd_plan plan;
+  int fds[3];
+  if (plan_redirects(redirs, &plan) < 0) return 1;
+  if (resolve_fd_plan(&plan, fds) < 0) {
+    close_fd_plan(&plan);
+    return 1;
+  }
+  out_flush(&builtin_out);
+  int saved_in = swap_stdin(fds[0]);
+  int saved_out = builtin_out.fd;
+  int saved_err = builtin_err_fd;
+  int saved_error = builtin_out.error;
+  builtin_out.fd = fds[1];
+  builtin_out.error = 0;
+  builtin_err_fd = fds[2];
+  int status = b->run(argv);
+  out_flush(&builtin_out);
+  // echo hi >&- or > /dev/full fails as in bash; a reader that went away does not
+  if (builtin_out.error && builtin_out.error != EPIPE) {
+    err_printf("%s: write error: %s\n", argv[0], strerror(builtin_out.error));
+    status = 1;
+  }
+  builtin_out.error = saved_error;
+  builtin_out.fd = saved_out;
+  builtin_err_fd = saved_err;
+  restore_stdin(saved_in);
+  close_fd_plan(&plan);
+  return status;
+}
+
+static int run_fast_path(fast_path* fast, char* argv[], redirect* redirs) {
+  fd_plan plan = {.nops = 0, .nopened = 0};
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  if (redirs) {
+    if (plan_redirects(redirs, &plan) < 0) return 1;
+    if (resolve_fd_plan(&plan, fds) < 0) {
+      close_fd_plan(&plan);
+      return 1;
+    }
+  }
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  int saved_in = swap_stdin(fds[0]);
+  int status = fast->run(argv, fds[1], fds[2]);
+  restore_stdin(saved_in);
+  close_fd_plan(&plan);
+  return status;
+}
+
+static int call_function(shell_function* f, char* argv[], int argc, redirect* redirs) {
+  int saved[REDIRECT_FDS];
+  if (redirs && redirect_fds(redirs, saved) < 0) return 1;
+
+  char** saved_positional = positional;
+  int saved_count = positional_count;
+  int saved_loop_depth = loop_depth;
+  positional = argv + 1;
+  positional_count = argc - 1;
+  loop_depth = 0;
+  function_depth++;
+
+  int status = exec_node(f->body);
+  if (unwind == UNWIND_RETURN) unwind = UNWIND_NONE;
+
+  function_depth--;
+  loop_depth = saved_loop_depth;
+  positional = saved_positional;
+  positional_count = saved_count;
+  if (redirs) restore_fds(saved);
+  return status;
+}
+
+// Child side of an external command: redirects, prefix assignments, exec
+static void exec_external(node* n, char* argv[], const char* exec_path) {
+  fd_plan plan;
+  if (plan_redirects(n->redirs, &plan) < 0 || apply_fd_plan(&plan) < 0) child_exit(1);
+  for (int i = 0; i < n->nassigns; i++) {
+    char* text = expand_word_string(n->assigns[i], EXPAND_ASSIGNMENT);
+    char* eq = strchr(text, '=');
+    *eq = '\0';
+    setenv(text, eq + 1, 1);
+  }
+  execv(exec_path, argv);
+  perror("execv failed");
+  child_exit(126);
+}
+
+// Run one expanded command. in_child is set inside a pipeline stage, where an
+// external command replaces the process instead of forking again.
+static int run_command(node* n, char* argv[], int argc, int in_child) {
+  shell_function* f = find_function(argv[0]);
+  if (f) {
+    assign_vars(n);
+    return call_function(f, argv, argc, n->redirs);
+  }
+
+  builtin_command* builtin = find_builtin_command(argv[0]);
+  if (builtin) {
+    assign_vars(n);
+    return run_builtin(builtin, argv, n->redirs);
+  }
+
+  fast_path* fast = n->nassigns ? NULL : find_fast_path(argv[0]);
+  if (fast) {
+    int status = run_fast_path(fast, argv, n->redirs);
+    if (status != FAST_PATH_UNSUPPORTED) return status;
+  }
+
+  char exec_path[PATH_MAX];
+  if (!find_in_path(argv[0], exec_path, sizeof(exec_path))) {
+    // Reported through the command's own redirects: nosuchcmd 2>/dev/null
+    builtin_command missing = {argv[0], command_not_found, 0};
+    return run_builtin(&missing, argv, n->redirs);
+  }
+
+  if (in_child) exec_external(n, argv, exec_path);
+
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork failed");
+    return 1;
+  }
+  if (pid == 0) exec_external(n, argv, exec_path);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return wait_status(status);
+}
+
+static int exec_simple(node* n, int in_child) {
+  arena_mark mark = arena_save(&argv_arena);
+  int process_subs = process_sub_count;
+  int argc;
+  subst_status = -1;
+  arith_failed = 0;
+  char** argv = expand_words(n->words, n->nwords, &argc);
+  int status = 0;
+
+  if (arith_failed) {
+    // A bad $((...)) stops the command
+    status = 1;
+  } else if (argc > 0) {
+    status = run_command(n, argv, argc, in_child);
+  } else {
+    // x=$(cmd) takes the status of cmd
+    assign_vars(n);
+    if (subst_status >= 0) status = subst_status;
+    // Redirections without a command still create or truncate their files
+    fd_plan plan;
+    if (n->redirs) {
+      if (plan_redirects(n->redirs, &plan) < 0) {
+        status = 1;
+      } else {
+        close_fd_plan(&plan);
+      }
+    }
+  }
+
+  finish_process_substitutions(process_subs);
+  arena_restore(&argv_arena, mark);
+  set_pipe_status(&status, 1);
+  return status;
+}
+
+// A pollable fd that becomes readable when pid exits; -1 where the kernel has no
+// pidfd_open
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Reap children in the order they exit, watching one pidfd per child on a single
+// poll set, and store the exit status of pids[i] in statuses[i]. Children
+// without a pidfd are waited for in order afterwards.
+static void wait_children(pid_t* pids, int count, int* statuses) {
+  if (count == 0) return;
+  struct pollfd fds[count];
+  int pending = 0;
+  for (int i = 0; i < count; i++) {
+    statuses[i] = -1;
+    fds[i].fd = open_pidfd(pids[i]);
+    fds[i].events = POLLIN;
+    if (fds[i].fd >= 0) pending++;
+  }
+
+  while (pending > 0) {
+    if (poll(fds, count, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (fds[i].fd < 0 || !fds[i].revents) continue;
+      int wstatus;
+      if (waitpid(pids[i], &wstatus, 0) == pids[i]) statuses[i] = wait_status(wstatus);
+      close(fds[i].fd);
+      fds[i].fd = -1;  // poll skips negative fds
+      pending--;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (fds[i].fd >= 0) close(fds[i].fd);
+    if (statuses[i] >= 0) continue;
+    int wstatus;
+    statuses[i] = waitpid(pids[i], &wstatus, 0) == pids[i] ? wait_status(wstatus) : 1;
+  }
+}
+
+// Pipeline stage placement, $CHEFS_PIPELINE_AFFINITY. Stages hand their data
+// to each other through pipe buffers, so where they run decides whether that
+// data is still in a shared cache when the next stage reads it:
+//   compact  each stage on a core of its own, neighbouring cores of one package
+//   spread   each stage on a core of its own, taking packages in turn
+//   numa     every stage on all the CPUs of the NUMA node the shell is on
+// Unset or anything else leaves placement to the scheduler. Stages are laid
+// out from the CPU the shell is running on, so concurrent pipelines start in
+// different places, and they move on to second hardware threads only once
+// every core has a stage. The topology comes from /sys and is read again only
+// when the CPUs the shell may use change.
+enum { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SPREAD, AFFINITY_NUMA };
+
+typedef struct {
+  int cpu;
+  int package;
+  int core;
+  int node;
+  int thread;  // among the hardware threads of its core
+  int rank;    // of its core among those of its package
+} cpu_place;
+
+static cpu_place* cpu_places = NULL;  // the CPUs the shell may use
+static int cpu_place_count = 0;
+static cpu_set_t cpu_places_mask;
+static int* compact_order = NULL;  // indexes into cpu_places
+static int* spread_order = NULL;
+
+// An integer from a /sys file; -1 if it cannot be read
+static int sysfs_int(const char* path) {
+  char buf[32];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buf[n] = '\0';
+  return atoi(buf);
+}
+
+// The NUMA node of cpu: its cpuN/nodeM link, 0 on a machine without any
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* d = opendir(path);
+  if (!d) return 0;
+  int node = 0;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, "node", 4) == 0 && isdigit((unsigned char)e->d_name[4])) {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(d);
+  return node;
+}
+
+static int compare_compact(const void* a, const void* b) {
+  const cpu_place* x = &cpu_places[*(const int*)a];
+  const cpu_place* y = &cpu_places[*(const int*)b];
+  if (x->thread != y->thread) return x->thread - y->thread;
+  if (x->package != y->package) return x->package - y->package;
+  if (x->node != y->node) return x->node - y->node;
+  if (x->core != y->core) return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+
+static int compare_spread(const void* a, const void* b) {
+  const cpu_place* x = &cpu_places[*(const int*)a];
+  const cpu_place* y = &cpu_places[*(const int*)b];
+  if (x->thread != y->thread) return x->thread - y->thread;
+  if (x->rank != y->rank) return x->rank - y->rank;
+  if (x->package != y->package) return x->package - y->package;
+  return x->cpu - y->cpu;
+}
+
+static int compare_core(const void* a, const void* b) {
+  const cpu_place* x = a;
+  const cpu_place* y = b;
+  if (x->package != y->package) return x->package - y->package;
+  if (x->core != y->core) return x->core - y->core;
+  return x->cpu - y->cpu;
+}
+
+// Read the topology of the CPUs in allowed; 0 on success
+static int load_cpu_places(const cpu_set_t* allowed) {
+  int count = CPU_COUNT(allowed);
+  cpu_place* places = mem_malloc(MEM_CACHES, count * sizeof(cpu_place));
+  int* compact = mem_malloc(MEM_CACHES, count * sizeof(int));
+  int* spread = mem_malloc(MEM_CACHES, count * sizeof(int));
+  if (!places || !compact || !spread) {
+    mem_free(MEM_CACHES, places);
+    mem_free(MEM_CACHES, compact);
+    mem_free(MEM_CACHES, spread);
+    return -1;
+  }
+
+  int n = 0;
+  char path[96];
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < count; cpu++) {
+    if (!CPU_ISSET(cpu, allowed)) continue;
+    cpu_place* p = &places[n++];
+    p->cpu = cpu;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    p->package = sysfs_int(path);
+    // A core is named by its first CPU: core_id repeats across the dies of a package
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    p->core = sysfs_int(path);
+    if (p->core < 0) p->core = cpu;  // no topology: every CPU is a core
+    if (p->package < 0) p->package = 0;
+    p->node = cpu_node(cpu);
+  }
+
+  // Sorted by core, the threads of a core and the cores of a package are runs
+  qsort(places, n, sizeof(cpu_place), compare_core);
+  for (int i = 0; i < n; i++) {
+    cpu_place* p = &places[i];
+    cpu_place* prev = i ? &places[i - 1] : NULL;
+    int same_package = prev && prev->package == p->package;
+    int same_core = same_package && prev->core == p->core;
+    p->thread = same_core ? prev->thread + 1 : 0;
+    p->rank = !same_package ? 0 : same_core ? prev->rank : prev->rank + 1;
+  }
+
+  mem_free(MEM_CACHES, cpu_places);
+  mem_free(MEM_CACHES, compact_order);
+  mem_free(MEM_CACHES, spread_order);
+  cpu_places = places;
+  cpu_place_count = n;
+  compact_order = compact;
+  spread_order = spread;
+  for (int i = 0; i < n; i++) compact[i] = spread[i] = i;
+  qsort(compact, n, sizeof(int), compare_compact);
+  qsort(spread, n, sizeof(int), compare_spread);
+  cpu_places_mask = *allowed;
+  return 0;
+}
+
+typedef struct {
+  int policy;
+  int start;  // position in the order of the first stage's CPU
+  int node;   // for AFFINITY_NUMA
+} stage_placement;
+
+// Decided once per pipeline, before the stages fork
+static stage_placement plan_placement(void) {
+  stage_placement pl = {AFFINITY_NONE, 0, 0};
+  const char* v = get_var("CHEFS_PIPELINE_AFFINITY");
+  if (v == NULL) return pl;
+  int policy = strcmp(v, "compact") == 0  ? AFFINITY_COMPACT
+               : strcmp(v, "spread") == 0 ? AFFINITY_SPREAD
+               : strcmp(v, "numa") == 0   ? AFFINITY_NUMA
+                                          : AFFINITY_NONE;
+  if (policy == AFFINITY_NONE) return pl;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return pl;
+  if ((!cpu_places || !CPU_EQUAL(&allowed, &cpu_places_mask)) && load_cpu_places(&allowed) < 0) return pl;
+  if (cpu_place_count == 0) return pl;
+
+  int here = sched_getcpu();
+  const int* order = policy == AFFINITY_SPREAD ? spread_order : compact_order;
+  for (int i = 0; i < cpu_place_count; i++) {
+    if (cpu_places[order[i]].cpu == here) {
+      pl.start = i;
+      pl.node = cpu_places[order[i]].node;
+      break;
+    }
+  }
+  pl.policy = policy;
+  return pl;
+}
+
+// Child side: pin the process running stage
+static void place_stage(stage_placement pl, int stage) {
+  if (pl.policy == AFFINITY_NONE) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pl.policy == AFFINITY_NUMA) {
+    for (int i = 0; i < cpu_place_count; i++) {
+      if (cpu_places[i].node == pl.node) CPU_SET(cpu_places[i].cpu, &set);
+    }
+  } else {
+    const int* order = pl.policy == AFFINITY_SPREAD ? spread_order : compact_order;
+    CPU_SET(cpu_places[order[(pl.start + stage) % cpu_place_count]].cpu, &set);
+  }
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int exec_pipeline(node* n) {
+  int count = n->nkids;
+  if (count == 1) return exec_node(n->kids[0]);
+
+  int pipes[count - 1][2];
+  pid_t pids[count];
+
+  for (int i = 0; i < count - 1; i++) {
+    if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+      perror("pipe");
+      for (int j = 0; j < i; j++) {
+        close(pipes[j][0]);
+        close(pipes[j][1]);
+      }
+      return 1;
+    }
+  }
+
+  stage_placement placement = plan_placement();
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  int started = 0;
+  for (int c = 0; c < count; c++) {
+    pids[c] = fork();
+    if (pids[c] < 0) {
+      perror("fork");
+      break;
+    }
+    started++;
+
+    if (pids[c] == 0) {
+      place_stage(placement, c);
+      // read from previous pipe (except first command), write to the next one (except last)
+      if (c > 0) dup2(pipes[c - 1][0], 0);
+      if (c < count - 1) dup2(pipes[c][1], 1);
+      for (int i = 0; i < count - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+      }
+      node* stage = n->kids[c];
+      child_exit(stage->type == NODE_SIMPLE ? exec_simple(stage, 1) : exec_node(stage));
+    }
+  }
+
+  for (int i = 0; i < count - 1; i++) {
+    close(pipes[i][0]);
+    close(pipes[i][1]);
+  }
+
+  int statuses[count];
+  wait_children(pids, started, statuses);
+  set_pipe_status(statuses, started);
+  return started == count ? statuses[count - 1] : 1;
+}
+
+// Seconds in "1.5", "30s", "2m", "1h" or "1d"; -1 if malformed
+static double parse_duration(const char* s) {
+  char* end;
+  double value = strtod(s, &end);
+  if (end == s || value < 0) return -1;
+  if (*end && end[1]) return -1;
+  switch (*end) {
+    case '\0':
+    case 's':
+      return value;
+    case 'm':
+      return value * 60;
+    case 'h':
+      return value * 3600;
+    case 'd':
+      return value * 86400;
+  }
+  return -1;
+}
+
+static int parse_signal(const char* s) {
+  static const struct {
+    const char* name;
+    int number;
+  } signals[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+                 {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}};
+  if (isdigit((unsigned char)*s)) return atoi(s);
+  if (strncmp(s, "SIG", 3) == 0) s += 3;
+  for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+    if (strcmp(s, signals[i].name) == 0) return signals[i].number;
+  }
+  return -1;
+}
+
+// Wait up to seconds for pid to exit without reaping it; 1 if it did
+static int wait_for_exit(pid_t pid, int pidfd, double seconds) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double left = seconds - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+    if (left <= 0) return 0;
+    int ms = left > INT_MAX / 1000 ? INT_MAX : (int)(left * 1000) + 1;
+
+    if (pidfd >= 0) {
+      struct pollfd fd = {.fd = pidfd, .events = POLLIN};
+      int ready = poll(&fd, 1, ms);
+      if (ready > 0) return 1;
+      if (ready < 0 && errno != EINTR) return 1;
+    } else {
+      // No pidfd: check every 10ms
+      siginfo_t info;
+      info.si_pid = 0;
+      if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid) return 1;
+      usleep(ms < 10 ? ms * 1000 : 10000);
+    }
+  }
+}
+
+// Child side of the builtins that run a command (timeout, parallel): the real
+// fds 1 and 2 take over from the builtin's redirected ones, then argv runs as a
+// simple command would
+static void run_argv_in_child(char** argv) {
+  if (builtin_out.fd == FD_CLOSED) {
+    close(STDOUT_FILENO);
+  } else if (builtin_out.fd != STDOUT_FILENO && builtin_out.fd != OUT_CAPTURE) {
+    dup2(builtin_out.fd, STDOUT_FILENO);
+  }
+  if (builtin_err_fd == FD_CLOSED) {
+    close(STDERR_FILENO);
+  } else if (builtin_err_fd != STDERR_FILENO) {
+    dup2(builtin_err_fd, STDERR_FILENO);
+  }
+  builtin_out.fd = STDOUT_FILENO;
+  builtin_out.len = 0;
+  builtin_err_fd = STDERR_FILENO;
+
+  int argc = 0;
+  while (argv[argc]) argc++;
+  node cmd = {.type = NODE_SIMPLE};
+  child_exit(run_command(&cmd, argv, argc, 1));
+}
+
+// timeout [--foreground] [-s signal] [-k duration] duration command [args...]
+// The command runs in its own process group, so a function or script that
+// starts a pipeline is stopped as a whole. Exits 124 when the time runs out.
+// Its arguments are one simple command (a function, builtin or program), as
+// with parallel; a pipeline or list has to be wrapped in a function first.
+static int builtin_timeout(char* args[]) {
+  int sig = SIGTERM;
+  double kill_after = 0;
+  int foreground = 0;
+  int i = 1;
+  for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--foreground") == 0) {
+      foreground = 1;
+    } else if (strcmp(args[i], "-s") == 0 && args[i + 1]) {
+      sig = parse_signal(args[++i]);
+      if (sig <= 0) {
+        err_printf("timeout: %s: invalid signal\n", args[i]);
+        return 125;
+      }
+    } else if (strcmp(args[i], "-k") == 0 && args[i + 1]) {
+      kill_after = parse_duration(args[++i]);
+      if (kill_after < 0) {
+        err_printf("timeout: %s: invalid time interval\n", args[i]);
+        return 125;
+      }
+    } else {
+      break;
+    }
+  }
+  if (!args[i] || !args[i + 1]) {
+    err_printf("usage: timeout [--foreground] [-s signal] [-k duration] duration command [args...]\n");
+    return 125;
+  }
+  double duration = parse_duration(args[i]);
+  if (duration < 0) {
+    err_printf("timeout: %s: invalid time interval\n", args[i]);
+    return 125;
+  }
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 125;
+  }
+  if (pid == 0) {
+    if (!foreground) setpgid(0, 0);
+    run_argv_in_child(args + i + 1);
+  }
+  // Set from both sides so the group exists before either relies on it
+  if (!foreground) setpgid(pid, pid);
+  pid_t target = foreground ? pid : -pid;
+
+  int pidfd = open_pidfd(pid);
+  int timed_out = 0;
+  int killed = 0;
+  if (duration > 0 && !wait_for_exit(pid, pidfd, duration)) {
+    timed_out = 1;
+    killed = sig == SIGKILL;
+    kill(target, sig);
+    if (!foreground) kill(target, SIGCONT);
+    if (kill_after > 0 && !wait_for_exit(pid, pidfd, kill_after)) {
+      kill(target, SIGKILL);
+      killed = 1;
+    }
+  }
+  if (pidfd >= 0) close(pidfd);
+
+  int wstatus;
+  waitpid(pid, &wstatus, 0);
+  if (killed) return 128 + SIGKILL;
+  return timed_out ? 124 : wait_status(wstatus);
+}
+
+// One job of parallel: its argument and, while running, its output pipes
+typedef struct {
+  const char* arg;
+  pid_t pid;
+  int fds[2];  // stdout and stderr, -1 once closed
+  str_buf out[2];
+  int status;
+  int done;
+} parallel_job;
+
+// Child side of one job: {} in the command is replaced by the argument, which
+// is otherwise appended
+static void run_parallel_job(char** command, const char* arg) {
+  int count = 0;
+  int replaced = 0;
+  while (command[count]) count++;
+  char** argv = malloc((count + 2) * sizeof(char*));
+  for (int i = 0; i < count; i++) {
+    if (!strstr(command[i], "{}")) {
+      argv[i] = command[i];
+      continue;
+    }
+    str_buf word = {0};
+    const char* s = command[i];
+    for (const char* hole; (hole = strstr(s, "{}")); s = hole + 2) {
+      sb_append(&word, s, hole - s);
+      sb_append(&word, arg, strlen(arg));
+    }
+    sb_append(&word, s, strlen(s));
+    argv[i] = word.data;
+    replaced = 1;
+  }
+  if (!replaced) argv[count++] = (char*)arg;
+  argv[count] = NULL;
+  run_argv_in_child(argv);
+}
+
+static int start_parallel_job(parallel_job* job, char** command) {
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) < 0) return -1;
+  if (pipe2(err, O_CLOEXEC) < 0) {
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+  job->pid = fork();
+  if (job->pid == 0) {
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    builtin_out.fd = STDOUT_FILENO;
+    builtin_err_fd = STDERR_FILENO;
+    run_parallel_job(command, job->arg);
+  }
+  close(out[1]);
+  close(err[1]);
+  if (job->pid < 0) {
+    close(out[0]);
+    close(err[0]);
+    return -1;
+  }
+  job->fds[0] = out[0];
+  job->fds[1] = err[0];
+  return 0;
+}
+
+// parallel [-j N] command [args...] ::: arg...
+// Runs command once per argument (from the list, or one per line of stdin when
+// there is no :::), keeping N jobs in flight. Each job's output is held until
+// every earlier job's has been written, so the output reads as if the jobs ran
+// one after another. Exits with the number of failed jobs, at most 101, or
+// 255 when it cannot go on.
+static int builtin_parallel(char* args[]) {
+  long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int i = 1;
+  if (args[i] && (strcmp(args[i], "-j") == 0 || strcmp(args[i], "--jobs") == 0) && args[i + 1]) {
+    max_jobs = atol(args[i + 1]);
+    if (max_jobs < 1) {
+      err_printf("parallel: %s: invalid job count\n", args[i + 1]);
+      return 255;
+    }
+    i += 2;
+  }
+  if (max_jobs < 1) max_jobs = 1;
+
+  char** command = args + i;
+  int ncommand = 0;
+  while (command[ncommand] && strcmp(command[ncommand], ":::") != 0) ncommand++;
+  if (ncommand == 0) {
+    err_printf("usage: parallel [-j N] command [args...] ::: arg...\n");
+    return 255;
+  }
+
+  const char** job_args;
+  int njobs = 0;
+  str_buf input = {0};
+  if (command[ncommand]) {
+    job_args = (const char**)command + ncommand + 1;
+    while (job_args[njobs]) njobs++;
+  } else {
+    char chunk[65536];
+    ssize_t n;
+    sync_read_buffers();
+    while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      sb_append(&input, chunk, n);
+    }
+    int lines = 0;
+    for (size_t k = 0; k < input.len; k++) lines += input.data[k] == '\n';
+    job_args = malloc((lines + 1) * sizeof(char*));
+    for (char* line = input.data; line && *line;) {
+      char* nl = strchr(line, '\n');
+      if (nl) *nl = '\0';
+      job_args[njobs++] = line;
+      line = nl ? nl + 1 : NULL;
+    }
+  }
+
+  // The command words end at :::
+  char* separator = command[ncommand];
+  command[ncommand] = NULL;
+
+  if (max_jobs > njobs) max_jobs = njobs ? njobs : 1;
+  parallel_job* jobs = calloc(njobs ? njobs : 1, sizeof(parallel_job));
+  int* running = malloc(max_jobs * sizeof(int));
+  struct pollfd* pfds = malloc(2 * max_jobs * sizeof(struct pollfd));
+  int* owners = malloc(2 * max_jobs * sizeof(int));
+  int next_start = 0, next_emit = 0, nrunning = 0, failed = 0, broken = 0;
+
+  out_flush(&builtin_out);
+  while (next_emit < njobs) {
+    while (nrunning < max_jobs && next_start < njobs) {
+      parallel_job* job = &jobs[next_start];
+      job->arg = job_args[next_start];
+      if (start_parallel_job(job, command) < 0) {
+        err_printf("parallel: %s\n", strerror(errno));
+        job->status = 1;
+        job->done = 1;
+      } else {
+        running[nrunning++] = next_start;
+      }
+      next_start++;
+    }
+
+    // Only running jobs are polled, however many finished ones wait behind a
+    // slow earlier job
+    int npfds = 0;
+    for (int r = 0; r < nrunning; r++) {
+      for (int k = 0; k < 2; k++) {
+        if (jobs[running[r]].fds[k] < 0) continue;
+        pfds[npfds].fd = jobs[running[r]].fds[k];
+        pfds[npfds].events = POLLIN;
+        owners[npfds++] = running[r] * 2 + k;
+      }
+    }
+    if (npfds > 0 && poll(pfds, npfds, -1) < 0 && errno != EINTR) {
+      // Stop and reap the jobs still running rather than leave them behind
+      err_printf("parallel: %s\n", strerror(errno));
+      for (int r = 0; r < nrunning; r++) {
+        parallel_job* job = &jobs[running[r]];
+        kill(job->pid, SIGKILL);
+        for (int k = 0; k < 2; k++) {
+          if (job->fds[k] >= 0) close(job->fds[k]);
+        }
+        waitpid(job->pid, NULL, 0);
+      }
+      for (int j = next_emit; j < njobs; j++) {
+        free(jobs[j].out[0].data);
+        free(jobs[j].out[1].data);
+      }
+      broken = 1;
+      break;
+    }
+
+    for (int p = 0; p < npfds; p++) {
+      if (!pfds[p].revents) continue;
+      parallel_job* job = &jobs[owners[p] / 2];
+      int k = owners[p] % 2;
+      char chunk[65536];
+      ssize_t n = read(job->fds[k], chunk, sizeof(chunk));
+      if (n > 0) {
+        sb_append(&job->out[k], chunk, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      close(job->fds[k]);
+      job->fds[k] = -1;
+      if (job->fds[0] < 0 && job->fds[1] < 0) {
+        int wstatus;
+        waitpid(job->pid, &wstatus, 0);
+        job->status = wait_status(wstatus);
+        job->done = 1;
+        for (int r = 0; r < nrunning; r++) {
+          if (running[r] == owners[p] / 2) running[r] = running[--nrunning];
+        }
+      }
+    }
+
+    for (; next_emit < njobs && jobs[next_emit].done; next_emit++) {
+      parallel_job* job = &jobs[next_emit];
+      if (job->out[0].len) out_write(&builtin_out, job->out[0].data, job->out[0].len);
+      out_flush(&builtin_out);
+      if (job->out[1].len) write_all(builtin_err_fd, job->out[1].data, job->out[1].len);
+      free(job->out[0].data);
+      free(job->out[1].data);
+      if (job->status != 0) failed++;
+    }
+  }
+
+  command[ncommand] = separator;
+  if (!separator) free(job_args);
+  free(input.data);
+  free(jobs);
+  free(running);
+  free(pfds);
+  free(owners);
+  if (broken) return 255;
+  return failed > 101 ? 101 : failed;
+}
+
+// After a loop condition or body: 1 if the loop must stop, 0 to carry on
+static int loop_unwind(void) {
+  if (unwind == UNWIND_BREAK) {
+    if (--unwind_levels == 0) unwind = UNWIND_NONE;
+    return 1;
+  }
+  if (unwind == UNWIND_CONTINUE) {
+    if (--unwind_levels == 0) {
+      unwind = UNWIND_NONE;
+      return 0;
+    }
+    return 1;
+  }
+  return unwind != UNWIND_NONE;
+}
+
+static int exec_loop(node* n) {
+  int status = 0;
+  loop_depth++;
+  for (;;) {
+    int cond = exec_node(n->a);
+    if (unwind) {
+      if (loop_unwind()) break;
+      continue;
+    }
+    if ((cond == 0) != (n->type == NODE_WHILE)) break;
+    status = exec_node(n->b);
+    if (loop_unwind()) break;
+  }
+  loop_depth--;
+  return status;
+}
+
+static int exec_for(node* n) {
+  arena_mark mark = arena_save(&argv_arena);
+  char** items = positional;
+  int count = positional_count;
+  if (n->words) items = expand_words(n->words, n->nwords, &count);
+
+  int status = 0;
+  loop_depth++;
+  for (int i = 0; i < count; i++) {
+    set_var(n->name, items[i]);
+    status = exec_node(n->b);
+    if (loop_unwind()) break;
+  }
+  loop_depth--;
+
+  arena_restore(&argv_arena, mark);
+  return status;
+}
+
+static int exec_case(node* n) {
+  arena_mark mark = arena_save(&argv_arena);
+  char* subject = expand_word_string(n->words[0], 0);
+  int status = 0;
+
+  for (int i = 0; i < n->nkids; i++) {
+    node* item = n->kids[i];
+    for (int k = 0; k < item->nwords; k++) {
+      if (fnmatch(expand_word_string(item->words[k], EXPAND_PATTERN), subject, 0) == 0) {
+        status = item->a ? exec_node(item->a) : 0;
+        arena_restore(&argv_arena, mark);
+        return status;
+      }
+    }
+  }
+
+  arena_restore(&argv_arena, mark);
+  return status;
+}
+
+static void define_function(node* n) {
+  shell_function* f = find_function(n->name);
+  if (!f) {
+    f = mem_malloc(MEM_FUNCTIONS, sizeof(shell_function));
+    f->name = mem_strdup(MEM_FUNCTIONS, n->name);
+    f->next = functions;
+    functions = f;
+  }
+  f->body = n->a;
+  retain_parse_arena = 1;
+}
+
+static int exec_subshell(node* n) {
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) child_exit(exec_node(n->a));
+  int status;
+  waitpid(pid, &status, 0);
+  return wait_status(status);
+}
+
+static int exec_node_body(node* n) {
+  int status = 0;
+  switch (n->type) {
+    case NODE_SIMPLE:
+      status = exec_simple(n, 0);
+      break;
+    case NODE_PIPELINE:
+      status = exec_pipeline(n);
+      if (n->negate) status = !status;
+      break;
+    case NODE_AND:
+    case NODE_OR:
+      status = exec_node(n->a);
+      if (!unwind && (status == 0) == (n->type == NODE_AND)) status = exec_node(n->b);
+      break;
+    case NODE_LIST:
+      for (int i = 0; i < n->nkids && !unwind; i++) status = exec_node(n->kids[i]);
+      break;
+    case NODE_IF:
+      status = exec_node(n->a);
+      if (unwind) break;
+      if (status == 0) {
+        status = exec_node(n->b);
+      } else {
+        status = n->c ? exec_node(n->c) : 0;
+      }
+      break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      status = exec_loop(n);
+      break;
+    case NODE_FOR:
+      status = exec_for(n);
+      break;
+    case NODE_CASE:
+      status = exec_case(n);
+      break;
+    case NODE_FUNCTION:
+      define_function(n);
+      break;
+    case NODE_GROUP:
+      status = exec_node(n->a);
+      break;
+    case NODE_ARITH: {
+      // Succeeds when the expression is non-zero
+      arena_mark mark = arena_save(&argv_arena);
+      int64_t value;
+      status = arith_part_value(n->words[0], &value) < 0 ? 1 : value == 0;
+      arena_restore(&argv_arena, mark);
+      set_pipe_status(&status, 1);
+      break;
+    }
+    case NODE_SUBSHELL:
+      status = exec_subshell(n);
+      break;
+  }
+  return status;
+}
+
+static int exec_node(node* n) {
+  int status;
+  if (n->redirs && n->type != NODE_SIMPLE) {
+    int process_subs = process_sub_count;
+    int saved[REDIRECT_FDS];
+    if (redirect_fds(n->redirs, saved) < 0) {
+      status = 1;
+    } else {
+      status = exec_node_body(n);
+      restore_fds(saved);
+    }
+    finish_process_substitutions(process_subs);
+  } else {
+    status = exec_node_body(n);
+  }
+  last_status = status;
+  return status;
+}
+
+// Run a parsed line; its arena stays alive if it defined a function
+static void run_program(program* prog) {
+  if (prog->root) exec_node(prog->root);
+  unwind = UNWIND_NONE;
+  if (!retain_parse_arena) arena_free(&prog->arena);
+  retain_parse_arena = 0;
+}
+
+// Script files. A parsed script is saved to the cache directory as a flat image
+// of its AST: pointers are stored as offsets from the start of the file and
+// listed in a relocation table, so a later run maps the file and patches the
+// pointers in place instead of lexing and parsing again. Entries are keyed by
+// the script's path and are valid while its mtime and size match, or, after a
+// touch, while its content hash does.
+#define SCRIPT_CACHE_MAGIC "CHEFSAST"
+#define SCRIPT_CACHE_VERSION 6
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;  // pointer, node and word_part sizes, so a rebuilt shell never misreads old images
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  uint64_t hash;  // FNV-1a of the script contents
+  uint64_t path_off;
+  uint64_t root_off;
+  uint64_t relocs_off;
+  uint64_t nrelocs;
+  uint64_t image_size;
+} script_cache_header;
+
+#define SCRIPT_CACHE_LAYOUT ((uint32_t)(sizeof(void*) | sizeof(node) << 8 | sizeof(word_part) << 20))
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  uint64_t* relocs;
+  size_t nrelocs;
+  size_t relocs_cap;
+} image_writer;
+
+// Zeroed space in the image; returns its offset
+static size_t iw_alloc(image_writer* w, size_t size, size_t align) {
+  size_t off = (w->len + align - 1) & ~(align - 1);
+  if (off + size > w->cap) {
+    w->cap = (off + size) * 2;
+    w->data = realloc(w->data, w->cap);
+    if (!w->data) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memset(w->data + w->len, 0, off + size - w->len);
+  w->len = off + size;
+  return off;
+}
+
+// Store a pointer field as an offset and remember it for relocation; 0 stays NULL
+static void iw_pointer(image_writer* w, size_t field, size_t target) {
+  uintptr_t value = target;
+  memcpy(w->data + field, &value, sizeof(value));
+  if (target == 0) return;
+  if (w->nrelocs == w->relocs_cap) {
+    w->relocs_cap = w->relocs_cap ? w->relocs_cap * 2 : 256;
+    w->relocs = realloc(w->relocs, w->relocs_cap * sizeof(uint64_t));
+    if (!w->relocs) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  w->relocs[w->nrelocs++] = field;
+}
+
+static size_t save_string(image_writer* w, const char* s, size_t len) {
+  if (!s) return 0;
+  size_t off = iw_alloc(w, len + 1, 1);
+  memcpy(w->data + off, s, len);
+  return off;
+}
+
+static size_t save_node(image_writer* w, node* n);
+
+static size_t save_arith(image_writer* w, arith_node* n) {
+  if (!n) return 0;
+  size_t a = save_arith(w, n->a);
+  size_t b = save_arith(w, n->b);
+  size_t c = save_arith(w, n->c);
+  size_t name = n->name ? save_string(w, n->name, strlen(n->name)) : 0;
+  size_t off = iw_alloc(w, sizeof(arith_node), sizeof(void*));
+  memcpy(w->data + off, n, sizeof(arith_node));
+  iw_pointer(w, off + offsetof(arith_node, a), a);
+  iw_pointer(w, off + offsetof(arith_node, b), b);
+  iw_pointer(w, off + offsetof(arith_node, c), c);
+  iw_pointer(w, off + offsetof(arith_node, name), name);
+  return off;
+}
+
+static size_t save_word(image_writer* w, word_part* part) {
+  if (!part) return 0;
+  size_t next = save_word(w, part->next);
+  size_t text = save_string(w, part->text, part->len);
+  size_t sub = save_node(w, part->sub);
+  size_t arith = save_arith(w, part->arith);
+  size_t off = iw_alloc(w, sizeof(word_part), sizeof(void*));
+  memcpy(w->data + off, part, sizeof(word_part));
+  iw_pointer(w, off + offsetof(word_part, next), next);
+  iw_pointer(w, off + offsetof(word_part, text), text);
+  iw_pointer(w, off + offsetof(word_part, sub), sub);
+  iw_pointer(w, off + offsetof(word_part, arith), arith);
+  return off;
+}
+
+// Pointer arrays keep at least one slot: an empty but present list (for x in; do) is not NULL
+static size_t save_array(image_writer* w, void** items, int count, size_t (*save)(image_writer*, void*)) {
+  if (!items) return 0;
+  size_t* offs = malloc((count + 1) * sizeof(size_t));
+  for (int i = 0; i < count; i++) offs[i] = save(w, items[i]);
+  size_t off = iw_alloc(w, (count > 0 ? count : 1) * sizeof(void*), sizeof(void*));
+  for (int i = 0; i < count; i++) iw_pointer(w, off + i * sizeof(void*), offs[i]);
+  free(offs);
+  return off;
+}
+
+static size_t save_word_item(image_writer* w, void* part) { return save_word(w, part); }
+
+static size_t save_redirects(image_writer* w, redirect* r) {
+  if (!r) return 0;
+  size_t next = save_redirects(w, r->next);
+  size_t target = save_word(w, r->target);
+  size_t off = iw_alloc(w, sizeof(redirect), sizeof(void*));
+  memcpy(w->data + off, r, sizeof(redirect));
+  iw_pointer(w, off + offsetof(redirect, next), next);
+  iw_pointer(w, off + offsetof(redirect, target), target);
+  return off;
+}
+
+static size_t save_node_item(image_writer* w, void* n);
+
+static size_t save_node(image_writer* w, node* n) {
+  if (!n) return 0;
+  size_t a = save_node(w, n->a);
+  size_t b = save_node(w, n->b);
+  size_t c = save_node(w, n->c);
+  size_t kids = save_array(w, (void**)n->kids, n->nkids, save_node_item);
+  size_t words = save_array(w, (void**)n->words, n->nwords, save_word_item);
+  size_t assigns = save_array(w, (void**)n->assigns, n->nassigns, save_word_item);
+  size_t redirs = save_redirects(w, n->redirs);
+  size_t name = n->name ? save_string(w, n->name, strlen(n->name)) : 0;
+
+  size_t off = iw_alloc(w, sizeof(node), sizeof(void*));
+  memcpy(w->data + off, n, sizeof(node));
+  iw_pointer(w, off + offsetof(node, a), a);
+  iw_pointer(w, off + offsetof(node, b), b);
+  iw_pointer(w, off + offsetof(node, c), c);
+  iw_pointer(w, off + offsetof(node, kids), kids);
+  iw_pointer(w, off + offsetof(node, words), words);
+  iw_pointer(w, off + offsetof(node, assigns), assigns);
+  iw_pointer(w, off + offsetof(node, redirs), redirs);
+  iw_pointer(w, off + offsetof(node, name), name);
+  return off;
+}
+
+static size_t save_node_item(image_writer* w, void* n) { return save_node(w, n); }
+
+static int script_cache_enabled(void) {
+  char* env = getenv("CHEFS_SCRIPT_CACHE");
+  return env == NULL || strcmp(env, "0") != 0;
+}
+
+// $CHEFS_CACHE_DIR/name, else $XDG_CACHE_HOME/chefs_shell/name or ~/.cache/chefs_shell/name
+static int cache_dir(const char* name, char* out, size_t size) {
+  char* base = getenv("CHEFS_CACHE_DIR");
+  char* xdg = getenv("XDG_CACHE_HOME");
+  char* home = getenv("HOME");
+  if (base && *base) {
+    snprintf(out, size, "%s/%s", base, name);
+  } else if (xdg && *xdg) {
+    snprintf(out, size, "%s/chefs_shell/%s", xdg, name);
+  } else if (home && *home) {
+    snprintf(out, size, "%s/.cache/chefs_shell/%s", home, name);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int script_cache_dir(char* out, size_t size) { return cache_dir("scripts", out, size); }
+
+// mkdir -p
+static int make_dirs(const char* path) {
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof(buf), "%s", path);
+  for (char* p = buf + 1; *p; p++) {
+    if (*p != '/') continue;
+    *p = '\0';
+    if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+    *p = '/';
+  }
+  return mkdir(buf, 0700) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+static int script_cache_file(const char* resolved, char* out, size_t size) {
+  char dir[PATH_MAX];
+  if (script_cache_dir(dir, sizeof(dir)) < 0) return -1;
+  snprintf(out, size, "%s/%016llx.ast", dir, (unsigned long long)hash_name(resolved, strlen(resolved)));
+  return 0;
+}
+
+// Write the image next to its final name and rename it into place, so readers never see half a file
+static void save_script_cache(const char* resolved, const struct stat* st, uint64_t hash, node* root) {
+  char dir[PATH_MAX];
+  char file[PATH_MAX + 32];
+  if (script_cache_dir(dir, sizeof(dir)) < 0 || make_dirs(dir) < 0) return;
+  if (script_cache_file(resolved, file, sizeof(file)) < 0) return;
+
+  image_writer w = {0};
+  size_t header_off = iw_alloc(&w, sizeof(script_cache_header), sizeof(void*));
+  size_t path_off = save_string(&w, resolved, strlen(resolved));
+  size_t root_off = save_node(&w, root);
+  size_t relocs_off = iw_alloc(&w, w.nrelocs * sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(w.data + relocs_off, w.relocs, w.nrelocs * sizeof(uint64_t));
+
+  script_cache_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SCRIPT_CACHE_MAGIC, sizeof(h.magic));
+  h.version = SCRIPT_CACHE_VERSION;
+  h.layout = SCRIPT_CACHE_LAYOUT;
+  h.mtime_sec = st->st_mtim.tv_sec;
+  h.mtime_nsec = st->st_mtim.tv_nsec;
+  h.size = st->st_size;
+  h.hash = hash;
+  h.path_off = path_off;
+  h.root_off = root_off;
+  h.relocs_off = relocs_off;
+  h.nrelocs = w.nrelocs;
+  h.image_size = w.len;
+  memcpy(w.data + header_off, &h, sizeof(h));
+
+  char tmp[PATH_MAX + 64];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    ssize_t n = write(fd, w.data, w.len);
+    close(fd);
+    if (n != (ssize_t)w.len || rename(tmp, file) != 0) unlink(tmp);
+  }
+  free(w.data);
+  free(w.relocs);
+}
+
+// Is every offset in the image inside it? The path must be a terminated string
+// and every pointer field, and what it points to, must lie between the header
+// and the relocation table, so relocating cannot write outside the mapping or
+// into the table it is reading.
+static int script_cache_in_bounds(const script_cache_header* h) {
+  const char* base = (const char*)h;
+  uint64_t table = h->relocs_off;
+  if (table % sizeof(uint64_t) != 0 || table > h->image_size ||
+      h->nrelocs > (h->image_size - table) / sizeof(uint64_t)) {
+    return 0;
+  }
+  if (h->path_off < sizeof(*h) || h->path_off >= table || !memchr(base + h->path_off, '\0', table - h->path_off)) {
+    return 0;
+  }
+  if (h->root_off < sizeof(*h) || h->root_off > table || table - h->root_off < sizeof(node)) return 0;
+  const uint64_t* relocs = (const uint64_t*)(base + table);
+  for (uint64_t i = 0; i < h->nrelocs; i++) {
+    uintptr_t value;
+    if (relocs[i] < sizeof(*h) || relocs[i] > table || table - relocs[i] < sizeof(value)) return 0;
+    memcpy(&value, base + relocs[i], sizeof(value));
+    if (value < sizeof(*h) || value >= table) return 0;
+  }
+  return 1;
+}
+
+// Map a cache image and check that it belongs to this shell build and stays
+// inside itself; NULL if unusable
+static script_cache_header* map_script_cache(const char* file, size_t* size_out) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(script_cache_header)) {
+    close(fd);
+    return NULL;
+  }
+  // Private mapping: relocation dirties only the pages it touches, never the file
+  void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+
+  script_cache_header* h = base;
+  if (memcmp(h->magic, SCRIPT_CACHE_MAGIC, sizeof(h->magic)) != 0 || h->version != SCRIPT_CACHE_VERSION ||
+      h->layout != SCRIPT_CACHE_LAYOUT || h->image_size != (uint64_t)st.st_size || !script_cache_in_bounds(h)) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  *size_out = st.st_size;
+  return h;
+}
+
+static node* relocate_script_cache(script_cache_header* h) {
+  char* base = (char*)h;
+  uint64_t* relocs = (uint64_t*)(base + h->relocs_off);
+  for (uint64_t i = 0; i < h->nrelocs; i++) {
+    uintptr_t value;
+    memcpy(&value, base + relocs[i], sizeof(value));
+    value += (uintptr_t)base;
+    memcpy(base + relocs[i], &value, sizeof(value));
+  }
+  return (node*)(base + h->root_off);
+}
+
+static char* read_file(const char* path, size_t* len_out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t cap = st.st_size + 1;
+  size_t len = 0;
+  char* buf = malloc(cap);
+  ssize_t n;
+  while (buf && (n = read(fd, buf + len, cap - len - 1)) > 0) {
+    len += n;
+    if (len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  close(fd);
+  if (!buf) return NULL;
+  buf[len] = '\0';
+  *len_out = len;
+  return buf;
+}
+
+// Run a script in the current shell with the given positional parameters.
+// Returns the status of the last command, or 127 if the file cannot be read.
+static int run_script_file(const char* path, char** args, int nargs) {
+  struct stat st;
+  char resolved[PATH_MAX];
+  if (stat(path, &st) < 0 || realpath(path, resolved) == NULL) {
+    err_printf("chefs_shell: %s: %s\n", path, strerror(errno));
+    return 127;
+  }
+
+  int use_cache = script_cache_enabled();
+  char cache_file[PATH_MAX + 32];
+  if (use_cache && script_cache_file(resolved, cache_file, sizeof(cache_file)) < 0) use_cache = 0;
+
+  node* root = NULL;
+  script_cache_header* image = NULL;
+  size_t image_size = 0;
+  program prog = {{NULL}, NULL};
+  char* src = NULL;
+  size_t len = 0;
+
+  if (use_cache) image = map_script_cache(cache_file, &image_size);
+  // Names are a hash of the path, so check the image was saved for this one
+  if (image && strcmp((const char*)image + image->path_off, resolved) != 0) {
+    munmap(image, image_size);
+    image = NULL;
+  }
+  if (image && (image->mtime_sec != st.st_mtim.tv_sec || image->mtime_nsec != st.st_mtim.tv_nsec ||
+                image->size != st.st_size)) {
+    // Touched or rewritten: still good if the contents hash the same
+    src = read_file(path, &len);
+    if (src && (int64_t)len == image->size && hash_name(src, len) == image->hash) {
+      int64_t mtime[2] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+      int fd = open(cache_file, O_WRONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        if (pwrite(fd, mtime, sizeof(mtime), offsetof(script_cache_header, mtime_sec)) < 0) unlink(cache_file);
+        close(fd);
+      }
+    } else {
+      munmap(image, image_size);
+      image = NULL;
+    }
+  }
+
+  if (image) {
+    root = relocate_script_cache(image);
+    mem_map(MEM_PARSE, image_size);
+  } else {
+    if (!src) src = read_file(path, &len);
+    if (!src) {
+      err_printf("chefs_shell: %s: %s\n", path, strerror(errno));
+      return 127;
+    }
+    int result = parse_program(src, &prog);
+    if (result != PARSE_OK) {
+      if (result == PARSE_INCOMPLETE) err_printf("chefs_shell: %s: syntax error: unexpected end of file\n", path);
+      free(src);
+      return 2;
+    }
+    root = prog.root;
+    if (use_cache && root) save_script_cache(resolved, &st, hash_name(src, len), root);
+  }
+  free(src);
+
+  char** saved_positional = positional;
+  int saved_count = positional_count;
+  if (args) {
+    positional = args;
+    positional_count = nargs;
+  }
+  function_depth++;
+
+  int status = 0;
+  if (root) status = exec_node(root);
+  if (unwind == UNWIND_RETURN) unwind = UNWIND_NONE;
+
+  function_depth--;
+  positional = saved_positional;
+  positional_count = saved_count;
+
+  // Functions defined by the script keep pointing into its AST
+  if (!retain_parse_arena) {
+    if (image) {
+      munmap(image, image_size);
+      mem_map(MEM_PARSE, -(long)image_size);
+    }
+    arena_free(&prog.arena);
+  }
+  retain_parse_arena = 0;
+  return status;
+}
+
+static int builtin_source(char* args[]) {
+  if (args[1] == NULL) {
+    err_printf("%s: filename argument required\n", args[0]);
+    return 2;
+  }
+  int nargs = 0;
+  while (args[2 + nargs]) nargs++;
+  return run_script_file(args[1], nargs > 0 ? args + 2 : NULL, nargs);
+}
+
+// scriptcache [list|clear|dir]
+static int builtin_scriptcache(char* args[]) {
+  char dir[PATH_MAX];
+  if (script_cache_dir(dir, sizeof(dir)) < 0) {
+    err_printf("scriptcache: no cache directory (set HOME or CHEFS_CACHE_DIR)\n");
+    return 1;
+  }
+  const char* action = args[1] ? args[1] : "list";
+  if (strcmp(action, "dir") == 0) {
+    out_printf("%s\n", dir);
+    return 0;
+  }
+  if (strcmp(action, "list") != 0 && strcmp(action, "clear") != 0) {
+    err_printf("scriptcache: usage: scriptcache [list|clear|dir]\n");
+    return 2;
+  }
+
+  DIR* d = opendir(dir);
+  if (!d) return 0;
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL) {
+    size_t name_len = strlen(entry->d_name);
+    if (name_len < 4 || strcmp(entry->d_name + name_len - 4, ".ast") != 0) continue;
+    char file[PATH_MAX + 256];
+    snprintf(file, sizeof(file), "%s/%s", dir, entry->d_name);
+
+    if (strcmp(action, "clear") == 0) {
+      unlink(file);
+      continue;
+    }
+
+    size_t size;
+    script_cache_header* h = map_script_cache(file, &size);
+    if (!h) {
+      out_printf("%-8s %8s  %s\n", "invalid", "-", file);
+      continue;
+    }
+    const char* source = (const char*)h + h->path_off;
+    struct stat st;
+    const char* state = "fresh";
+    if (stat(source, &st) < 0) {
+      state = "missing";
+    } else if (st.st_mtim.tv_sec != h->mtime_sec || st.st_mtim.tv_nsec != h->mtime_nsec ||
+               st.st_size != h->size) {
+      state = "stale";
+    }
+    out_printf("%-8s %8zu  %s\n", state, size, source);
+    munmap(h, size);
+  }
+  closedir(d);
+  return 0;
+}
+
+// cache: replays the saved stdout, stderr and status of a deterministic command.
+// An entry is keyed by the command's argv, cwd, a few environment variables and
+// the identity and mtime of its declared dependencies; the outputs themselves
+// are stored once per content in blobs/, named by hash and length. Only runs
+// that exit 0 are stored, unless --keep-failed asks for the others too; runs
+// killed by a signal never are.
+#define COMMAND_CACHE_MAGIC "CHEFSRN2"
+#define COMMAND_CACHE_MAX_DEPS 64
+#define COMMAND_CACHE_MAX_ENV 16
+
+typedef struct {
+  char magic[8];
+  int64_t created_ms;  // wall clock
+  int32_t status;
+  uint32_t key_len;
+  uint64_t blob_hash[2];  // stdout, stderr
+  uint64_t blob_len[2];
+  uint64_t blob_check[2];  // blob_check() of each, verified on replay
+} command_cache_entry;
+
+static int64_t wall_clock_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void blob_name(char* out, size_t size, const char* dir, uint64_t hash, uint64_t len) {
+  snprintf(out, size, "%s/blobs/%016llx-%llx", dir, (unsigned long long)hash, (unsigned long long)len);
+}
+
+// A second hash of a blob's content, with another basis than the one in its
+// name, so a blob stored for different output that hashed the same is caught
+static uint64_t blob_check(const char* data, size_t len) {
+  uint64_t h = 0x84222325cbf29ce4ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return h ^ len;
+}
+
+// Write data to path through a temporary file, so readers see all of it or none
+static int write_file_atomic(const char* path, const void* data, size_t len) {
+  char tmp[PATH_MAX + 64];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return -1;
+  ssize_t n = len ? write(fd, data, len) : 0;
+  close(fd);
+  if (n != (ssize_t)len || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// 64M unless CHEFS_CACHE_MAX says otherwise (bytes, or with a K, M or G suffix)
+static uint64_t command_cache_cap(void) {
+  char* env = getenv("CHEFS_CACHE_MAX");
+  if (!env || !*env) return 64ULL << 20;
+  char* end;
+  uint64_t cap = strtoull(env, &end, 10);
+  switch (*end) {
+    case 'K':
+    case 'k':
+      return cap << 10;
+    case 'M':
+    case 'm':
+      return cap << 20;
+    case 'G':
+    case 'g':
+      return cap << 30;
+  }
+  return cap;
+}
+
+typedef struct {
+  char name[32];
+  int64_t mtime_ns;
+  uint64_t size;
+  uint64_t blob_hash[2];
+  uint64_t blob_len[2];
+} cached_run;
+
+typedef struct {
+  char name[48];
+  uint64_t size;
+  int refs;
+} cached_blob;
+
+static int compare_cached_run(const void* a, const void* b) {
+  int64_t x = ((const cached_run*)a)->mtime_ns, y = ((const cached_run*)b)->mtime_ns;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_cached_blob(const void* a, const void* b) {
+  return strcmp(((const cached_blob*)a)->name, ((const cached_blob*)b)->name);
+}
+
+static cached_blob* find_cached_blob(cached_blob* blobs, size_t count, uint64_t hash, uint64_t len) {
+  cached_blob key;
+  snprintf(key.name, sizeof(key.name), "%016llx-%llx", (unsigned long long)hash, (unsigned long long)len);
+  return bsearch(&key, blobs, count, sizeof(cached_blob), compare_cached_blob);
+}
+
+// Drop the least recently used entries (a hit touches its entry) until the
+// store fits under the cap; blobs go when nothing refers to them any more
+static void evict_command_cache(const char* dir) {
+  char path[PATH_MAX + 64];
+  cached_run* runs = NULL;
+  size_t nruns = 0, runs_cap = 0;
+  cached_blob* blobs = NULL;
+  size_t nblobs = 0, blobs_cap = 0;
+  uint64_t total = 0;
+  struct dirent* e;
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/blobs", dir);
+  DIR* d = opendir(path);
+  while (d && (e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.' || strlen(e->d_name) >= sizeof(blobs[0].name)) continue;
+    snprintf(path, sizeof(path), "%s/blobs/%s", dir, e->d_name);
+    if (stat(path, &st) < 0) continue;
+    if (nblobs == blobs_cap) {
+      blobs_cap = blobs_cap ? blobs_cap * 2 : 64;
+      blobs = realloc(blobs, blobs_cap * sizeof(cached_blob));
+    }
+    memcpy(blobs[nblobs].name, e->d_name, strlen(e->d_name) + 1);
+    blobs[nblobs].size = st.st_size;
+    blobs[nblobs].refs = 0;
+    nblobs++;
+    total += st.st_size;
+  }
+  if (d) closedir(d);
+  if (nblobs) qsort(blobs, nblobs, sizeof(cached_blob), compare_cached_blob);
+
+  snprintf(path, sizeof(path), "%s/keys", dir);
+  d = opendir(path);
+  while (d && (e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.' || strlen(e->d_name) >= sizeof(runs[0].name)) continue;
+    snprintf(path, sizeof(path), "%s/keys/%s", dir, e->d_name);
+    command_cache_entry h;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    int ok = fstat(fd, &st) == 0 && read(fd, &h, sizeof(h)) == sizeof(h) &&
+             memcmp(h.magic, COMMAND_CACHE_MAGIC, sizeof(h.magic)) == 0;
+    close(fd);
+    if (!ok) {
+      unlink(path);
+      continue;
+    }
+    if (nruns == runs_cap) {
+      runs_cap = runs_cap ? runs_cap * 2 : 64;
+      runs = realloc(runs, runs_cap * sizeof(cached_run));
+    }
+    cached_run* run = &runs[nruns++];
+    memcpy(run->name, e->d_name, strlen(e->d_name) + 1);
+    run->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    run->size = st.st_size;
+    total += st.st_size;
+    for (int k = 0; k < 2; k++) {
+      run->blob_hash[k] = h.blob_hash[k];
+      run->blob_len[k] = h.blob_len[k];
+      cached_blob* blob = find_cached_blob(blobs, nblobs, h.blob_hash[k], h.blob_len[k]);
+      if (blob) blob->refs++;
+    }
+  }
+  if (d) closedir(d);
+
+  // Blobs left behind by an interrupted store
+  for (size_t i = 0; i < nblobs; i++) {
+    if (blobs[i].refs > 0) continue;
+    snprintf(path, sizeof(path), "%s/blobs/%s", dir, blobs[i].name);
+    if (unlink(path) == 0) total -= blobs[i].size;
+  }
+
+  uint64_t cap = command_cache_cap();
+  if (nruns) qsort(runs, nruns, sizeof(cached_run), compare_cached_run);
+  for (size_t i = 0; i < nruns && total > cap; i++) {
+    snprintf(path, sizeof(path), "%s/keys/%s", dir, runs[i].name);
+    if (unlink(path) != 0) continue;
+    total -= runs[i].size;
+    for (int k = 0; k < 2; k++) {
+      cached_blob* blob = find_cached_blob(blobs, nblobs, runs[i].blob_hash[k], runs[i].blob_len[k]);
+      if (!blob || --blob->refs > 0) continue;
+      blob_name(path, sizeof(path), dir, runs[i].blob_hash[k], runs[i].blob_len[k]);
+      if (unlink(path) == 0) total -= blob->size;
+    }
+  }
+  free(runs);
+  free(blobs);
+}
+
+// Replay a stored run; -1 if there is none, it is older than ttl seconds, or it
+// or one of its blobs was stored for something else that hashed the same
+static int replay_command_cache(const char* dir, const char* entry_path, const str_buf* key, double ttl) {
+  size_t len;
+  char* entry = read_file(entry_path, &len);
+  if (!entry) return -1;
+  command_cache_entry h;
+  int status = -1;
+  char* blob[2] = {NULL, NULL};
+  size_t blob_len[2];
+  memcpy(&h, entry, len < sizeof(h) ? len : sizeof(h));
+  if (len < sizeof(h) || memcmp(h.magic, COMMAND_CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+      len != sizeof(h) + h.key_len || h.key_len != key->len || memcmp(entry + sizeof(h), key->data, key->len) != 0) {
+    goto done;
+  }
+  if (ttl > 0 && (wall_clock_ms() - h.created_ms) / 1000.0 > ttl) goto done;
+
+  for (int k = 0; k < 2; k++) {
+    char path[PATH_MAX + 64];
+    blob_name(path, sizeof(path), dir, h.blob_hash[k], h.blob_len[k]);
+    blob[k] = read_file(path, &blob_len[k]);
+    if (!blob[k] || blob_len[k] != h.blob_len[k] || blob_check(blob[k], blob_len[k]) != h.blob_check[k]) goto done;
+  }
+  out_write(&builtin_out, blob[0], blob_len[0]);
+  out_flush(&builtin_out);
+  write_all(builtin_err_fd, blob[1], blob_len[1]);
+  // Most recently used entries are the last to be evicted
+  utimensat(AT_FDCWD, entry_path, NULL, 0);
+  status = h.status;
+
+done:
+  free(entry);
+  free(blob[0]);
+  free(blob[1]);
+  return status;
+}
+
+// Run the command with stdin from /dev/null, passing its output through as it
+// arrives and keeping a copy of each stream; returns its wait status
+static int record_command(char** command, str_buf out[2]) {
+  int pipes[2][2];
+  if (pipe2(pipes[0], O_CLOEXEC) < 0) return -1;
+  if (pipe2(pipes[1], O_CLOEXEC) < 0) {
+    close(pipes[0][0]);
+    close(pipes[0][1]);
+    return -1;
+  }
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDONLY);
+    dup2(null, STDIN_FILENO);
+    dup2(pipes[0][1], STDOUT_FILENO);
+    dup2(pipes[1][1], STDERR_FILENO);
+    builtin_out.fd = STDOUT_FILENO;
+    builtin_err_fd = STDERR_FILENO;
+    run_argv_in_child(command);
+  }
+  close(pipes[0][1]);
+  close(pipes[1][1]);
+  if (pid < 0) {
+    close(pipes[0][0]);
+    close(pipes[1][0]);
+    return -1;
+  }
+
+  struct pollfd fds[2] = {{.fd = pipes[0][0], .events = POLLIN}, {.fd = pipes[1][0], .events = POLLIN}};
+  while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (int k = 0; k < 2; k++) {
+      if (fds[k].fd < 0 || !fds[k].revents) continue;
+      char chunk[65536];
+      ssize_t n = read(fds[k].fd, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        close(fds[k].fd);
+        fds[k].fd = -1;
+        continue;
+      }
+      sb_append(&out[k], chunk, n);
+      if (k == 0) {
+        out_write(&builtin_out, chunk, n);
+        out_flush(&builtin_out);
+      } else {
+        write_all(builtin_err_fd, chunk, n);
+      }
+    }
+  }
+  for (int k = 0; k < 2; k++) {
+    if (fds[k].fd >= 0) close(fds[k].fd);
+  }
+  int wstatus;
+  if (waitpid(pid, &wstatus, 0) < 0) return -1;
+  return wstatus;
+}
+
+static void store_command_cache(const char* dir, const char* entry_path, const str_buf* key, str_buf out[2],
+                         int status) {
+  command_cache_entry h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, COMMAND_CACHE_MAGIC, sizeof(h.magic));
+  h.created_ms = wall_clock_ms();
+  h.status = status;
+  h.key_len = key->len;
+  for (int k = 0; k < 2; k++) {
+    char path[PATH_MAX + 64];
+    const char* data = out[k].data ? out[k].data : "";
+    h.blob_hash[k] = hash_name(data, out[k].len);
+    h.blob_len[k] = out[k].len;
+    h.blob_check[k] = blob_check(data, out[k].len);
+    blob_name(path, sizeof(path), dir, h.blob_hash[k], h.blob_len[k]);
+    // Content-addressed: reuse an identical output already there, and leave
+    // the run unstored if a different one has taken its name
+    size_t len;
+    char* stored = read_file(path, &len);
+    int same = stored && len == out[k].len && memcmp(stored, data, len) == 0;
+    free(stored);
+    if (stored && !same) return;
+    if (!stored && write_file_atomic(path, data, out[k].len) < 0) return;
+  }
+  char* entry = malloc(sizeof(h) + key->len);
+  memcpy(entry, &h, sizeof(h));
+  memcpy(entry + sizeof(h), key->data, key->len);
+  write_file_atomic(entry_path, entry, sizeof(h) + key->len);
+  free(entry);
+  evict_command_cache(dir);
+}
+
+// cache [--ttl duration] [--dep file...] [--env name...] [--keep-failed] [--] command [args...]
+// cache --clear
+static int builtin_cache(char* args[]) {
+  char dir[PATH_MAX];
+  if (cache_dir("commands", dir, sizeof(dir)) < 0) {
+    err_printf("cache: no cache directory (set HOME or CHEFS_CACHE_DIR)\n");
+    return 1;
+  }
+
+  double ttl = 0;
+  char* deps[COMMAND_CACHE_MAX_DEPS];
+  int ndeps = 0;
+  const char* env[COMMAND_CACHE_MAX_ENV] = {"PATH", "LANG", "LC_ALL"};
+  int nenv = 3;
+  int keep_failed = 0;
+  int i = 1;
+  while (args[i] && strncmp(args[i], "--", 2) == 0) {
+    char* opt = args[i++];
+    if (strcmp(opt, "--") == 0) break;
+    if (strcmp(opt, "--clear") == 0) {
+      char path[PATH_MAX + 32];
+      const char* subdirs[] = {"keys", "blobs"};
+      for (int s = 0; s < 2; s++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, subdirs[s]);
+        DIR* d = opendir(path);
+        struct dirent* e;
+        while (d && (e = readdir(d)) != NULL) {
+          if (e->d_name[0] == '.') continue;
+          char file[PATH_MAX + 300];
+          snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+          unlink(file);
+        }
+        if (d) closedir(d);
+      }
+      return 0;
+    } else if (strcmp(opt, "--keep-failed") == 0) {
+      keep_failed = 1;
+    } else if (strcmp(opt, "--ttl") == 0 && args[i]) {
+      ttl = parse_duration(args[i++]);
+      if (ttl < 0) {
+        err_printf("cache: %s: invalid time interval\n", args[i - 1]);
+        return 2;
+      }
+    } else if (strcmp(opt, "--dep") == 0 || strcmp(opt, "--env") == 0) {
+      // Every word up to the next option
+      for (; args[i] && strncmp(args[i], "--", 2) != 0; i++) {
+        if (opt[2] == 'd' && ndeps < COMMAND_CACHE_MAX_DEPS) {
+          deps[ndeps++] = args[i];
+        } else if (opt[2] == 'e' && nenv < COMMAND_CACHE_MAX_ENV) {
+          env[nenv++] = args[i];
+        }
+      }
+    } else {
+      err_printf("cache: %s: unknown option\n", opt);
+      return 2;
+    }
+  }
+  if (!args[i]) {
+    err_printf("usage: cache [--ttl duration] [--dep file...] [--env name...] [--keep-failed] -- command [args...]\n");
+    return 2;
+  }
+  char** command = args + i;
+
+  str_buf key = {0};
+  for (char** a = command; *a; a++) sb_append(&key, *a, strlen(*a) + 1);
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd))) sb_append(&key, cwd, strlen(cwd) + 1);
+  for (int k = 0; k < nenv; k++) {
+    const char* value = get_var(env[k]);
+    char item[PATH_MAX];
+    int n = snprintf(item, sizeof(item), "%s=%s", env[k], value ? value : "");
+    if (n >= (int)sizeof(item)) n = sizeof(item) - 1;
+    sb_append(&key, item, n + 1);
+  }
+  for (int k = 0; k < ndeps; k++) {
+    struct stat st;
+    char item[PATH_MAX + 128];
+    int n;
+    if (stat(deps[k], &st) == 0) {
+      n = snprintf(item, sizeof(item), "%s %llu %llu %lld %lld.%09ld", deps[k], (unsigned long long)st.st_dev,
+                   (unsigned long long)st.st_ino, (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                   st.st_mtim.tv_nsec);
+    } else {
+      n = snprintf(item, sizeof(item), "%s missing", deps[k]);
+    }
+    if (n >= (int)sizeof(item)) n = sizeof(item) - 1;
+    sb_append(&key, item, n + 1);
+  }
+
+  char entry_path[PATH_MAX + 64];
+  snprintf(entry_path, sizeof(entry_path), "%s/keys/%016llx", dir,
+           (unsigned long long)hash_name(key.data, key.len));
+  int status = replay_command_cache(dir, entry_path, &key, ttl);
+  if (status >= 0) {
+    free(key.data);
+    return status;
+  }
+
+  str_buf out[2] = {{0}, {0}};
+  int wstatus = record_command(command, out);
+  if (wstatus < 0) {
+    perror("cache");
+    status = 1;
+  } else if ((status = wait_status(wstatus)) == 0 || (keep_failed && WIFEXITED(wstatus))) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/keys", dir);
+    int ok = make_dirs(path) == 0;
+    snprintf(path, sizeof(path), "%s/blobs", dir);
+    if (ok && make_dirs(path) == 0) store_command_cache(dir, entry_path, &key, out, status);
+  }
+  free(out[0].data);
+  free(out[1].data);
+  free(key.data);
+  return status;
+}
+
+// Executables on $PATH for command completion. They are kept in one file per
+// PATH in the cache directory, mapped read-only, so the many shells of the web
+// deployment share one copy in the page cache instead of each reading every
+// PATH directory. The file records the dev, inode and mtime of each
+// directory. The first shell to see one change rebuilds the file under a lock
+// and renames it into place; the others then map the new file.
+#define PATH_INDEX_MAGIC "CHEFSPIX"
+#define PATH_INDEX_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t ndirs;
+  uint64_t path_len;   // the $PATH text follows the directory records
+  uint64_t count;      // names: a sorted uint32 offset into the text for each
+  uint64_t names_off;
+  uint64_t text_off;
+  uint64_t size;
+} path_index_header;
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;  // 0 for a missing directory, -1 if it may change unseen
+  int64_t mtime_nsec;
+} path_index_dir;
+
+static path_index_header* path_index = NULL;
+static size_t path_index_size = 0;
+static int path_index_mapped = 0;  // else malloc'd, when there is no cache directory
+
+static void path_dir_state(const char* dir, path_index_dir* out) {
+  struct stat st;
+  memset(out, 0, sizeof(*out));
+  if (stat(dir, &st) != 0) return;
+  out->dev = st.st_dev;
+  out->ino = st.st_ino;
+  out->mtime_sec = st.st_mtim.tv_sec;
+  out->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// Whether h indexes path and none of its directories changed since
+static int path_index_fresh(const path_index_header* h, size_t size, const char* path) {
+  size_t path_len = strlen(path);
+  if (size < sizeof(*h) || memcmp(h->magic, PATH_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != PATH_INDEX_VERSION || h->size != size || h->path_len != path_len) {
+    return 0;
+  }
+  const path_index_dir* dirs = (const path_index_dir*)(h + 1);
+  if (memcmp(dirs + h->ndirs, path, path_len) != 0) return 0;
+
+  uint32_t k = 0;
+  for (const char *dir = path, *end; *dir; dir = *end ? end + 1 : end) {
+    end = strchrnul(dir, ':');
+    if (end == dir) continue;
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%.*s", (int)(end - dir), dir);
+    path_index_dir now;
+    path_dir_state(name, &now);
+    if (k >= h->ndirs || memcmp(&now, &dirs[k], sizeof(now)) != 0) return 0;
+    k++;
+  }
+  return k == h->ndirs;
+}
+
+static const char* path_index_text;
+
+static int compare_path_names(const void* a, const void* b) {
+  return strcmp(path_index_text + *(const uint32_t*)a, path_index_text + *(const uint32_t*)b);
+}
+
+// Read every PATH directory into a new index image
+static path_index_header* build_path_index(const char* path, size_t* size_out) {
+  str_buf dirs = {0}, text = {0}, names = {0};
+  uint32_t ndirs = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_REALTIME, &start);
+
+  for (const char *dir = path, *end; *dir; dir = *end ? end + 1 : end) {
+    end = strchrnul(dir, ':');
+    if (end == dir) continue;
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%.*s", (int)(end - dir), dir);
+    path_index_dir state;
+    path_dir_state(name, &state);
+    // A change later in the same second would leave the mtime as it is
+    if (state.mtime_sec >= start.tv_sec - 1) state.mtime_sec = -1;
+    sb_append(&dirs, (const char*)&state, sizeof(state));
+    ndirs++;
+
+    DIR* d = opendir(name);
+    if (!d) continue;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+      if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+      char full[PATH_MAX + NAME_MAX + 2];
+      snprintf(full, sizeof(full), "%s/%s", name, entry->d_name);
+      struct stat st;
+      if (access(full, X_OK) != 0) continue;
+      if (entry->d_type != DT_REG && (stat(full, &st) != 0 || !S_ISREG(st.st_mode))) continue;
+      uint32_t off = text.len;
+      sb_append(&text, entry->d_name, strlen(entry->d_name) + 1);
+      sb_append(&names, (const char*)&off, sizeof(off));
+    }
+    closedir(d);
+  }
+
+  // Sorted for prefix search; a name found in several directories is kept once
+  uint32_t* offs = (uint32_t*)names.data;
+  size_t count = names.len / sizeof(uint32_t);
+  path_index_text = text.data;
+  if (count) qsort(offs, count, sizeof(uint32_t), compare_path_names);
+  size_t unique = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (unique == 0 || strcmp(text.data + offs[unique - 1], text.data + offs[i]) != 0) offs[unique++] = offs[i];
+  }
+
+  path_index_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, PATH_INDEX_MAGIC, sizeof(h.magic));
+  h.version = PATH_INDEX_VERSION;
+  h.ndirs = ndirs;
+  h.path_len = strlen(path);
+  h.count = unique;
+  h.names_off = (sizeof(h) + dirs.len + h.path_len + 1 + 3) & ~(uint64_t)3;
+  h.text_off = h.names_off + unique * sizeof(uint32_t);
+  h.size = h.text_off + text.len;
+
+  char* image = mem_calloc(MEM_CACHES, 1, h.size);
+  if (image) {
+    memcpy(image, &h, sizeof(h));
+    if (dirs.len) memcpy(image + sizeof(h), dirs.data, dirs.len);
+    memcpy(image + sizeof(h) + dirs.len, path, h.path_len);
+    if (unique) memcpy(image + h.names_off, offs, unique * sizeof(uint32_t));
+    if (text.len) memcpy(image + h.text_off, text.data, text.len);
+  }
+  *size_out = h.size;
+  free(dirs.data);
+  free(text.data);
+  free(names.data);
+  return (path_index_header*)image;
+}
+
+// Does every part of a mapped index lie inside it? The directory records and
+// $PATH come before the names, the names before the text, each name starts in
+// the text and the text ends in a NUL, so completion never reads past the end.
+static int path_index_in_bounds(const path_index_header* h, size_t size) {
+  if (memcmp(h->magic, PATH_INDEX_MAGIC, sizeof(h->magic)) != 0 || h->version != PATH_INDEX_VERSION ||
+      h->size != size) {
+    return 0;
+  }
+  if (h->names_off % sizeof(uint32_t) != 0 || h->text_off > size || h->names_off > h->text_off ||
+      h->path_len > h->names_off ||
+      sizeof(*h) + (uint64_t)h->ndirs * sizeof(path_index_dir) > h->names_off - h->path_len ||
+      h->count > (h->text_off - h->names_off) / sizeof(uint32_t)) {
+    return 0;
+  }
+  uint64_t text_len = size - h->text_off;
+  const char* text = (const char*)h + h->text_off;
+  if (text_len > 0 && text[text_len - 1] != '\0') return 0;
+  const uint32_t* names = (const uint32_t*)((const char*)h + h->names_off);
+  for (uint64_t i = 0; i < h->count; i++) {
+    if (names[i] >= text_len) return 0;
+  }
+  return 1;
+}
+
+static path_index_header* map_path_index(const char* file, size_t* size_out) {
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void* base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(path_index_header)) {
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+  // A corrupt or foreign file is rebuilt like a stale one
+  if (!path_index_in_bounds(base, st.st_size)) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  *size_out = st.st_size;
+  mem_map(MEM_CACHES, st.st_size);
+  return base;
+}
+
+static void drop_path_index(void) {
+  if (!path_index) return;
+  if (path_index_mapped) {
+    munmap(path_index, path_index_size);
+    mem_map(MEM_CACHES, -(long)path_index_size);
+  } else {
+    mem_free(MEM_CACHES, path_index);
+  }
+  path_index = NULL;
+}
+
+// The index for the current $PATH: the mapped one while it is fresh, else the
+// shared file, rebuilt first if it is stale too
+static path_index_header* load_path_index(void) {
+  const char* path = getenv("PATH");
+  if (path == NULL) path = "";
+  if (path_index && path_index_fresh(path_index, path_index_size, path)) return path_index;
+  drop_path_index();
+
+  char dir[PATH_MAX];
+  char file[PATH_MAX + 32];
+  if (cache_dir("path", dir, sizeof(dir)) < 0 || make_dirs(dir) < 0) {
+    path_index = build_path_index(path, &path_index_size);
+    path_index_mapped = 0;
+    return path_index;
+  }
+  snprintf(file, sizeof(file), "%s/%016llx.idx", dir, (unsigned long long)hash_name(path, strlen(path)));
+
+  path_index_mapped = 1;
+  path_index = map_path_index(file, &path_index_size);
+  if (path_index && path_index_fresh(path_index, path_index_size, path)) return path_index;
+  drop_path_index();
+
+  // One shell rebuilds while the others wait, then they all map its file
+  char lock_path[PATH_MAX + 40];
+  snprintf(lock_path, sizeof(lock_path), "%s.lock", file);
+  int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock >= 0) lock_file(lock, LOCK_EX);
+  path_index = map_path_index(file, &path_index_size);
+  if (!path_index || !path_index_fresh(path_index, path_index_size, path)) {
+    drop_path_index();
+    size_t size;
+    path_index_header* image = build_path_index(path, &size);
+    if (image && write_file_atomic(file, image, size) == 0) path_index = map_path_index(file, &path_index_size);
+    if (path_index) {
+      mem_free(MEM_CACHES, image);
+    } else {
+      path_index = image;
+      path_index_size = size;
+      path_index_mapped = 0;
+    }
+  }
+  if (lock >= 0) close(lock);
+  return path_index;
+}
+
+// Embedding API (chefs.h). All shell state is global, so the session handle
+// only guards against opening a second one.
+struct chefs_session {
+  int open;
+};
+
+static chefs_session the_session;
+
+// Calls with a NULL, freed or foreign handle do nothing
+static int session_open(const chefs_session* s) { return s == &the_session && s->open; }
+
+chefs_session* chefs_session_new(const char* name) {
+  static int flush_registered = 0;
+  if (the_session.open) return NULL;
+  the_session.open = 1;
+  shell_pid = getpid();
+  if (name) shell_name = name;
+  // `exit` may end the process in the middle of a command
+  if (!flush_registered) {
+    atexit(flush_builtin_output);
+    flush_registered = 1;
+  }
+  return &the_session;
+}
+
+void chefs_session_free(chefs_session* s) {
+  if (!session_open(s)) return;
+  flush_builtin_output();
+  s->open = 0;
+}
+
+int chefs_exec(chefs_session* s, const char* line, int out_fd, int err_fd) {
+  if (!session_open(s)) return 1;
+  fd_plan plan;
+  plan.nops = 0;
+  plan.nopened = 0;
+  if (out_fd != STDOUT_FILENO) plan_op(&plan, STDOUT_FILENO, out_fd);
+  if (err_fd != STDERR_FILENO) plan_op(&plan, STDERR_FILENO, err_fd);
+  int saved[REDIRECT_FDS];
+  out_flush(&builtin_out);
+  sync_read_buffers();
+  if (apply_fd_plan_saved(&plan, saved) < 0) return 1;
+
+  program prog;
+  int status;
+  int result = parse_program(line, &prog);
+  if (result == PARSE_OK) {
+    run_program(&prog);
+    status = last_status;
+  } else if (result == PARSE_INCOMPLETE) {
+    status = CHEFS_INCOMPLETE;
+  } else {
+    status = last_status = 2;
+  }
+
+  // Flushes builtin output to out_fd before putting the caller's fds back
+  restore_fds(saved);
+  return status;
+}
+
+int chefs_incomplete(chefs_session* s, const char* line) {
+  if (!session_open(s)) return 0;
+  program prog;
+  parse_quietly = 1;
+  int result = parse_program(line, &prog);
+  parse_quietly = 0;
+  arena_free(&prog.arena);
+  return result == PARSE_INCOMPLETE;
+}
+
+int chefs_run_script(chefs_session* s, const char* path, char* args[], int nargs) {
+  if (!session_open(s)) return 1;
+  int status = run_script_file(path, args, nargs);
+  flush_builtin_output();
+  return status;
+}
+
+void chefs_set_status(chefs_session* s, int status) {
+  if (!session_open(s)) return;
+  last_status = status;
+}
+
+const char* chefs_builtin_name(size_t i) { return i < BUILTIN_COUNT ? builtin_commands[i].name : NULL; }
+
+void chefs_prefetch_command(chefs_session* s, const char* name) {
+  if (!session_open(s)) return;
+  if (!find_function(name) && !is_builtin(name)) prefetch_command(name);
+}
+
+int chefs_command_kind(chefs_session* s, const char* name) {
+  if (!session_open(s)) return CHEFS_CMD_UNKNOWN;
+  if (find_function(name)) return CHEFS_CMD_FUNCTION;
+  if (is_builtin(name)) return CHEFS_CMD_BUILTIN;
+  const char* path = getenv("PATH");
+  if (path == NULL) path = "";
+  pthread_mutex_lock(&command_paths_lock);
+  command_path* c = find_command_path(name, hash_name(path, strlen(path)));
+  int kind = !c ? CHEFS_CMD_UNKNOWN : c->path ? CHEFS_CMD_EXTERNAL : CHEFS_CMD_MISSING;
+  pthread_mutex_unlock(&command_paths_lock);
+  return kind;
+}
+
+size_t chefs_path_commands(chefs_session* s, const char* prefix, void (*fn)(const char* name, void* arg), void* arg) {
+  if (!session_open(s)) return 0;
+  path_index_header* h = load_path_index();
+  if (!h) return 0;
+  const uint32_t* names = (const uint32_t*)((const char*)h + h->names_off);
+  const char* text = (const char*)h + h->text_off;
+  size_t prefix_len = strlen(prefix), lo = 0, hi = h->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(text + names[mid], prefix) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t n = 0;
+  for (size_t i = lo; i < h->count && strncmp(text + names[i], prefix, prefix_len) == 0; i++, n++) {
+    if (fn) fn(text + names[i], arg);
+  }
+  return n;
+}
+
+void chefs_history_file(chefs_session* s, const char* path) {
+  if (!session_open(s)) return;
+  histfile = path;
+}
+
+int chefs_history_load(chefs_session* s) {
+  if (!session_open(s)) return 0;
+  return ensure_history_loaded();
+}
+
+void chefs_history_add(chefs_session* s, const char* line) {
+  if (!session_open(s)) return;
+  hist_add(line);
+}
+
+size_t chefs_history_count(chefs_session* s) {
+  if (!session_open(s)) return 0;
+  return shell_history.count;
+}
+
+const char* chefs_history_get(chefs_session* s, size_t i) {
+  if (!session_open(s)) return NULL;
+  return i < shell_history.count ? hist_line(i) : NULL;
+}
+
+void chefs_history_listen(chefs_session* s, void (*listener)(size_t index, const char* line)) {
+  if (!session_open(s)) return;
+  hist_listener = listener;
+}
+
+void chefs_history_save(chefs_session* s) {
+  if (!session_open(s)) return;
+  sync_history_file();
+}
+
+void chefs_memory_source(chefs_session* s, const char* name, size_t (*bytes)(void)) {
+  if (!session_open(s)) return;
+  for (int i = 0; i < MEM_SOURCES; i++) {
+    if (!mem_sources[i].name || strcmp(mem_sources[i].name, name) == 0) {
+      mem_sources[i] = (mem_source){name, bytes};
+      return;
+    }
+  }
+}
@@ -0,0 +1,86 @@
+#ifndef CHEFS_H
+#define CHEFS_H
+
+// libchefs: the ChefsShell parser, builtins and executor as a library, so a
+// program can run shell commands in-process instead of driving chefs_shell
+// through a terminal. Link with libchefs.a.
+//
+//   chefs_session* s = chefs_session_new(NULL);
+//   int status = chefs_exec(s, "for f in main.c util.c; do wc -l $f; done", out_fd, err_fd);
+//   chefs_session_free(s);
+//
+// Shell variables, functions, the working directory and history belong to the
+// process, so there is one session per process and it is not thread-safe.
+// Calls given a NULL or freed session do nothing: chefs_exec and
+// chefs_run_script return 1, the others 0, NULL or CHEFS_CMD_UNKNOWN.
+// Everything else in libchefs is internal (static); only the chefs_ names
+// below are exported.
+// Commands run as they would in chefs_shell: `exit` ends the process, and
+// external commands are forked.
+
+#include <stddef.h>
+
+typedef struct chefs_session chefs_session;
+
+// chefs_exec's result for a line that needs more input (an open quote, `if`
+// without `fi`, ...); nothing was run, so call again with the rest appended
+#define CHEFS_INCOMPLETE -1
+
+// Open the session; name is $0 (NULL for "chefs_shell"). Returns NULL if a
+// session is already open.
+chefs_session* chefs_session_new(const char* name);
+void chefs_session_free(chefs_session* s);
+
+// Parse and run one command line with its stdout on out_fd and its stderr on
+// err_fd. Returns the exit status ($?), 2 for a syntax error, or CHEFS_INCOMPLETE.
+int chefs_exec(chefs_session* s, const char* line, int out_fd, int err_fd);
+
+// Whether line needs more lines to be a whole command (open quote, if without
+// fi, ...). It is parsed quietly and not run; a syntax error is not incomplete.
+int chefs_incomplete(chefs_session* s, const char* line);
+
+// Run a script file with the given positional parameters; returns its status
+int chefs_run_script(chefs_session* s, const char* path, char* args[], int nargs);
+
+// Set $? (e.g. after input the caller rejected itself)
+void chefs_set_status(chefs_session* s, int status);
+
+// Name of builtin i, in sorted order, or NULL past the last one
+const char* chefs_builtin_name(size_t i);
+
+// Command lookup while a line is typed. chefs_prefetch_command starts
+// resolving name through $PATH on a background thread and returns at once;
+// the command then runs without searching PATH again. chefs_command_kind
+// never blocks: it reports what is known so far, e.g. for highlighting.
+enum { CHEFS_CMD_UNKNOWN, CHEFS_CMD_BUILTIN, CHEFS_CMD_FUNCTION, CHEFS_CMD_EXTERNAL, CHEFS_CMD_MISSING };
+void chefs_prefetch_command(chefs_session* s, const char* name);
+int chefs_command_kind(chefs_session* s, const char* name);
+
+// Executables on $PATH whose names start with prefix, in sorted order and
+// each once: calls fn (if not NULL) for each and returns how many there are.
+// The index behind it is a file in the cache directory shared by all shells.
+size_t chefs_path_commands(chefs_session* s, const char* prefix, void (*fn)(const char* name, void* arg), void* arg);
+
+// History. Entries are added with chefs_history_add, which applies $HISTSIZE
+// and $HISTCONTROL; index 0 is the oldest. The file is read on the first
+// chefs_history_load (or `history` builtin), which returns 1 if it loaded it
+// just now. chefs_history_save (and `exit`) appends the entries added since to
+// the file and adds the ones other sessions appended meanwhile, so sessions
+// sharing a file may call it after every command.
+void chefs_history_file(chefs_session* s, const char* path);
+int chefs_history_load(chefs_session* s);
+void chefs_history_save(chefs_session* s);
+void chefs_history_add(chefs_session* s, const char* line);
+size_t chefs_history_count(chefs_session* s);
+const char* chefs_history_get(chefs_session* s, size_t i);
+
+// listener is called after every entry added at the end (line set) and every
+// entry removed (line NULL), so a line editor can mirror the list
+void chefs_history_listen(chefs_session* s, void (*listener)(size_t index, const char* line));
+
+// Memory the caller holds for the shell (completion caches, a line editor's
+// history, ...), listed by the memstat builtin under name next to the
+// library's own. bytes is called each time memstat runs; up to 8 sources.
+void chefs_memory_source(chefs_session* s, const char* name, size_t (*bytes)(void));
+
+#endif
@@ -0,0 +1,667 @@
+// ChefsShell's native line editor. The terminal is in raw mode only while a
+// line is being read. Output for one keystroke is collected and sent in one
+// write, and only the cells that changed are redrawn: the editor remembers
+// what the terminal shows, diffs the new line against it, and inserts or
+// deletes cells in place (ICH/DCH) when that is shorter than rewriting the
+// rest of the line.
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#include "lineedit.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include <wchar.h>
+
+// Completions beyond this many are only listed after a y at the prompt
+#define LIST_QUERY_ITEMS 100
+
+// Readline's word breaks, so both editors complete the same words
+#define WORD_BREAKS " \t\n\"\\'`@$><=;|&{("
+#define FILENAME_QUOTE_CHARS " \t\n\\\"'<>;|&()$`*?[#"
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+} edit_buf;
+
+typedef struct {
+  const line_editor* ed;
+  edit_buf line;
+  size_t pos;         // cursor, as a byte offset into line
+  edit_buf shown;     // prompt and line as the terminal shows them
+  size_t prompt_len;
+  size_t cursor;      // the terminal's cursor, in cells from the start of the prompt
+  size_t prompt_width;
+  size_t cols;
+  edit_buf out;       // pending output
+  size_t history_index;
+  int history_moved;  // history_index is valid
+  char* scratch;      // the new line, while a history entry is shown
+  int last_was_tab;   // the previous key was a Tab that changed nothing
+} edit_state;
+
+void eb_put(edit_buf* b, const char* s, size_t n) {
+  if (b->len + n + 1 > b->cap) {
+    b->cap = (b->len + n + 1) * 2;
+    b->data = realloc(b->data, b->cap);
+    if (!b->data) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+}
+
+void eb_puts(edit_buf* b, const char* s) { eb_put(b, s, strlen(s)); }
+
+void eb_set(edit_buf* b, const char* s, size_t n) {
+  b->len = 0;
+  eb_put(b, s, n);
+}
+
+// fmt takes one size_t; the text is cut at sizeof(text) - 1 bytes, which
+// every escape sequence and prompt here fits in
+void eb_printf(edit_buf* b, const char* fmt, size_t n) {
+  char text[96];
+  int len = snprintf(text, sizeof(text), fmt, n);
+  if (len < 0) return;
+  eb_put(b, text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+}
+
+void flush_output(edit_state* st) {
+  size_t done = 0;
+  while (done < st->out.len) {
+    ssize_t n = write(STDOUT_FILENO, st->out.data + done, st->out.len - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    done += n;
+  }
+  st->out.len = 0;
+}
+
+// UTF-8: the length of the character at s (1 for a stray byte) and its cells
+size_t char_len(const char* s, size_t avail) {
+  unsigned char c = (unsigned char)s[0];
+  size_t n = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+  if (n > avail) return 1;
+  for (size_t i = 1; i < n; i++) {
+    if (((unsigned char)s[i] & 0xc0) != 0x80) return 1;
+  }
+  return n;
+}
+
+size_t char_width(const char* s, size_t n) {
+  unsigned char c = (unsigned char)s[0];
+  if (n == 1) return c < 0x20 || c == 0x7f ? 0 : 1;
+  wchar_t wc = c & (0x7f >> n);
+  for (size_t i = 1; i < n; i++) wc = (wc << 6) | (s[i] & 0x3f);
+  int w = wcwidth(wc);
+  return w < 0 ? 1 : (size_t)w;
+}
+
+size_t text_width(const char* s, size_t len) {
+  size_t w = 0;
+  for (size_t i = 0; i < len;) {
+    size_t n = char_len(s + i, len - i);
+    w += char_width(s + i, n);
+    i += n;
+  }
+  return w;
+}
+
+// The start of the character before i, and the end of the one at i
+size_t prev_char(const char* s, size_t i) {
+  if (i == 0) return 0;
+  i--;
+  while (i > 0 && ((unsigned char)s[i] & 0xc0) == 0x80) i--;
+  return i;
+}
+
+size_t next_char(const char* s, size_t len, size_t i) { return i < len ? i + char_len(s + i, len - i) : len; }
+
+// The bytes of shown covering cells [from, to), or NULL if they do not start
+// and end on character boundaries
+const char* shown_cells(edit_state* st, size_t from, size_t to, size_t* len) {
+  size_t at = 0, i = 0;
+  while (i < st->shown.len && at < from) {
+    size_t n = char_len(st->shown.data + i, st->shown.len - i);
+    at += char_width(st->shown.data + i, n);
+    i += n;
+  }
+  size_t j = i;
+  size_t end = at;
+  while (j < st->shown.len && end < to) {
+    size_t n = char_len(st->shown.data + j, st->shown.len - j);
+    end += char_width(st->shown.data + j, n);
+    j += n;
+  }
+  if (at != from || end != to) return NULL;
+  *len = j - i;
+  return st->shown.data + i;
+}
+
+// Move the terminal's cursor to cell with the fewest bytes: a relative move,
+// backspaces, or rewriting characters already on the screen (from the cursor,
+// or from the start of the row after a CR)
+void move_cursor(edit_state* st, size_t cell) {
+  size_t cols = st->cols;
+  size_t from_row = st->cursor / cols, to_row = cell / cols;
+  size_t from_col = st->cursor % cols, to_col = cell % cols;
+  if (to_row < from_row) eb_printf(&st->out, "\033[%zuA", from_row - to_row);
+  if (to_row > from_row) eb_printf(&st->out, "\033[%zuB", to_row - from_row);
+  st->cursor = cell;
+  if (to_col == from_col) return;
+
+  size_t row_start = to_row * cols, over_len = 0, line_len = 0;
+  size_t dist = to_col > from_col ? to_col - from_col : from_col - to_col;
+  char seq[32];
+  size_t best = snprintf(seq, sizeof(seq), to_col > from_col ? "\033[%zuC" : "\033[%zuD", dist);
+  const char* over = to_col > from_col ? shown_cells(st, row_start + from_col, cell, &over_len) : NULL;
+  const char* line = shown_cells(st, row_start, cell, &line_len);
+
+  if (to_col < from_col && dist <= best && (!line || dist <= line_len + 1)) {
+    for (size_t i = 0; i < dist; i++) eb_put(&st->out, "\b", 1);
+  } else if (over && over_len <= best && (!line || over_len <= line_len + 1)) {
+    eb_put(&st->out, over, over_len);
+  } else if (line && line_len + 1 < best) {
+    eb_put(&st->out, "\r", 1);
+    eb_put(&st->out, line, line_len);
+  } else {
+    eb_put(&st->out, seq, best);
+  }
+}
+
+// After writing up to cell: a cursor left in the last column waits to wrap, so
+// put it on the next row, where the next cell is
+void settle_wrap(edit_state* st, size_t cell) {
+  st->cursor = cell;
+  if (cell > 0 && cell % st->cols == 0) {
+    eb_puts(&st->out, "\n");
+  }
+}
+
+void update_width(edit_state* st) {
+  struct winsize ws;
+  st->cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+}
+
+// Bring the terminal from shown to line, then place the cursor
+void refresh(edit_state* st) {
+  update_width(st);
+  const char* old = st->shown.data + st->prompt_len;
+  const char* now = st->line.data;
+  size_t old_len = st->shown.len - st->prompt_len, new_len = st->line.len;
+
+  // First differing character
+  size_t d = 0;
+  while (d < old_len && d < new_len && old[d] == now[d]) d++;
+  while (d > 0 && d < new_len && ((unsigned char)now[d] & 0xc0) == 0x80) d--;
+  while (d > 0 && d < old_len && ((unsigned char)old[d] & 0xc0) == 0x80) d--;
+
+  if (d < old_len || d < new_len) {
+    size_t start_cell = st->prompt_width + text_width(now, d);
+    size_t old_width = text_width(old, old_len), new_width = text_width(now, new_len);
+
+    // Common tail after d, starting on a character boundary in both
+    size_t tail = 0;
+    while (tail < old_len - d && tail < new_len - d && old[old_len - 1 - tail] == now[new_len - 1 - tail]) tail++;
+    while (tail > 0 && (((unsigned char)now[new_len - tail] & 0xc0) == 0x80 ||
+                        ((unsigned char)old[old_len - tail] & 0xc0) == 0x80)) {
+      tail--;
+    }
+    size_t old_mid = text_width(old + d, old_len - tail - d);
+    size_t new_mid = text_width(now + d, new_len - tail - d);
+    // Rewriting leaves the cursor at the end, to be brought back to pos
+    size_t back = new_width - text_width(now, st->pos);
+    size_t rewrite_cost = new_len - d + (new_width < old_width ? 3 : 0) + (back < 4 ? back : 4);
+    size_t shift_cost = (new_len - tail - d) + 4;
+
+    // Within one row, shift the tail with ICH/DCH instead of rewriting it
+    if (tail > 0 && st->prompt_width + (old_width > new_width ? old_width : new_width) < st->cols &&
+        shift_cost < rewrite_cost) {
+      move_cursor(st, start_cell);
+      if (new_mid > old_mid) eb_printf(&st->out, "\033[%zu@", new_mid - old_mid);
+      if (new_mid < old_mid) eb_printf(&st->out, "\033[%zuP", old_mid - new_mid);
+      eb_put(&st->out, now + d, new_len - tail - d);
+      st->cursor = start_cell + new_mid;
+    } else {
+      move_cursor(st, start_cell);
+      if (new_len > d) {
+        eb_put(&st->out, now + d, new_len - d);
+        settle_wrap(st, st->prompt_width + new_width);
+      }
+      if (new_width < old_width) eb_puts(&st->out, "\033[J");
+    }
+    st->shown.len = st->prompt_len;
+    eb_put(&st->shown, now, new_len);
+  }
+  move_cursor(st, st->prompt_width + text_width(now, st->pos));
+}
+
+// Start over below whatever was printed: prompt and line drawn from scratch
+void redraw_all(edit_state* st, const char* prompt) {
+  eb_puts(&st->out, prompt);
+  st->cursor = st->prompt_width;
+  st->shown.len = st->prompt_len;
+  refresh(st);
+}
+
+void insert_text(edit_state* st, const char* s, size_t n) {
+  edit_buf* b = &st->line;
+  eb_put(b, s, n);  // grow; the bytes are moved into place below
+  memmove(b->data + st->pos + n, b->data + st->pos, b->len - n - st->pos);
+  memcpy(b->data + st->pos, s, n);
+  st->pos += n;
+}
+
+void delete_range(edit_state* st, size_t from, size_t to) {
+  edit_buf* b = &st->line;
+  memmove(b->data + from, b->data + to, b->len - to + 1);
+  b->len -= to - from;
+  if (st->pos > to) st->pos -= to - from;
+  else if (st->pos > from) st->pos = from;
+}
+
+void set_line(edit_state* st, const char* s) {
+  eb_set(&st->line, s, strlen(s));
+  st->pos = st->line.len;
+}
+
+void history_move(edit_state* st, int up) {
+  const line_editor* ed = st->ed;
+  if (!ed->history_count || !ed->history_get) return;
+  if (ed->history_load) ed->history_load();
+  size_t count = ed->history_count();
+  if (!st->history_moved) {
+    st->history_index = count;
+    st->history_moved = 1;
+  }
+  if (st->history_index > count) st->history_index = count;
+  if (up) {
+    if (st->history_index == 0) return;
+    if (st->history_index == count) {
+      free(st->scratch);
+      st->scratch = strdup(st->line.data ? st->line.data : "");
+    }
+    st->history_index--;
+  } else {
+    if (st->history_index >= count) return;
+    st->history_index++;
+  }
+  const char* entry = st->history_index == count ? st->scratch : ed->history_get(st->history_index);
+  set_line(st, entry ? entry : "");
+}
+
+size_t word_start(const char* s, size_t pos) {
+  while (pos > 0 && (s[pos - 1] == ' ' || s[pos - 1] == '\t')) pos--;
+  while (pos > 0 && s[pos - 1] != ' ' && s[pos - 1] != '\t') pos--;
+  return pos;
+}
+
+size_t word_end(const char* s, size_t len, size_t pos) {
+  while (pos < len && (s[pos] == ' ' || s[pos] == '\t')) pos++;
+  while (pos < len && s[pos] != ' ' && s[pos] != '\t') pos++;
+  return pos;
+}
+
+// A path match with a leading ~ or ~user, for the directory check
+int is_directory(const char* match) {
+  char path[4096];
+  const char* rest = match;
+  path[0] = '\0';
+  if (match[0] == '~') {
+    const char* slash = strchrnul(match, '/');
+    const char* home = NULL;
+    if (slash == match + 1) {
+      home = getenv("HOME");
+    } else {
+      char user[256];
+      snprintf(user, sizeof(user), "%.*s", (int)(slash - match - 1), match + 1);
+      struct passwd* pw = getpwnam(user);
+      if (pw) home = pw->pw_dir;
+    }
+    if (home) {
+      snprintf(path, sizeof(path), "%s", home);
+      rest = slash;
+    }
+  }
+  size_t used = strlen(path);
+  snprintf(path + used, sizeof(path) - used, "%s", rest);
+  struct stat sb;
+  return stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+}
+
+// The word as it goes on the line: special characters escaped, unless it is
+// inside quotes
+void put_completion(edit_buf* b, const char* s, int quote) {
+  for (; *s; s++) {
+    if (quote && strchr(FILENAME_QUOTE_CHARS, *s)) eb_put(b, "\\", 1);
+    eb_put(b, s, 1);
+  }
+}
+
+void list_matches(edit_state* st, char** matches, const char* prompt) {
+  size_t n = 0, widest = 0;
+  for (char** m = matches + 1; *m; m++, n++) {
+    size_t w = text_width(*m, strlen(*m));
+    if (w > widest) widest = w;
+  }
+
+  move_cursor(st, st->prompt_width + text_width(st->line.data, st->line.len));
+  eb_puts(&st->out, "\n");
+  if (n > LIST_QUERY_ITEMS) {
+    eb_printf(&st->out, "Display all %zu possibilities? (y or n)", n);
+    flush_output(st);
+    char c = 0;
+    while (read(STDIN_FILENO, &c, 1) < 0 && errno == EINTR) {
+    }
+    eb_puts(&st->out, "\n");
+    if (c != 'y' && c != 'Y' && c != ' ') {
+      redraw_all(st, prompt);
+      return;
+    }
+  }
+
+  size_t col_width = widest + 2, per_row = st->cols / col_width;
+  if (per_row == 0) per_row = 1;
+  size_t rows = (n + per_row - 1) / per_row;
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < per_row; c++) {
+      size_t i = c * rows + r;  // down the columns, like readline
+      if (i >= n) break;
+      eb_puts(&st->out, matches[i + 1]);
+      if ((c + 1) * rows + r < n) {
+        for (size_t w = text_width(matches[i + 1], strlen(matches[i + 1])); w < col_width; w++) eb_put(&st->out, " ", 1);
+      }
+    }
+    eb_puts(&st->out, "\n");
+  }
+  redraw_all(st, prompt);
+}
+
+// Returns whether the line changed
+int complete(edit_state* st, const char* prompt) {
+  if (!st->ed->complete) return 0;
+  const char* line = st->line.data ? st->line.data : "";
+
+  // The word before the cursor; a break character after a backslash is part of it
+  size_t start = st->pos;
+  while (start > 0 && (!strchr(WORD_BREAKS, line[start - 1]) || (start > 1 && line[start - 2] == '\\'))) start--;
+  char quote = 0;
+  for (size_t i = 0; i < start; i++) {
+    if (line[i] == '\\' && !quote && i + 1 < start) i++;
+    else if ((line[i] == '\'' || line[i] == '"') && (!quote || quote == line[i])) quote = quote ? 0 : line[i];
+  }
+
+  // What the completer sees: the word without its escapes
+  edit_buf text = {0};
+  eb_put(&text, "", 0);
+  for (size_t i = start; i < st->pos; i++) {
+    if (line[i] == '\\' && i + 1 < st->pos) i++;
+    eb_put(&text, line + i, 1);
+  }
+
+  int filenames = 0;
+  char** matches = st->ed->complete(text.data, line, (int)start, &filenames);
+  free(text.data);
+  if (!matches) {
+    eb_puts(&st->out, "\a");
+    return 0;
+  }
+
+  edit_buf word = {0};
+  eb_put(&word, "", 0);
+  int single = matches[1] == NULL;
+  put_completion(&word, matches[0], filenames && !quote);
+  if (single) {
+    size_t len = strlen(matches[0]);
+    int dir = filenames && (len > 0 && matches[0][len - 1] == '/' ? 1 : is_directory(matches[0]));
+    if (dir && matches[0][len - 1] != '/') eb_put(&word, "/", 1);
+    if (!dir) {
+      if (quote) eb_put(&word, &quote, 1);
+      eb_put(&word, " ", 1);
+    }
+  }
+
+  int grew = word.len != st->pos - start || memcmp(word.data, line + start, word.len) != 0;
+  if (grew) {
+    delete_range(st, start, st->pos);
+    insert_text(st, word.data, word.len);
+  }
+  if (!single && !grew) {
+    if (st->last_was_tab) {
+      list_matches(st, matches, prompt);
+    } else {
+      eb_puts(&st->out, "\a");
+    }
+  }
+  free(word.data);
+  for (char** m = matches; *m; m++) free(*m);
+  free(matches);
+  return grew;
+}
+
+// One key: a byte, or an escape sequence read whole. Returns the sequence's
+// final byte with the bytes in between in seq, -1 at end of input.
+int read_key(char* seq, size_t size) {
+  unsigned char c;
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+  }
+  if (n <= 0) return -1;
+  seq[0] = '\0';
+  if (c != 0x1b) return c;
+
+  // ESC alone (a lone Escape key) if nothing follows within 50ms
+  size_t len = 0;
+  struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+  while (len + 1 < size && poll(&p, 1, 50) > 0) {
+    if (read(STDIN_FILENO, &c, 1) != 1) break;
+    seq[len++] = c;
+    seq[len] = '\0';
+    if (len == 1 && c != '[' && c != 'O') break;  // ESC x: Meta-x
+    if (len > 1 && c >= 0x40 && c <= 0x7e) break;
+  }
+  return 0x1b;
+}
+
+int input_pending(void) {
+  struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+  return poll(&p, 1, 0) > 0;
+}
+
+// Without a terminal: echo the prompt and the line like readline does, reading
+// byte by byte so nothing meant for a later command is consumed
+char* read_plain(const char* prompt) {
+  edit_buf b = {0};
+  if (write(STDOUT_FILENO, prompt, strlen(prompt)) < 0) return NULL;
+  char c;
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, &c, 1)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (c == '\n') break;
+    eb_put(&b, &c, 1);
+  }
+  if (n == 0 && b.len == 0) {
+    free(b.data);
+    return NULL;
+  }
+  eb_put(&b, "\n", 1);
+  if (write(STDOUT_FILENO, b.data, b.len) < 0) {
+  }
+  b.data[--b.len] = '\0';
+  return b.data;
+}
+
+char* line_edit(const line_editor* ed, const char* prompt) {
+  if (!isatty(STDIN_FILENO)) return read_plain(prompt);
+
+  struct termios cooked, raw;
+  if (tcgetattr(STDIN_FILENO, &cooked) < 0) return read_plain(prompt);
+  raw = cooked;
+  raw.c_iflag &= ~(ICRNL | INLCR | IGNCR | IXON | ISTRIP);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  edit_state st;
+  memset(&st, 0, sizeof(st));
+  st.ed = ed;
+  eb_set(&st.line, "", 0);
+  st.prompt_len = strlen(prompt);
+  eb_set(&st.shown, prompt, st.prompt_len);
+  st.prompt_width = text_width(prompt, st.prompt_len);
+  update_width(&st);
+  eb_puts(&st.out, prompt);
+  st.cursor = st.prompt_width;
+  flush_output(&st);
+
+  // Load history once the user pauses, as readline's idle hook does
+  static int idle_loaded = 0;
+  if (!idle_loaded && ed->history_load) {
+    struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&p, 1, 100) == 0) {
+      ed->history_load();
+      idle_loaded = 1;
+    }
+  }
+
+  char* result = NULL;
+  int done = 0;
+  while (!done) {
+    // Typed-ahead and pasted keys are drawn together
+    if (!input_pending()) {
+      refresh(&st);
+      flush_output(&st);
+    }
+    char seq[16];
+    int key = read_key(seq, sizeof(seq));
+    int tab = 0;
+    size_t before = st.line.len;
+    switch (key) {
+      case -1:
+      case 4:  // Ctrl-D: end of input on an empty line, else delete
+        if (key == -1 || st.line.len == 0) {
+          done = 1;
+          break;
+        }
+        delete_range(&st, st.pos, next_char(st.line.data, st.line.len, st.pos));
+        break;
+      case '\r':
+      case '\n':
+        result = strdup(st.line.data);
+        done = 1;
+        break;
+      case 3:  // Ctrl-C: drop the line
+        st.pos = st.line.len;
+        refresh(&st);
+        eb_puts(&st.out, "^C\n");
+        set_line(&st, "");
+        st.history_moved = 0;
+        redraw_all(&st, prompt);
+        break;
+      case '\t':
+        // A second Tab lists the matches, unless the first one completed something
+        tab = !complete(&st, prompt);
+        break;
+      case 127:
+      case 8:  // Backspace
+        delete_range(&st, prev_char(st.line.data, st.pos), st.pos);
+        break;
+      case 1:  // Ctrl-A
+        st.pos = 0;
+        break;
+      case 5:  // Ctrl-E
+        st.pos = st.line.len;
+        break;
+      case 2:  // Ctrl-B
+        st.pos = prev_char(st.line.data, st.pos);
+        break;
+      case 6:  // Ctrl-F
+        st.pos = next_char(st.line.data, st.line.len, st.pos);
+        break;
+      case 11:  // Ctrl-K
+        delete_range(&st, st.pos, st.line.len);
+        break;
+      case 21:  // Ctrl-U
+        delete_range(&st, 0, st.pos);
+        break;
+      case 23:  // Ctrl-W
+        delete_range(&st, word_start(st.line.data, st.pos), st.pos);
+        break;
+      case 12:  // Ctrl-L
+        eb_puts(&st.out, "\033[H\033[2J");
+        redraw_all(&st, prompt);
+        break;
+      case 16:  // Ctrl-P
+        history_move(&st, 1);
+        break;
+      case 14:  // Ctrl-N
+        history_move(&st, 0);
+        break;
+      case 0x1b:
+        if (strcmp(seq, "[A") == 0 || strcmp(seq, "OA") == 0) {
+          history_move(&st, 1);
+        } else if (strcmp(seq, "[B") == 0 || strcmp(seq, "OB") == 0) {
+          history_move(&st, 0);
+        } else if (strcmp(seq, "[C") == 0 || strcmp(seq, "OC") == 0) {
+          st.pos = next_char(st.line.data, st.line.len, st.pos);
+        } else if (strcmp(seq, "[D") == 0 || strcmp(seq, "OD") == 0) {
+          st.pos = prev_char(st.line.data, st.pos);
+        } else if (strcmp(seq, "[H") == 0 || strcmp(seq, "OH") == 0 || strcmp(seq, "[1~") == 0 ||
+                   strcmp(seq, "[7~") == 0) {
+          st.pos = 0;
+        } else if (strcmp(seq, "[F") == 0 || strcmp(seq, "OF") == 0 || strcmp(seq, "[4~") == 0 ||
+                   strcmp(seq, "[8~") == 0) {
+          st.pos = st.line.len;
+        } else if (strcmp(seq, "[3~") == 0) {
+          delete_range(&st, st.pos, next_char(st.line.data, st.line.len, st.pos));
+        } else if (strcmp(seq, "b") == 0 || strcmp(seq, "[1;5D") == 0) {
+          st.pos = word_start(st.line.data, st.pos);
+        } else if (strcmp(seq, "f") == 0 || strcmp(seq, "[1;5C") == 0) {
+          st.pos = word_end(st.line.data, st.line.len, st.pos);
+        } else if (strcmp(seq, "\x7f") == 0) {
+          delete_range(&st, word_start(st.line.data, st.pos), st.pos);
+        }
+        break;
+      default:
+        if (key >= 0x20) {
+          char c = (char)key;
+          insert_text(&st, &c, 1);
+        }
+        break;
+    }
+    st.last_was_tab = tab;
+    if (st.line.len != before && ed->changed && !input_pending()) ed->changed(st.line.data);
+  }
+
+  // The caller prints the newline after end of input, as with readline
+  st.pos = st.line.len;
+  refresh(&st);
+  if (result) eb_puts(&st.out, "\n");
+  flush_output(&st);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+
+  free(st.line.data);
+  free(st.shown.data);
+  free(st.out.data);
+  free(st.scratch);
+  return result;
+}
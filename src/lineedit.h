@@ -0,0 +1,29 @@
+// ChefsShell's native line editor: a small replacement for readline that
+// redraws only the cells that changed. Used by main.c when CHEFS_EDITOR=native
+// or when the shell is built without readline.
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+#include <stddef.h>
+
+// Completion for text, the word before the cursor (unquoted), which starts at
+// line[start]. Same contract as the readline completion hook: returns the
+// matches in readline's layout (matches[0] replaces the word, matches[1..] are
+// the candidates, NULL-terminated; a single match has only matches[0]), or
+// NULL. *filenames is set when the matches are paths, which get quoted and a
+// '/' after directories.
+typedef char** (*line_completer)(const char* text, const char* line, int start, int* filenames);
+
+typedef struct {
+  line_completer complete;
+  // History, oldest first; count is called again after load
+  size_t (*history_count)(void);
+  const char* (*history_get)(size_t i);
+  void (*history_load)(void);  // before the first history key, and once when idle
+  void (*changed)(const char* line);  // after each edit, e.g. to prefetch the command
+} line_editor;
+
+// Read one line with prompt; NULL at end of input. The caller frees the line.
+char* line_edit(const line_editor* ed, const char* prompt);
+
+#endif
@@ -1,89 +1,85 @@
+// ChefsShell's interactive front end: the line editor (readline, or the
+// native one in lineedit.c), tab completion and the prompt loop. Parsing and
+// running commands is libchefs (chefs.c, chefs.h).
 #define _XOPEN_SOURCE 700
 #define _GNU_SOURCE
 #include <dirent.h>
-#include <fcntl.h>
 #include <limits.h>
+#include <locale.h>
+#include <malloc.h>
+#include <pwd.h>
+#ifndef CHEFS_NO_READLINE
 #include <readline/history.h>
 #include <readline/readline.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-// builtin commands
-const char* builtins[] = {"cd", "echo", "exit", "github", "help", "history", "linkedin", "fetchme", "pwd", "resume", "youtube", NULL};
+#include "chefs.h"
+#include "lineedit.h"
 
-char* combined_generator(const char* text, int state) {
-  static int stage;        // 0 = builtins, 1 = externals
-  static int builtin_idx;  // builtin index
+chefs_session* session;
 
-  static char* path_copy = NULL;
-  static char* current_dir = NULL;
-
-  static DIR* d = NULL;
-  static struct dirent* entry = NULL;
-
-  static char* saved_dir = NULL;
-
-  if (state == 0) {
-    stage = 0;
-    builtin_idx = 0;
-
-    if (path_copy) free(path_copy);
-
-    char* envpath = getenv("PATH");
-    path_copy = strdup(envpath ? envpath : "");
-
-    current_dir = strtok(path_copy, ":");
+void collect_command(const char* name, void* arg) {
+  char*** next = arg;
+  *(*next)++ = strdup(name);
+}
 
-    if (d) {
-      closedir(d);
-      d = NULL;
-    }
+int compare_matches(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
 
-    saved_dir = NULL;
+// matches[1..n] (sorted, n > 0) in readline's format: [0] is what replaces the
+// word, the common prefix of all of them or the one match itself
+char** finish_matches(char** matches, size_t n) {
+  matches[n + 1] = NULL;
+  if (n == 1) {
+    matches[0] = matches[1];
+    matches[1] = NULL;
+    return matches;
   }
+  // Sorted, so the common prefix of all of them is that of the first and last
+  size_t common = 0;
+  while (matches[1][common] && matches[1][common] == matches[n][common]) common++;
+  matches[0] = strndup(matches[1], common);
+  return matches;
+}
 
-  if (stage == 0) {
-    while (builtins[builtin_idx]) {
-      const char* name = builtins[builtin_idx++];
-      if (strncmp(name, text, strlen(text)) == 0) {
-        return strdup(name);
-      }
-    }
-    stage = 1;  // Move to external executables
+// Builtins, and executables from the shared PATH index, starting with text
+char** command_completions(const char* text) {
+  size_t builtins = 0;
+  const char* name;
+  for (size_t i = 0; (name = chefs_builtin_name(i)) != NULL; i++) builtins++;
+  size_t externals = chefs_path_commands(session, text, NULL, NULL);
+
+  char** matches = malloc((builtins + externals + 2) * sizeof(char*));
+  if (!matches) return NULL;
+  char** next = matches + 1;
+  for (size_t i = 0; (name = chefs_builtin_name(i)) != NULL; i++) {
+    if (strncmp(name, text, strlen(text)) == 0) *next++ = strdup(name);
   }
-
-  while (current_dir || d) {
-    if (!d) {
-      saved_dir = current_dir;
-      d = opendir(current_dir);
-      current_dir = strtok(NULL, ":");
-    }
-
-    if (d) {
-      while ((entry = readdir(d)) != NULL) {
-        if (strncmp(entry->d_name, text, strlen(text)) == 0) {
-          char full[PATH_MAX];
-          snprintf(full, sizeof(full), "%s/%s", saved_dir, entry->d_name);
-
-          if (access(full, X_OK) == 0) {
-            return strdup(entry->d_name);
-          }
-        }
-      }
-
-      closedir(d);
-      d = NULL;
-      saved_dir = NULL;
+  chefs_path_commands(session, text, collect_command, &next);
+
+  // A builtin like echo is often also a program
+  size_t n = next - (matches + 1);
+  qsort(matches + 1, n, sizeof(char*), compare_matches);
+  size_t unique = 0;
+  for (size_t i = 1; i <= n; i++) {
+    if (unique > 0 && strcmp(matches[unique], matches[i]) == 0) {
+      free(matches[i]);
+    } else {
+      matches[++unique] = matches[i];
     }
   }
-
-  // No more matches
-  return NULL;
+  if (unique == 0) {
+    free(matches);
+    return NULL;
+  }
+  return finish_matches(matches, unique);
 }
 
 // auto-cpmplete for builtins
@@ -105,52 +101,248 @@ char* builtin_generator(const char* text, int state) {
 }
 */
 
-int is_external_prefix(const char* text) {
-  if (!text || text[0] == '\0') return 0;
-
-  char* path = getenv("PATH");
-  if (!path) return 0;
-
-  char* p = strdup(path);
-  char* dir = strtok(p, ":");
-
-  while (dir) {
-    DIR* d = opendir(dir);
-    if (d) {
-      struct dirent* entry;
-      while ((entry = readdir(d)) != NULL) {
-        // match prefix
-        if (strncmp(entry->d_name, text, strlen(text)) == 0) {
-          // build full path
-          char full[PATH_MAX];
-          snprintf(full, sizeof(full), "%s/%s", dir, entry->d_name);
-
-          // check if executable
-          if (access(full, X_OK) == 0) {
-            closedir(d);
-            free(p);
-            return 1;  // found at least one external match
-          }
-        }
-      }
-      closedir(d);
-    }
-    dir = strtok(NULL, ":");
+// Directory listings for filename completion. A listing is kept sorted, so
+// the names with a given prefix are one binary search away, and it is reused
+// until the directory's inode or mtime changes. Reading a 100k-entry
+// directory once is cheap; re-reading it on every Tab press is what stalls.
+#define DIR_LISTINGS 16
+
+typedef struct {
+  char* path;  // directory as opened (~ expanded); NULL for an unused slot
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int racy;      // changed within a second of being read: mtime may miss a later change
+  char* names;   // every name, NUL-terminated, back to back
+  char** sorted; // pointers into names, in strcmp order
+  size_t count;
+  unsigned long used;  // for least recently used eviction
+} dir_listing;
+
+dir_listing dir_listings[DIR_LISTINGS];
+unsigned long dir_listing_clock;
+
+void free_listing(dir_listing* l) {
+  free(l->path);
+  free(l->names);
+  free(l->sorted);
+  memset(l, 0, sizeof(*l));
+}
+
+// What the listings hold, for memstat
+size_t listing_bytes(void) {
+  size_t total = 0;
+  for (int i = 0; i < DIR_LISTINGS; i++) {
+    dir_listing* l = &dir_listings[i];
+    total += malloc_usable_size(l->path) + malloc_usable_size(l->names) + malloc_usable_size(l->sorted);
   }
+  return total;
+}
 
-  free(p);
-  return 0;
+int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int read_listing(dir_listing* l, const char* path, const struct stat* st) {
+  struct timespec start;
+  clock_gettime(CLOCK_REALTIME, &start);
+  DIR* d = opendir(path);
+  if (!d) return 0;
+
+  size_t len = 0, cap = 4096, count = 0;
+  char* names = malloc(cap);
+  struct dirent* entry;
+  while (names && (entry = readdir(d)) != NULL) {
+    const char* name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    size_t n = strlen(name) + 1;
+    if (len + n > cap) {
+      char* grown = realloc(names, cap * 2);
+      if (!grown) {
+        free(names);
+        names = NULL;
+        break;
+      }
+      names = grown;
+      cap *= 2;
+    }
+    memcpy(names + len, name, n);
+    len += n;
+    count++;
+  }
+  closedir(d);
+
+  char** sorted = names ? malloc((count ? count : 1) * sizeof(char*)) : NULL;
+  if (!sorted) {
+    free(names);
+    return 0;
+  }
+  char* p = names;
+  for (size_t i = 0; i < count; i++) {
+    sorted[i] = p;
+    p += strlen(p) + 1;
+  }
+  qsort(sorted, count, sizeof(char*), compare_names);
+
+  free_listing(l);
+  l->path = strdup(path);
+  l->dev = st->st_dev;
+  l->ino = st->st_ino;
+  l->mtime = st->st_mtim;
+  l->racy = st->st_mtim.tv_sec >= start.tv_sec - 1;
+  l->names = names;
+  l->sorted = sorted;
+  l->count = count;
+  return 1;
 }
 
-int is_builtin_prefix(const char* text) {
-  for (int i = 0; builtins[i] != NULL; i++) {
-    if (strncmp(builtins[i], text, strlen(text)) == 0) {
-      return 1;
+// The listing of path, read again only if the directory changed since
+dir_listing* get_listing(const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+  dir_listing* slot = &dir_listings[0];
+  for (int i = 0; i < DIR_LISTINGS; i++) {
+    dir_listing* l = &dir_listings[i];
+    if (l->path && strcmp(l->path, path) == 0) {
+      slot = l;
+      break;
     }
+    if (l->used < slot->used) slot = l;
   }
-  return 0;
+  int fresh = slot->path && strcmp(slot->path, path) == 0 && !slot->racy &&
+              slot->dev == st.st_dev && slot->ino == st.st_ino &&
+              slot->mtime.tv_sec == st.st_mtim.tv_sec && slot->mtime.tv_nsec == st.st_mtim.tv_nsec;
+  if (!fresh && !read_listing(slot, path, &st)) return NULL;
+  slot->used = ++dir_listing_clock;
+  return slot;
+}
+
+// ~name/ for the users whose names start with prefix (the text after ~)
+char** user_completions(const char* prefix) {
+  size_t n = 0, cap = 16;
+  char** matches = malloc((cap + 2) * sizeof(char*));
+  if (!matches) return NULL;
+  struct passwd* pw;
+  setpwent();
+  while ((pw = getpwent()) != NULL) {
+    if (strncmp(pw->pw_name, prefix, strlen(prefix)) != 0) continue;
+    if (n == cap) {
+      char** grown = realloc(matches, (cap * 2 + 2) * sizeof(char*));
+      if (!grown) break;
+      matches = grown;
+      cap *= 2;
+    }
+    size_t len = strlen(pw->pw_name);
+    char* match = malloc(len + 3);
+    if (!match) break;
+    match[0] = '~';
+    memcpy(match + 1, pw->pw_name, len);
+    strcpy(match + 1 + len, "/");
+    matches[++n] = match;
+  }
+  endpwent();
+  if (n == 0) {
+    free(matches);
+    return NULL;
+  }
+  qsort(matches + 1, n, sizeof(char*), compare_matches);
+  return finish_matches(matches, n);
+}
+
+// Paths starting with text
+char** filename_completions(const char* text) {
+  if (text[0] == '~' && !strchr(text, '/')) return user_completions(text + 1);
+
+  // "dir/" as typed, and the directory it names
+  const char* slash = strrchr(text, '/');
+  size_t typed_len = slash ? (size_t)(slash - text) + 1 : 0;
+  const char* prefix = text + typed_len;
+  char dir[PATH_MAX];
+  if (typed_len == 0) {
+    strcpy(dir, ".");
+  } else if (text[0] == '~') {
+    // ~/ or ~user/, expanded the way the shell expands the word
+    const char* user_end = strchr(text, '/');
+    const char* home = NULL;
+    if (user_end == text + 1) {
+      home = getenv("HOME");
+    } else {
+      char user[256];
+      snprintf(user, sizeof(user), "%.*s", (int)(user_end - text - 1), text + 1);
+      struct passwd* pw = getpwnam(user);
+      if (pw) home = pw->pw_dir;
+    }
+    if (!home) return NULL;
+    snprintf(dir, sizeof(dir), "%s%.*s", home, (int)(typed_len - (user_end - text)), user_end);
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int)typed_len, text);
+  }
+
+  dir_listing* l = get_listing(dir);
+  if (!l) return NULL;
+
+  // Names with the prefix are the run starting at its lower bound
+  size_t prefix_len = strlen(prefix), lo = 0, hi = l->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(l->sorted[mid], prefix) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t end = lo;
+  while (end < l->count && strncmp(l->sorted[end], prefix, prefix_len) == 0) end++;
+
+  char** matches = malloc((end - lo + 2) * sizeof(char*));
+  if (!matches) return NULL;
+  size_t n = 0;
+  for (size_t i = lo; i < end; i++) {
+    const char* name = l->sorted[i];
+    if (name[0] == '.' && prefix[0] != '.') continue;
+    size_t name_len = strlen(name);
+    char* match = malloc(typed_len + name_len + 1);
+    if (!match) break;
+    memcpy(match, text, typed_len);
+    memcpy(match + typed_len, name, name_len + 1);
+    matches[++n] = match;
+  }
+  if (n == 0) {
+    free(matches);
+    return NULL;
+  }
+  return finish_matches(matches, n);
+}
+
+// Whether the word starting at start is in command position: first on the
+// line or after an operator
+int at_command_position(const char* line, int start) {
+  int i = start;
+  while (i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t')) i--;
+  return i == 0 || strchr(";|&(", line[i - 1]) != NULL;
+}
+
+// Completions for text, the word at line[start], for either line editor
+char** complete_word(const char* text, const char* line, int start, int* filenames) {
+  // Arguments, redirect targets and anything with a slash complete as paths
+  *filenames = !at_command_position(line, start) || strchr(text, '/') || text[0] == '~';
+  return *filenames ? filename_completions(text) : command_completions(text);
 }
 
+// Hand the command name to libchefs once it is typed (a blank or operator
+// follows it), so its PATH lookup runs while the arguments are typed. Partial
+// names would only fill the lookup cache; assignments and names with quotes or
+// expansions are left for the executor.
+void prefetch_first_word(const char* line) {
+  static char last[NAME_MAX + 1];
+  const char* p = line + strspn(line, " \t");
+  size_t n = strcspn(p, " \t;|&<>()=$`'\"\\");
+  if (n == 0 || n > NAME_MAX || p[n] == '\0' || !strchr(" \t;|&<>()", p[n])) return;
+  if (strncmp(last, p, n) == 0 && last[n] == '\0') return;
+  memcpy(last, p, n);
+  last[n] = '\0';
+  chefs_prefetch_command(session, last);
+}
+
+#ifndef CHEFS_NO_READLINE
 // display function for multiple matches
 void display_matches_hook(char** matches, int num_matches, int max_length) {
   (void)max_length;  // Unused parameter
@@ -166,1189 +358,285 @@ void display_matches_hook(char** matches, int num_matches, int max_length) {
 }
 
 char** completion_hook(const char* text, int start, int end) {
-  (void)start;  // Unused parameter
-  (void)end;    // Unused parameter
-  if (!is_builtin_prefix(text) && !is_external_prefix(text)) {
+  (void)end;  // Unused parameter
+  // Never fall back to readline's own filename completion, which rereads the directory
+  rl_attempted_completion_over = 1;
+  rl_sort_completion_matches = 0;  // already sorted
+
+  int filenames;
+  char** matches = complete_word(text, rl_line_buffer, start, &filenames);
+  rl_filename_completion_desired = filenames;
+  if (!matches && !filenames) {
     // Bell character
     printf("\a");
     fflush(stdout);
-
-    return NULL;  // No autocomplete
   }
-
-  char** matches = rl_completion_matches(text, combined_generator);
-
-  // If there's only one match, add a space after it
-  if (matches && matches[1] != NULL && matches[2] == NULL) {
-    rl_insert_text(" ");
+  // A single ~/ or ~user/ is a directory already marked
+  if (matches && matches[1] == NULL && matches[0][0] && matches[0][strlen(matches[0]) - 1] == '/') {
+    rl_completion_append_character = '\0';
   }
-
   return matches;
 }
 
-// Making a self tokeniser of ' ' adn " " and backslash escapes
-void tokenize(char* line, char* args[], int* argc_out) {
-  int i = 0;
-  int len = strlen(line);
-  int in_quotes = 0;
-  int in_double_quotes = 0;
-  int escape = 0;
-  char current[200] = {0};
-  int cur = 0;
-
-  for (int j = 0; j < len; j++) {
-    char c = line[j];
-
-    if (!in_quotes && !in_double_quotes && c == '\\') {
-      escape = 1;
-      continue;
-    }
-
-    if (in_quotes) {
-      if (c == '\'') {
-        in_quotes = 0;
-      } else {
-        current[cur++] = c;
-      }
-      continue;
-    }
-
-    if (in_double_quotes) {
-      if (escape) {
-        if (c == '\"' || c == '\\') {
-          current[cur++] = c;
-        } else {
-          current[cur++] = '\\';
-          current[cur++] = c;
-        }
-        escape = 0;
-        continue;
-      }
-
-      if (c == '\\') {
-        escape = 1;
-        continue;
-      }
-
-      if (c == '\"') {
-        in_double_quotes = 0;
-      } else {
-        current[cur++] = c;
-      }
-      continue;
-    }
-
-    if (escape) {
-      current[cur++] = c;
-      escape = 0;
-      continue;
-    }
-
-    // not in quotes
-    if (c == '\'') {
-      in_quotes = 1;
-      continue;
-    }
-
-    if (c == '\"') {
-      in_double_quotes = 1;
-      continue;
-    }
-
-    if (c == ' ' || c == '\t') {
-      if (cur > 0) {
-        current[cur] = '\0';
-        args[i] = strdup(current);
-        i++;
-        cur = 0;
-        current[0] = '\0';
-      }
-      continue;
-    }
+void prefetch_redisplay(void) {
+  prefetch_first_word(rl_line_buffer);
+  rl_redisplay();
+}
 
-    current[cur++] = c;
+// readline's own list, used by Up/Down and Ctrl-R, mirrors the shell's history
+void mirror_history(size_t index, const char* line) {
+  if (line) {
+    add_history(line);
+    return;
   }
+  HIST_ENTRY* entry = remove_history((int)index);
+  if (entry) free_history_entry(entry);
+}
 
-  if (cur > 0) {
-    current[cur] = '\0';
-    args[i] = strdup(current);
-    i++;
+// readline's copy of the history, for memstat
+size_t readline_history_bytes(void) {
+  HIST_ENTRY** list = history_list();
+  size_t total = malloc_usable_size(list);
+  for (size_t i = 0; list && list[i]; i++) {
+    total += malloc_usable_size(list[i]) + malloc_usable_size(list[i]->line) + malloc_usable_size(list[i]->timestamp);
   }
+  return total;
+}
 
-  args[i] = NULL;
-  *argc_out = i;
+// readline fixed its history position when the prompt came up; if the file was
+// loaded just now, move it past the new entries
+void load_history(void) {
+  if (chefs_history_load(session)) using_history();
 }
 
-void save_history_to_file(const char* filepath) {
-  if (filepath == NULL) return;
-  
-  FILE* fp = fopen(filepath, "w");
-  if (!fp) return;
-   
-  int len = history_length;
-  for (int i = 0; i < len; i++) {
-    HIST_ENTRY* entry = history_get(i + 1);
-    if (entry) {
-      fprintf(fp, "%s\n", entry->line);
-    }
-  }
-  
-  fclose(fp);
+// Called by readline roughly every 100ms while it waits for a key
+int history_idle_hook(void) {
+  load_history();
+  rl_event_hook = NULL;
+  return 0;
 }
 
-int is_builtin(const char* cmd) {
-  return (strcmp(cmd, "echo") == 0 || 
-          strcmp(cmd, "type") == 0 || 
-          strcmp(cmd, "pwd") == 0 ||
-          strcmp(cmd, "cd") == 0 ||
-          strcmp(cmd, "exit") == 0 ||
-          strcmp(cmd, "github") == 0 ||
-          strcmp(cmd, "help") == 0 ||
-          strcmp(cmd, "linkedin") == 0 ||
-          strcmp(cmd, "fetchme") == 0 ||
-          strcmp(cmd, "resume") == 0 ||
-          strcmp(cmd, "youtube") == 0 ||
-          strcmp(cmd, "history") == 0);
+int lazy_previous_history(int count, int key) {
+  load_history();
+  return rl_get_previous_history(count, key);
 }
 
-void execute_builtin_in_child(char* args[]) {
-  char* cmd = args[0];
-  
-  if (strcmp(cmd, "echo") == 0) {
-    // Count args
-    int count = 0;
-    while (args[count] != NULL) count++;
-    
-    for (int i = 1; i < count; i++) {
-      printf("%s", args[i]);
-      if (i < count - 1) printf(" ");
-    }
-    printf("\n");
-  }
-  else if (strcmp(cmd, "type") == 0) {
-    if (args[1] == NULL) {
-      exit(0);
-    }
-    char* target = args[1];
-    
-    if (is_builtin(target)) {
-      printf("%s is a shell builtin\n", target);
-    } else {
-      // Check PATH
-      char* path = getenv("PATH");
-      if (path == NULL) path = "";
-      char path_cpy[1000];
-      strncpy(path_cpy, path, sizeof(path_cpy));
-      path_cpy[sizeof(path_cpy) - 1] = '\0';
-      
-      char* dir = strtok(path_cpy, ":");
-      int found = 0;
-      
-      while (dir != NULL) {
-        char fullpath[1200];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, target);
-        
-        if (access(fullpath, X_OK) == 0) {
-          printf("%s is %s\n", target, fullpath);
-          found = 1;
-          break;
-        }
-        dir = strtok(NULL, ":");
-      }
-      if (!found) {
-        printf("%s: not found\n", target);
-      }
-    }
-  }
-  else if (strcmp(cmd, "pwd") == 0) {
-    char cwd[1000];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-      printf("%s\n", cwd);
-    }
-  }
+int lazy_next_history(int count, int key) {
+  load_history();
+  return rl_get_next_history(count, key);
 }
 
-int main(int argc, char* argv[]) {
-  (void)argc;  // Unused parameter
-  (void)argv;  // Unused parameter
-  // Flush after every printf
-  setbuf(stdout, NULL);
+int lazy_reverse_search_history(int count, int key) {
+  load_history();
+  return rl_reverse_search_history(count, key);
+}
+
+int lazy_forward_search_history(int count, int key) {
+  load_history();
+  return rl_forward_search_history(count, key);
+}
 
+void setup_readline(void) {
   rl_bind_key('\t', rl_complete);
   rl_attempted_completion_function = completion_hook;
+  rl_completer_quote_characters = "'\"";
+  rl_filename_quote_characters = " \t\n\\\"'<>;|&()$`*?[#";
+  rl_redisplay_function = prefetch_redisplay;
   // Skip setting display hook as it causes type compatibility issues
   // rl_completion_display_matches_hook = display_matches_hook;
 
-  int last_appended_index = 0;  // Track last appended history entry
-
-  //Loading history from HISTFILE as real OS shell does, same as history -r done later
-  char* histfile = getenv("HISTFILE");
-  if (histfile != NULL) {
-    FILE* fp = fopen(histfile, "r");
-    if (fp) {
-      char buf[1024];
-      while (fgets(buf, sizeof(buf), fp)) {
-        // Remove newline
-        buf[strcspn(buf, "\n")] = 0;
-        
-        // Skip empty lines
-        if (strlen(buf) == 0) continue;
-        
-        add_history(buf);
-      }
-      fclose(fp);
-    }
+  //CHEFS_LAZY_HISTORY=0 loads HISTFILE up front, otherwise it is deferred until idle or first use.
+  chefs_history_listen(session, mirror_history);
+  chefs_memory_source(session, "readline", readline_history_bytes);
+  char* lazy = getenv("CHEFS_LAZY_HISTORY");
+  if (lazy != NULL && strcmp(lazy, "0") == 0) {
+    load_history();
+  } else {
+    rl_event_hook = history_idle_hook;
+    rl_bind_keyseq("\\e[A", lazy_previous_history);
+    rl_bind_keyseq("\\eOA", lazy_previous_history);
+    rl_bind_keyseq("\\C-p", lazy_previous_history);
+    rl_bind_keyseq("\\e[B", lazy_next_history);
+    rl_bind_keyseq("\\eOB", lazy_next_history);
+    rl_bind_keyseq("\\C-n", lazy_next_history);
+    rl_bind_keyseq("\\C-r", lazy_reverse_search_history);
+    rl_bind_keyseq("\\C-s", lazy_forward_search_history);
   }
+}
+#endif
 
-  // Welcome message
-  printf("\n\033[1;36m");
-  printf("========================================================\n");
-  printf("       Welcome to ChefsShell - Handcrafted Mini Shell        \n");
-  printf("========================================================\n");
-  printf("\033[0m\n");
-  printf("\033[1;32mA lightweight Unix shell written in C\033[0m\n");
-  printf("\033[2mType '\033[1;33mhelp\033[0;2m' to see available commands\033[0m\n");
-  printf("\033[1;90m---------------------------\033[0m\n");
-  printf("\033[2mType '\033[1;33mfetchme\033[0;2m' to know about me\033[0m\n\n");
-
-  while (1) {
-    char* line = readline("$ ");
-    if (line == NULL) {
-      printf("\n");
-      break;  // EOF
-    }
-    if (strlen(line) > 0) {
-      add_history(line);
-    }
-
-    line[strcspn(line, "\n")] = 0;  // Remove newline character
-
-    // EXIT
-    if (strcmp(line, "exit 0") == 0 || strcmp(line, "exit 1") == 0 || strcmp(line, "exit") == 0) {
-      save_history_to_file(histfile);
-      exit(0);
-    }
-
-    // ECHO
-    else if (strncmp(line, "echo", 4) == 0) {
-      char* args2[20];
-      int argc_echo = 0;
-      tokenize(line + 5, args2, &argc_echo);
-
-      // Check if there's a pipe - if so, skip this handler and let pipeline handle it
-      int has_pipe = 0;
-      for (int r = 0; r < argc_echo; r++) {
-        if (strcmp(args2[r], "|") == 0) {
-          has_pipe = 1;
-          break;
-        }
-      }
-      
-      if (!has_pipe) {
-        // Handle echo without pipeline
-        int redirect_stdout_index = -1;
-        int redirect_stderr_index = -1;
-        int append_stdout_index = -1;
-        int append_stderr_index = -1;
-        char* append_stderr_file = NULL;
-        char* append_stdout_file = NULL;
-        char* outfile = NULL;
-        char* errfile = NULL;
-
-        for (int r = 0; r < argc_echo; r++) {
-          if (strcmp(args2[r], ">") == 0 || strcmp(args2[r], "1>") == 0) {
-            redirect_stdout_index = r;
-            outfile = args2[r + 1];
-            break;
-          } else if (strcmp(args2[r], "2>") == 0) {
-          redirect_stderr_index = r;
-          errfile = args2[r + 1];
-          break;
-        } else if (strcmp(args2[r], "2>>") == 0) {
-          append_stderr_index = r;
-          append_stderr_file = args2[r + 1];
-          break;
-        } else if (strcmp(args2[r], ">>") == 0 || strcmp(args2[r], "1>>") == 0) {
-          append_stdout_index = r;
-          append_stdout_file = args2[r + 1];
-          break;
-        }
-      }
-
-      // Prepare for temporary redirection
-      int saved_stdout = -1;
-      int fd = -1;
-
-      if (redirect_stdout_index != -1) {
-        fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (fd < 0) {
-          perror("open");
-          continue;
-        }
-
-        saved_stdout = dup(1);
-
-        dup2(fd, 1);
-        close(fd);
-
-        args2[redirect_stdout_index] = NULL;
-        argc_echo = redirect_stdout_index;
-      }
-
-      if (redirect_stderr_index != -1) {
-        int fd_err = open(errfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (fd_err < 0) {
-          perror("open");
-          continue;
-        }
-
-        saved_stdout = dup(1);
-
-        dup2(fd_err, 2);
-        close(fd_err);
-
-        args2[redirect_stderr_index] = NULL;
-        argc_echo = redirect_stderr_index;
-      }
-      if (append_stdout_index != -1) {
-        fd = open(append_stdout_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-        if (fd < 0) {
-          perror("open");
-          continue;
-        }
-
-        saved_stdout = dup(1);
-
-        dup2(fd, 1);
-        close(fd);
-
-        args2[append_stdout_index] = NULL;
-        argc_echo = append_stdout_index;
-      }
-      if (append_stderr_index != -1) {
-        int fd_err = open(append_stderr_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-        if (fd_err < 0) {
-          perror("open");
-          continue;
-        }
-
-        saved_stdout = dup(1);
+// The native editor (lineedit.c) reads the shell's history list directly
+size_t native_history_count(void) { return chefs_history_count(session); }
 
-        dup2(fd_err, 2);
-        close(fd_err);
+const char* native_history_get(size_t i) { return chefs_history_get(session, i); }
 
-        args2[append_stderr_index] = NULL;
-        argc_echo = append_stderr_index;
-      }
+void native_history_load(void) { chefs_history_load(session); }
 
-      for (int k = 0; k < argc_echo; k++) {
-        printf("%s", args2[k]);
-        if (k < argc_echo - 1) printf(" ");
-      }
-      printf("\n");
-
-      if (saved_stdout != -1) {
-        dup2(saved_stdout, 1);
-        close(saved_stdout);
-      }
+const line_editor native_editor = {
+    complete_word, native_history_count, native_history_get, native_history_load, prefetch_first_word,
+};
 
-        continue;
-      } 
-    } 
+int use_native_editor = 0;
 
-    /*
-    else if (strncmp(line, "echo ", 5) == 0) {
-      printf("%s\n", line + 5);
-      continue;
-    } else if (strcmp(line, "echo") == 0) {
-      printf("\n");
-      continue;
-    }
-    */
-    // TYPE
-    else if (strncmp(line, "type ", 5) == 0) {
-      char* cmd = line + 5;
-      // check for builtins
-      if (strcmp(cmd, "echo") == 0 || strcmp(cmd, "exit") == 0 || strcmp(cmd, "type") == 0 ||
-          strcmp(cmd, "pwd") == 0 || strncmp(cmd, "cd", 2) == 0 ||
-          strcmp(cmd, "github") == 0 || strcmp(cmd, "help") == 0 || strcmp(cmd, "linkedin") == 0 ||
-          strcmp(cmd, "fetchme") == 0 || strcmp(cmd, "resume") == 0 || strcmp(cmd, "youtube") == 0 || strncmp(cmd, "history", 7) == 0) {
-        printf("%s is a shell builtin\n", cmd);
-        continue;
-      }
-      // check for executable in PATH
-      else {
-        char* path = getenv("PATH");
-        if (path == NULL) path = "";
-        char path_cpy[1000];
-        strncpy(path_cpy, path, sizeof(path_cpy));
-        path_cpy[sizeof(path_cpy) - 1] = '\0';  // Ensure null-termination
-
-        char* dir = strtok(path_cpy, ":");
-
-        int found = 0;
-
-        while (dir != NULL) {
-          char fullpath[1200];
-          snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, cmd);
-
-          if (access(fullpath, X_OK) == 0) {
-            printf("%s is %s\n", cmd, fullpath);
-            found = 1;
-            break;
-          }
-          dir = strtok(NULL, ":");
-        }
-        if (!found) {
-          printf("%s: not found\n", cmd);
-        }
-        continue;
-      }
-    }
-
-    // PWD
-    else if (strncmp(line, "pwd", 3) == 0) {
-      char cwd[1000];
-      if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s\n", cwd);
-      } else {
-        perror("getcwd() error");
-      }
-      continue;
+char* read_line(const char* prompt) {
+#ifndef CHEFS_NO_READLINE
+  if (!use_native_editor) return readline(prompt);
+#endif
+  return line_edit(&native_editor, prompt);
+}
 
+// How the next line of a multi-line command joins the text before it in its
+// history entry, the way bash's cmdhist does it: a newline inside quotes or a
+// here-document, where it is part of the command; nothing after a trailing
+// backslash, which is dropped; a space after a word or operator that takes
+// the next line as its operand (then, do, |, &&, ...); else "; "
+const char* history_separator(char* entry) {
+  char quote = 0;
+  int here_doc = 0, escaped = 0;
+  for (const char* p = entry; *p; p++) {
+    if (escaped) {
+      escaped = 0;
+    } else if (*p == '\\' && quote != '\'') {
+      escaped = 1;
+    } else if (quote) {
+      if (*p == quote) quote = 0;
+    } else if (*p == '\'' || *p == '"') {
+      quote = *p;
+    } else if (*p == '#' && (p == entry || strchr(" \t\n;&|(", p[-1]))) {
+      p += strcspn(p, "\n") - 1;
+    } else if (p[0] == '<' && p[1] == '<' && p[2] != '<') {
+      here_doc = 1;
     }
+  }
+  if (quote || here_doc) return "\n";
+  size_t len = strlen(entry);
+  if (escaped) {
+    entry[len - 1] = '\0';
+    return "";
+  }
+  while (len > 0 && (entry[len - 1] == ' ' || entry[len - 1] == '\t')) entry[--len] = '\0';
+  static const char* const operands[] = {"then", "do", "else", "in", "{", "(", ")", "|", "&&", "||", ";", "&"};
+  for (size_t i = 0; i < sizeof(operands) / sizeof(operands[0]); i++) {
+    size_t n = strlen(operands[i]);
+    if (len < n || strcmp(entry + len - n, operands[i]) != 0) continue;
+    // A word must stand alone: "do", not "undo"
+    if (!strchr("{()|&;", operands[i][0]) && len > n && !strchr(" \t\n;&|", entry[len - n - 1])) continue;
+    return " ";
+  }
+  return len == 0 ? "" : "; ";
+}
 
-    // HELP
-    else if (strcmp(line, "help") == 0) {
-      printf("\n\033[1;36m ChefsShell - All available commands\033[0m\n");
-      printf("\033[2m════════════════════════════════════════════════════════════\033[0m\n\n");
-      
-      printf("\033[1;33mcd\033[0m [directory]\n");
-      printf("  Change the current working directory\n");
-      printf("  Examples: cd /home, cd .., cd ~\n\n");
-
-      printf("\033[1;33mmkdir\033[0m [directory]\n");
-      printf("  Create a new directory\n");
-      printf("  Examples: mkdir new_folder, mkdir -p parent/child\n\n");
-      
-      printf("\033[1;33mecho\033[0m [text...]\n");
-      printf("  Display a line of text\n");
-      printf("  Supports output redirection (>, >>, 2>)\n");
-      printf("  Example: echo Hello World\n\n");
-      
-      printf("\033[1;33mexit\033[0m [code]\n");
-      printf("  Exit the shell\n");
-      printf("  Example: exit 0\n\n");
-      
-      printf("\033[1;33mgithub\033[0m\n");
-      printf("  Opens my GitHub profile link\n\n");
-      
-      printf("\033[1;33mhelp\033[0m\n");
-      printf("  Display this help message\n\n");
-      
-      printf("\033[1;33mhistory\033[0m [n]\n");
-      printf("  Display command history\n");
-      printf("  Options:\n");
-      printf("    history        - Show all history\n");
-      printf("    history n      - Show last n commands\n");
-      printf("    history -a file - Append new history to file\n");
-      printf("    history -w file - Write all history to file\n");
-      printf("    history -r file - Read history from file\n\n");
-      
-      printf("\033[1;33mlinkedin\033[0m\n");
-      printf("  Opens my LinkedIn profile link\n\n");
-      
-      printf("\033[1;33mfetchme\033[0m\n");
-      printf("  Display system and my information\n\n");
-      
-      printf("\033[1;33mpwd\033[0m\n");
-      printf("  Print current working directory\n\n");
-      
-      printf("\033[1;33mresume\033[0m\n");
-      printf("  View resume on Google Drive\n\n");
-      
-      printf("\033[1;33mtype\033[0m <command>\n");
-      printf("  Display command type (builtin or path to executable)\n");
-      printf("  Example: type ls\n\n");
-      
-      printf("\033[1;33myoutube\033[0m\n");
-      printf("  Opens my YouTube channel link\n\n");
-      
-      printf("\033[1;32mExternal Commands:\033[0m\n");
-      printf("  Any executable in $PATH can be run\n");
-      printf("  Examples: ls, cat, grep, etc.\n\n");
-      
-      continue;
-    }
+int main(int argc, char* argv[]) {
+  struct timespec startup;
+  clock_gettime(CLOCK_MONOTONIC, &startup);
 
-    // GITHUB
-    else if (strcmp(line, "github") == 0) {
-      printf("\n\033[1;36m GitHub Profile\033[0m\n");
-      printf("\033[4;34mhttps://github.com/yogesh-rana-2301\033[0m\n\n");
-      continue;
-    }
+  // Flush after every printf
+  setbuf(stdout, NULL);
 
-    // LINKEDIN 
-    else if (strcmp(line, "linkedin") == 0) {
-      printf("\n\033[1;36m  LinkedIn Profile\033[0m\n");
-      printf("\033[4;34mhttps://linkedin.com/in/yogesh-rana-sde\033[0m\n\n");
-      continue;
-    }
+  // chefs_shell script.sh [args...] runs the script without the interactive setup
+  if (argc > 1) {
+    session = chefs_session_new(argv[1]);
+    return chefs_run_script(session, argv[1], argv + 2, argc - 2);
+  }
+  session = chefs_session_new(NULL);
+
+  //Loading history from HISTFILE as real OS shell does, same as history -r done later.
+  chefs_history_file(session, getenv("HISTFILE"));
+
+  chefs_memory_source(session, "completion", listing_bytes);
+
+  // CHEFS_EDITOR=native uses the built-in line editor instead of readline
+  char* editor = getenv("CHEFS_EDITOR");
+#ifdef CHEFS_NO_READLINE
+  (void)editor;
+  use_native_editor = 1;
+#else
+  use_native_editor = editor != NULL && strcmp(editor, "native") == 0;
+  if (!use_native_editor) setup_readline();
+#endif
+  if (use_native_editor) {
+    setlocale(LC_CTYPE, "");  // character widths for cursor movement
+    char* lazy = getenv("CHEFS_LAZY_HISTORY");
+    if (lazy != NULL && strcmp(lazy, "0") == 0) native_history_load();
+  }
 
-    // RESUME 
-    else if (strcmp(line, "resume") == 0) {
-      printf("\n\033[1;36m Resume\033[0m\n");
-      printf("\033[4;34mhttps://bit.ly/3LZn2Ia\033[0m\n\n");
-      continue;
-    }
+  // Welcome message, sent as a single write
+  static const char banner[] =
+      "\n\033[1;36m"
+      "========================================================\n"
+      "       Welcome to ChefsShell - Handcrafted Mini Shell        \n"
+      "========================================================\n"
+      "\033[0m\n"
+      "\033[1;32mA lightweight Unix shell written in C\033[0m\n"
+      "\033[2mType '\033[1;33mhelp\033[0;2m' to see available commands\033[0m\n"
+      "\033[1;90m---------------------------\033[0m\n"
+      "\033[2mType '\033[1;33mfetchme\033[0;2m' to know about me\033[0m\n\n";
+  if (write(STDOUT_FILENO, banner, sizeof(banner) - 1) < 0) {
+    perror("write");
+  }
 
-    // YOUTUBE 
-    else if (strcmp(line, "youtube") == 0) {
-      printf("\n\033[1;36m YouTube Channel\033[0m\n");
-      printf("\033[4;34mhttps://youtube.com/@SameerRana-2004\033[0m\n\n");
-      continue;
-    }
+  // CHEFS_STARTUP_TIME=1 reports the time from main() to the first prompt on stderr
+  const char* startup_time = getenv("CHEFS_STARTUP_TIME");
+  if (startup_time && *startup_time && strcmp(startup_time, "0") != 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - startup.tv_sec) * 1e3 + (now.tv_nsec - startup.tv_nsec) / 1e6;
+    fprintf(stderr, "startup: %.3f ms\n", ms);
+  }
 
-    // FETCHPROFILE - Personal info display
-    else if (strcmp(line, "fetchme") == 0) {
-      // Get system info
-      char hostname[256];
-      gethostname(hostname, sizeof(hostname));
-      
-      char* user = getenv("USER");
-      if (user == NULL) user = "user";
-      
+  while (1) {
+    char* line = read_line("$ ");
+    if (line == NULL) {
       printf("\n");
-      
-      // Displaying Moebius Triangle logo on left, info on right
-      printf("   \033[1;33m           ____\033[0m                      \033[1;32m%s\033[0m@\033[1;32m%s\033[0m\n", user, hostname);
-      printf("   \033[1;33m          /   /\\\033[0m                      \033[1;90m---------------------------\033[0m\n");
-      printf("   \033[1;33m         /___/  \\\033[0m                     \033[1;36mName\033[0m:     Yogesh Rana\n");
-      printf("   \033[1;33m        /   /\\  /\\\033[0m                    \033[1;36mMajor\033[0m:    Computer Science (CS)\n");
-      printf("   \033[1;33m       /   /  \\/  \\\033[0m                   \033[1;36mStack\033[0m:    C++, Python, Web Dev\n");
-      printf("   \033[1;33m      /   /   /\\   \\\033[0m                  \033[1;36mFocus\033[0m:    DSA & System Design\n");
-      printf("   \033[1;36m     /   /   /  \\   \\\033[0m                 \033[1;36mGoal\033[0m:     Money\n");
-      printf("   \033[1;36m    /   /   /\\   \\   \\\033[0m                \033[1;36mLoc\033[0m:      Chandigarh, India\n");
-      printf("   \033[1;36m   /   /   /  \\   \\   \\\033[0m               \033[1;36mStatus\033[0m:   Open to Work\n");
-      printf("   \033[1;34m  /___/___/____\\   \\   \\\033[0m              \033[1;36mShell\033[0m:    ChefsShell v1.0\n");
-      printf("   \033[1;34m /   /          \\   \\  /\\\033[0m             \033[1;36mTerminal\033[0m: xterm-256color\n");
-      printf("   \033[1;34m/___/____________\\___\\/  \\\033[0m            \033[1;36mOS\033[0m:       Windows 11\n");
-      printf("   \033[1;35m\\   \\             \\   \\  /\033[0m            \033[1;36mCPU\033[0m:      Intel Core i7\n");
-      printf("   \033[1;35m \\___\\_____________\\___\\/\033[0m             \033[1;36mGPU\033[0m:      AMD\n");
-
-    printf("\n");
-    
-    // decoration color pallete
-    printf("                                         \033[1;90m█\033[0m\033[1;91m█\033[0m\033[1;92m█\033[0m\033[1;93m█\033[0m\033[1;94m█\033[0m\033[1;95m█\033[0m\033[1;96m█\033[0m\033[1;97m█\033[0m\n");
-    printf("\n");
-    
-    // Resume Box
-    printf("   \033[1;36m╔════════════════════════════════════╗\033[0m\n");
-    printf("   \033[1;36m║\033[0m \033[1;37m Resume:      \033[0m                   \033[1;36m  ║\033[0m\n");
-    printf("   \033[1;36m╠════════════════════════════════════╣\033[0m\n");
-    printf("   \033[1;36m║\033[0m  \033[4;34mhttps://bit.ly/3LZn2Ia\033[0m  \033[1;36m          ║\033[0m\n");
-    printf("   \033[1;36m╚════════════════════════════════════╝\033[0m\n\n");
-      
-      continue;
-    }
-
-    // absolute path handling for cd
-    else if (strncmp(line, "cd", 2) == 0) {
-      if (strcmp(line, "cd") == 0) {
-        continue;
-      }
-      if (line[2] != ' ') {
-        continue;
-      }
-      char* path = line + 3;
-      if (path[0] == '/') {
-        if (chdir(path) != 0) {
-          printf("cd: %s: No such file or directory\n", path);
-        }
-        continue;
-      }
-      // home directory handling for cd
-      if (path[0] == '~') {
-        char* home = getenv("HOME");
-        if (home == NULL) {
-          printf("cd: Home is not set\n");
-          continue;
-        }
-        if (path[1] == '\0') {
-          if (chdir(home) != 0) {
-            printf("cd: %s: No such file or directory\n", home);
-          }
-          continue;
-        }
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", home, path + 2);
-        if (chdir(fullpath) != 0) {
-          printf("cd: %s: No such file or directory\n", fullpath);
-        }
-        continue;
-      }
-
-      // relative path handling for cd
-      if (chdir(path) != 0) {
-        printf("cd: %s: No such file or directory\n", path);
-      }
-      continue;
-    }
-
-    // HISTORY
-    else if (strncmp(line, "history", 7) == 0) {
-
-      // add history to a file (append basically )
-      if (strncmp(line, "history -a ", 11) == 0) {
-        char* filepath = line + 11;
-
-        FILE* fp = fopen(filepath, "a");
-        if (!fp) {
-          printf("history: cannot open %s\n", filepath);
-          continue;
-        }
-
-        int total = history_length;
-        for (int i = last_appended_index; i < total; i++) {
-          HIST_ENTRY* entry = history_get(i + 1);
-          if (entry) {
-            fprintf(fp, "%s\n", entry->line);
-          }
-        }
-        
-        last_appended_index = total;
-
-        fclose(fp);
-        continue;
-      }
-
-      // write history to file
-      if (strncmp(line, "history -w ", 11) == 0) {
-        char* filepath = line + 11;
-
-        FILE* fp = fopen(filepath, "w");
-        if (!fp) {
-          printf("history: cannot open %s\n", filepath);
-          continue;
-        }
-
-        int total = history_length;
-        for (int i = 0; i < total; i++) {
-          HIST_ENTRY* entry = history_get(i + 1);
-          if (entry) {
-            fprintf(fp, "%s\n", entry->line);
-          }
-        }
-
-        fclose(fp);
-        continue;
-      }
-
-      // Case: history -r <file>
-      if (strncmp(line, "history -r ", 11) == 0) {
-        char* filepath = line + 11;
-
-        FILE* fp = fopen(filepath, "r");
-        if (!fp) {
-          printf("history: cannot open %s\n", filepath);
-          continue;
-        }
-
-        char buf[1024];
-        while (fgets(buf, sizeof(buf), fp)) {
-          // remove newline
-          buf[strcspn(buf, "\n")] = 0;
-
-          // skip empty lines
-          if (strlen(buf) == 0) continue;
-
-          add_history(buf);
-        }
-
-        fclose(fp);
-        continue;
-      }
-
-      int limit = -1;  // -1 means show all
-
-    
-      if (strlen(line) > 7 && line[7] == ' ' && line[8] >= '0' && line[8] <= '9') {
-        char* arg = line + 8;
-        limit = atoi(arg);
-      }
-
-      int total = history_length;
-      
-      // Calculate starting index
-      int start = 0;
-      if (limit > 0 && limit < total) {
-        start = total - limit;
-      }
-
-      for (int i = start; i < total; i++) {
-        HIST_ENTRY* entry = history_get(i + 1);
-        if (entry) {
-          printf("%5d  %s\n", i + 1, entry->line);
-        }
-      }
-      continue;
-    }
-
-    // EXTERNAL COMMANDS FOR RUNNIGN A PROGRAM
-    {
-      char* args[20];
-      int argc2 = 0;
-      tokenize(line, args, &argc2);
-      if (argc2 == 0) {
-        continue;
-      }
-
-      // Check for pipelines - count how many pipes we have
-      int pipe_count = 0;
-      int pipe_positions[10];
-      for (int k = 0; k < argc2; k++) {
-        if (strcmp(args[k], "|") == 0) {
-          pipe_positions[pipe_count++] = k;
-        }
-      }
-
-      // Handle pipeline 
-      if (pipe_count > 0) {
-        // Split into commands
-        char* commands[11][20];  // Max 11 commands (10 pipes + 1)
-        int cmd_count = pipe_count + 1;
-        
-        // First command
-        int start = 0;
-        for (int i = 0; i < pipe_positions[0]; i++) {
-          commands[0][i] = args[i];
-        }
-        commands[0][pipe_positions[0]] = NULL;
-        
-        // Middle commands
-        for (int c = 1; c < pipe_count; c++) {
-          start = pipe_positions[c - 1] + 1;
-          int idx = 0;
-          for (int i = start; i < pipe_positions[c]; i++) {
-            commands[c][idx++] = args[i];
-          }
-          commands[c][idx] = NULL;
-        }
-        
-        // Last command
-        start = pipe_positions[pipe_count - 1] + 1;
-        int idx = 0;
-        for (int i = start; i < argc2; i++) {
-          commands[cmd_count - 1][idx++] = args[i];
-        }
-        commands[cmd_count - 1][idx] = NULL;
-
-        // Check which commands are built-ins and find executables for external ones
-        int cmd_is_builtin[11];
-        char exec_paths[11][1200];
-        
-        for (int c = 0; c < cmd_count; c++) {
-          cmd_is_builtin[c] = is_builtin(commands[c][0]);
-          
-          if (!cmd_is_builtin[c]) {
-            
-            char* path = getenv("PATH");
-            if (path == NULL) path = "";
-            char path_cpy[1000];
-            strncpy(path_cpy, path, sizeof(path_cpy));
-            path_cpy[sizeof(path_cpy) - 1] = '\0';
-            
-            int found = 0;
-            char* dir = strtok(path_cpy, ":");
-            while (dir != NULL) {
-              snprintf(exec_paths[c], sizeof(exec_paths[c]), "%s/%s", dir, commands[c][0]);
-              if (access(exec_paths[c], X_OK) == 0) {
-                found = 1;
-                break;
-              }
-              dir = strtok(NULL, ":");
-            }
-            
-            if (!found) {
-              printf("%s: command not found\n", commands[c][0]);
-              goto pipeline_cleanup;
-            }
-          }
-        }
-
-        // Create pipes
-        int pipes[10][2];  // Max 10 pipes for 11 commands
-        for (int i = 0; i < pipe_count; i++) {
-          if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            // Close already created pipes
-            for (int j = 0; j < i; j++) {
-              close(pipes[j][0]);
-              close(pipes[j][1]);
-            }
-            goto pipeline_cleanup;
-          }
-        }
-
-        pid_t pids[11];
-        for (int c = 0; c < cmd_count; c++) {
-          pids[c] = fork();
-          
-          if (pids[c] < 0) {
-            perror("fork");
-            // Close all pipes
-            for (int i = 0; i < pipe_count; i++) {
-              close(pipes[i][0]);
-              close(pipes[i][1]);
-            }
-            for (int j = 0; j < c; j++) {
-              waitpid(pids[j], NULL, 0);
-            }
-            goto pipeline_cleanup;
-          }
-          
-          if (pids[c] == 0) {
-            //  read from previous pipe (except first command)
-            if (c > 0) {
-              dup2(pipes[c - 1][0], 0);
-            }
-            
-            // write to next pipe (except last command)
-            if (c < cmd_count - 1) {
-              dup2(pipes[c][1], 1);
-            }
-            
-            // Close all pipe file descriptors in child
-            for (int i = 0; i < pipe_count; i++) {
-              close(pipes[i][0]);
-              close(pipes[i][1]);
-            }
-            
-            if (cmd_is_builtin[c]) {
-              execute_builtin_in_child(commands[c]);
-              exit(0);
-            } else {
-              execv(exec_paths[c], commands[c]);
-              perror("execv failed");
-              exit(1);
-            }
-          }
-        }
-        
-        for (int i = 0; i < pipe_count; i++) {
-          close(pipes[i][0]);
-          close(pipes[i][1]);
-        }
-        
-        for (int c = 0; c < cmd_count; c++) {
-          waitpid(pids[c], NULL, 0);
-        }
-        
-        pipeline_cleanup:
-        continue;
-      }
-
-      /* OLD TWO-COMMAND PIPELINE CODE
-      // Check for pipeline
-      int pipe_index = -1;
-      for (int k = 0; k < argc2; k++) {
-        if (strcmp(args[k], "|") == 0) {
-          pipe_index = k;
-          break;
-        }
-      }
-
-      // Handle pipeline with two commands
-      if (pipe_index != -1) {
-        // Split commands
-        char* cmd1_args[20];
-        char* cmd2_args[20];
-
-        for (int i = 0; i < pipe_index; i++) {
-          cmd1_args[i] = args[i];
-        }
-        cmd1_args[pipe_index] = NULL;
-
-        int cmd2_argc = 0;
-        for (int i = pipe_index + 1; i < argc2; i++) {
-          cmd2_args[cmd2_argc++] = args[i];
-        }
-        cmd2_args[cmd2_argc] = NULL;
-
-        // Check if commands are built-ins or external
-        int cmd1_is_builtin = is_builtin(cmd1_args[0]);
-        int cmd2_is_builtin = is_builtin(cmd2_args[0]);
-
-        // Find external executables if needed
-        char exec_path1[1200] = {0};
-        char exec_path2[1200] = {0};
-        
-        if (!cmd1_is_builtin) {
-          char* path = getenv("PATH");
-          if (path == NULL) path = "";
-          char path_cpy1[1000];
-          strncpy(path_cpy1, path, sizeof(path_cpy1));
-          path_cpy1[sizeof(path_cpy1) - 1] = '\0';
-          
-          int found1 = 0;
-          char* dir = strtok(path_cpy1, ":");
-          while (dir != NULL) {
-            snprintf(exec_path1, sizeof(exec_path1), "%s/%s", dir, cmd1_args[0]);
-            if (access(exec_path1, X_OK) == 0) {
-              found1 = 1;
-              break;
-            }
-            dir = strtok(NULL, ":");
-          }
-          
-          if (!found1) {
-            printf("%s: command not found\n", cmd1_args[0]);
-            continue;
-          }
-        }
-
-        if (!cmd2_is_builtin) {
-          char* path = getenv("PATH");
-          if (path == NULL) path = "";
-          char path_cpy2[1000];
-          strncpy(path_cpy2, path, sizeof(path_cpy2));
-          path_cpy2[sizeof(path_cpy2) - 1] = '\0';
-          
-          int found2 = 0;
-          char* dir = strtok(path_cpy2, ":");
-          while (dir != NULL) {
-            snprintf(exec_path2, sizeof(exec_path2), "%s/%s", dir, cmd2_args[0]);
-            if (access(exec_path2, X_OK) == 0) {
-              found2 = 1;
-              break;
-            }
-            dir = strtok(NULL, ":");
-          }
-          
-          if (!found2) {
-            printf("%s: command not found\n", cmd2_args[0]);
-            continue;
-          }
-        }
-
-        // Create pipe
-        int pipefd[2];
-        if (pipe(pipefd) == -1) {
-          perror("pipe");
-          continue;
-        }
-
-        // Fork first command
-        pid_t pid1 = fork();
-        if (pid1 < 0) {
-          perror("fork");
-          close(pipefd[0]);
-          close(pipefd[1]);
-          continue;
-        }
-
-        if (pid1 == 0) {
-          // First child: write to pipe
-          close(pipefd[0]);    // Close read end
-          dup2(pipefd[1], 1);  // Redirect stdout to pipe write end
-          close(pipefd[1]);
-          
-          if (cmd1_is_builtin) {
-            execute_builtin_in_child(cmd1_args);
-            exit(0);
-          } else {
-            execv(exec_path1, cmd1_args);
-            perror("execv failed");
-            exit(1);
-          }
-        }
-
-        // Fork second command
-        pid_t pid2 = fork();
-        if (pid2 < 0) {
-          perror("fork");
-          close(pipefd[0]);
-          close(pipefd[1]);
-          waitpid(pid1, NULL, 0);
-          continue;
-        }
-
-        if (pid2 == 0) {
-          // Second child: read from pipe
-          close(pipefd[1]);    // Close write end
-          dup2(pipefd[0], 0);  // Redirect stdin to pipe read end
-          close(pipefd[0]);
-          
-          if (cmd2_is_builtin) {
-            execute_builtin_in_child(cmd2_args);
-            exit(0);
-          } else {
-            execv(exec_path2, cmd2_args);
-            perror("execv failed");
-            exit(1);
-          }
-        }
-
-        // Parent: close both ends and wait for both children
-        close(pipefd[0]);
-        close(pipefd[1]);
-
-        int status1, status2;
-        waitpid(pid1, &status1, 0);
-        waitpid(pid2, &status2, 0);
-
-        continue;
-      }
-      */
-
-      // Alternative tokenization
-      /*
-      char *token = strtok(line, " ");
-      int i = 0;
-
-      while (token != NULL && i < 19) {
-        args[i++] = token;
-        token = strtok(NULL, " ");
-      }
-      args[i] = NULL;
-
-      if (args[0] == NULL) {
-        continue;  // empty command
-      }
-      */
-
-      // Redirect Stdout and stderr if needed
-      int redirect_stdout_index = -1;
-      int redirect_stderr_index = -1;
-      int append_stdout_index = -1;
-      int append_stderr_index = -1;
-      char* append_stdout_file = NULL;
-      char* append_stderr_file = NULL;
-      char* filename = NULL;
-      char* errfile = NULL;
-      for (int k = 0; k < argc2; k++) {
-        if (strcmp(args[k], ">") == 0 || strcmp(args[k], "1>") == 0) {
-          redirect_stdout_index = k;
-          filename = args[k + 1];
-          break;
-        } else if (strcmp(args[k], "2>") == 0) {
-          redirect_stderr_index = k;
-          errfile = args[k + 1];
-          break;
-        } else if (strcmp(args[k], ">>") == 0 || strcmp(args[k], "1>>") == 0) {
-          append_stdout_index = k;
-          append_stdout_file = args[k + 1];
-          break;
-        } else if (strcmp(args[k], "2>>") == 0) {
-          append_stderr_index = k;
-          append_stderr_file = args[k + 1];
-          break;
-        }
-      }
-      if (redirect_stdout_index != -1) {
-        args[redirect_stdout_index] = NULL;
-      }
-      if (redirect_stderr_index != -1) {
-        args[redirect_stderr_index] = NULL;
-      }
-      if (append_stdout_index != -1) {
-        args[append_stdout_index] = NULL;
-      }
-      if (append_stderr_index != -1) {
-        args[append_stderr_index] = NULL;
-      }
-      // Find the command in PATH
-      char* cmd = args[0];
-
-      // Search PATH for executable
-      char* path = getenv("PATH");
-      if (path == NULL) path = "";
-
-      char path_cpy[1000];
-      strncpy(path_cpy, path, sizeof(path_cpy));
-      path_cpy[sizeof(path_cpy) - 1] = '\0';
-
-      char* dir = strtok(path_cpy, ":");
-      int found = 0;
-
-      char exec_path[1200];
-
-      while (dir != NULL) {
-        snprintf(exec_path, sizeof(exec_path), "%s/%s", dir, cmd);
-
-        if (access(exec_path, X_OK) == 0) {
-          found = 1;
-          break;
-        }
-        dir = strtok(NULL, ":");
-      }
-
-      if (!found) {
-        printf("%s: command not found\n", cmd);
-        continue;
-      }
-
-      // Run the executable
-      pid_t pid = fork();
-
-      if (pid < 0) {
-        perror("fork failed");
-      } else if (pid == 0) {
-        // Child process
-        if (redirect_stdout_index != -1) {
-          int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-          if (fd < 0) {
-            perror("open");
-            exit(1);
-          }
-          dup2(fd, 1);
-          close(fd);
-        }
-        if (redirect_stderr_index != -1) {
-          int fd = open(errfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-          if (fd < 0) {
-            perror("open");
-            exit(1);
-          }
-          dup2(fd, 2);
-          close(fd);
-        }
-        if (append_stdout_index != -1) {
-          int fd = open(append_stdout_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-          if (fd < 0) {
-            perror("open");
-            exit(1);
-          }
-          dup2(fd, 1);
-          close(fd);
-        }
-        if (append_stderr_index != -1) {
-          int fd = open(append_stderr_file, O_WRONLY | O_CREAT | O_APPEND, 0666);
-          if (fd < 0) {
-            perror("open");
-            exit(1);
-          }
-          dup2(fd, 2);
-          close(fd);
-        }
-        execv(exec_path, args);
-        perror("execv failed");
-        exit(1);
-      } else {
-        // Parent
-        int status;
-        waitpid(pid, &status, 0);
-      }
-
-      continue;
+      break;  // EOF
     }
-
-    printf("%s: command not found\n", line);
+    // Keep reading with "> " while the command is incomplete (open quote, if
+    // without fi, ...), then add it to history once, joined, before it runs
+    char* entry = strdup(line);
+    int complete = 1;
+    while (chefs_incomplete(session, line)) {
+      char* more = read_line("> ");
+      if (more == NULL) {
+        fprintf(stderr, "chefs_shell: syntax error: unexpected end of file\n");
+        chefs_set_status(session, 2);
+        complete = 0;
+        break;
+      }
+      // A blank line only counts inside quotes or a here-document
+      const char* separator = entry ? history_separator(entry) : "";
+      if (entry && (*more || *separator == '\n')) {
+        size_t entry_len = strlen(entry);
+        char* grown = realloc(entry, entry_len + strlen(separator) + strlen(more) + 1);
+        if (grown) {
+          entry = grown;
+          strcpy(entry + entry_len, separator);
+          strcat(entry, more);
+        }
+      }
+      size_t len = strlen(line);
+      char* joined = realloc(line, len + strlen(more) + 2);
+      if (!joined) {
+        free(more);
+        complete = 0;
+        break;
+      }
+      line = joined;
+      line[len] = '\n';
+      strcpy(line + len + 1, more);
+      free(more);
+    }
+    if (entry && *entry) chefs_history_add(session, entry);
+    free(entry);
+    if (complete) chefs_exec(session, line, STDOUT_FILENO, STDERR_FILENO);
     free(line);
+
+    // Share the new entries with other sessions and pick up theirs
+    chefs_history_save(session);
   }
-  
+
   // Save history before exiting
-  save_history_to_file(histfile);
-  
+  chefs_history_save(session);
+  chefs_session_free(session);
+
   return 0;
 }